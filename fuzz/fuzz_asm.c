@@ -0,0 +1,59 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+// Feeds the input to the hexa_asm parser, and for sources that parse, the optimizer, fixups and
+// code emission too. assembler.c is built with its main renamed, so its functions are declared here.
+
+extern bool optimize;
+extern bool compact;
+
+void init_mnemonics();
+void reset_assembler();
+int parse_source(const char *src);
+size_t optimize_items();
+int apply_fixups();
+uint8_t *emit(uint32_t *size);
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    static bool initialized = false;
+
+    if (!initialized) {
+        init_mnemonics();
+        initialized = true;
+    }
+
+    if (size < 1)
+        return 0;
+
+    // the first byte picks the assembler options so they are fuzzed along with the source
+    char *src = malloc(size);
+
+    if (!src)
+        return 0;
+
+    memcpy(src, data + 1, size - 1);
+    src[size - 1] = '\0';
+
+    optimize = data[0] & 1;
+    compact = data[0] & 2;
+
+    reset_assembler();
+
+    if (parse_source(src) == 0) {
+        if (optimize)
+            optimize_items();
+
+        if (apply_fixups() == 0) {
+            uint32_t code_size;
+
+            free(emit(&code_size));
+        }
+    }
+
+    free(src);
+
+    return 0;
+}
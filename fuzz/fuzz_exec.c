@@ -0,0 +1,75 @@
+#include <stdint.h>
+#include <stddef.h>
+#include "libhexa.h"
+#include "instruction_set.h"
+
+// Runs the input as guest code from one fixed machine state: supervisor mode, interrupts off,
+// every vector pointing at an IRET handler. The state is snapshotted once and each input only
+// pays for the pages it dirtied when it is restored.
+
+#define FUZZ_HANDLER START_ADDR
+#define FUZZ_CODE (START_ADDR + INST_SIZE)
+#define FUZZ_MAX_CODE 0x4000
+#define FUZZ_MAX_STEPS 20000
+#define FUZZ_VECTORS 16
+
+static HexaMachine *machine;
+
+static void ignore_serial(void *user, uint8_t data) {
+    (void)user;
+    (void)data;
+}
+
+static void ignore_exception(void *user, uint16_t core, uint16_t status) {
+    (void)user;
+    (void)core;
+    (void)status;
+}
+
+static HexaMachine *fuzz_machine() {
+    HexaMachine *m = hexa_create(1);
+    HexaCallbacks callbacks = {.serial_out = ignore_serial, .exception = ignore_exception};
+    uint8_t handler[INST_SIZE] = {IRET};
+
+    if (!m)
+        return NULL;
+
+    hexa_set_callbacks(m, &callbacks);
+    hexa_write_memory(m, FUZZ_HANDLER, handler, sizeof(handler));
+
+    for (uint16_t vector = 0; vector < FUZZ_VECTORS; vector++) {
+        uint8_t entry[4] = {0x00, 0x00, FUZZ_HANDLER >> 8, FUZZ_HANDLER & 0xff};
+
+        hexa_write_memory(m, IVT_ADDR + vector * 4, entry, sizeof(entry));
+    }
+
+    hexa_set_reg(m, 0, HEXA_FLAGS, FLAG_INT_DONE);
+    hexa_set_reg(m, 0, HEXA_CS, 0x0000);
+    hexa_set_reg(m, 0, HEXA_PC, FUZZ_CODE);
+    hexa_set_reg(m, 0, HEXA_DS, 0x1000);
+    hexa_set_reg(m, 0, HEXA_ES, 0x2000);
+    hexa_set_reg(m, 0, HEXA_SS, 0x8000);
+    hexa_set_reg(m, 0, HEXA_SP, 0xfffe);
+
+    if (!hexa_snapshot(m)) {
+        hexa_destroy(m);
+
+        return NULL;
+    }
+
+    return m;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    if (!machine && !(machine = fuzz_machine()))
+        return 0;
+
+    if (size > FUZZ_MAX_CODE)
+        size = FUZZ_MAX_CODE;
+
+    hexa_restore(machine);
+    hexa_write_memory(machine, FUZZ_CODE, data, size);
+    hexa_run(machine, FUZZ_MAX_STEPS, NULL);
+
+    return 0;
+}
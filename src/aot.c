@@ -0,0 +1,137 @@
+#include <stdlib.h>
+#include "aot.h"
+#include "debug.h"
+#include "smp.h"
+
+#define MAX_AOT_IMAGES 16
+
+// Images are registered by constructors before main, so the index is never written once cores run
+static const AotImage *aot_images[MAX_AOT_IMAGES];
+static size_t aot_count = 0;
+static const AotEntry **aot_index[PAGE_COUNT];
+static const AotImage *aot_owner[PAGE_COUNT];
+
+void aot_register(const AotImage *image) {
+    if (aot_count == MAX_AOT_IMAGES) {
+        fprintf(stderr, "Too many AOT images, ignoring %s\n", image->name);
+
+        return;
+    }
+
+    aot_images[aot_count++] = image;
+
+    for (uint32_t page = image->addr >> PAGE_SHIFT; page <= ((image->addr + image->size - 1) >> PAGE_SHIFT) && page < PAGE_COUNT; page++)
+        aot_owner[page] = image;
+
+    for (size_t i = 0; i < image->entry_count; i++) {
+        const AotEntry *entry = &image->entries[i];
+        uint32_t page = entry->addr >> PAGE_SHIFT;
+
+        if (!aot_index[page] && !(aot_index[page] = calloc(PAGE_SIZE, sizeof(AotEntry *))))
+            return;
+
+        aot_index[page][entry->addr & (PAGE_SIZE - 1)] = entry;
+    }
+}
+
+size_t aot_image_count() {
+    return aot_count;
+}
+
+// A page is compared with the image the first time a block on it runs, then write-watched until it changes
+bool aot_page_valid(Machine *machine, uint32_t page) {
+    const AotImage *image = aot_owner[page];
+
+    if (!image)
+        return false;
+
+    if (machine->aot_pages[page] != AOT_UNCHECKED)
+        return machine->aot_pages[page] == AOT_VALID;
+
+    uint32_t start = page << PAGE_SHIFT;
+    uint32_t end = start + PAGE_SIZE;
+
+    if (start < image->addr)
+        start = image->addr;
+
+    if (end > image->addr + image->size)
+        end = image->addr + image->size;
+
+    if (machine->core_count > 1)
+        device_lock(machine);
+
+    bool match = memcmp(&machine->memory[start], &image->code[start - image->addr], end - start) == 0;
+
+    machine->aot_pages[page] = match ? AOT_VALID : AOT_STALE;
+    machine->watch_pages[page] |= WATCH_WRITE;
+
+    if (machine->core_count > 1)
+        device_unlock(machine);
+
+    return match;
+}
+
+// Reached through the write-watch slow path, so it only runs for pages that were checked
+void aot_invalidate(Machine *machine, uint32_t addr, uint32_t len) {
+    if (len == 0)
+        return;
+
+    uint32_t page = (addr & ADDR_MASK) >> PAGE_SHIFT;
+    uint32_t last = ((addr + len - 1) & ADDR_MASK) >> PAGE_SHIFT;
+
+    while (true) {
+        if (machine->aot_pages[page] != AOT_UNCHECKED) {
+            machine->aot_pages[page] = AOT_UNCHECKED;
+            machine->watch_pages[page] = page_watch_type(machine, page);
+
+            atomic_fetch_add_explicit(&machine->aot_epoch, 1, memory_order_relaxed);
+        }
+
+        if (page == last)
+            break;
+
+        page = (page + 1) % PAGE_COUNT;
+    }
+}
+
+const AotEntry *aot_lookup(CPU *cpu) {
+    Machine *machine = cpu->machine;
+    uint32_t pc = cpu->pc;
+
+    // the reset state and halted cores are rare enough to leave to the interpreter
+    if ((cpu->flags & (FLAG_HALTED | FLAG_RESET)) || pc >= MEM_SIZE || !aot_index[pc >> PAGE_SHIFT])
+        return NULL;
+
+    const AotEntry *entry = aot_index[pc >> PAGE_SHIFT][pc & (PAGE_SIZE - 1)];
+
+    if (!entry || !aot_page_valid(machine, pc >> PAGE_SHIFT) || !aot_page_valid(machine, entry->last >> PAGE_SHIFT))
+        return NULL;
+
+    // blocks stop at anything that can change the mode, so checking both ends covers every instruction
+    if (!page_allowed(cpu, pc, PAGE_X, 0) || !page_allowed(cpu, entry->last, PAGE_X, 0))
+        return NULL;
+
+    return entry;
+}
+
+// Runs compiled blocks until the limit, a fault, or a pc without a valid block; executed counts ticked instructions
+int aot_run(CPU *cpu, uint64_t limit, uint64_t *executed) {
+    AotRun run = {0, limit, 0, 0};
+
+    // compiled blocks test and set the condition bits in flags directly
+    sync_flags(cpu);
+
+    while (run.executed < run.limit && !run.status) {
+        const AotEntry *entry = aot_lookup(cpu);
+
+        if (!entry)
+            break;
+
+        run.epoch = atomic_load_explicit(&cpu->machine->aot_epoch, memory_order_relaxed);
+        entry->block(cpu, &run);
+    }
+
+    *executed = run.executed;
+
+    return run.status;
+}
@@ -0,0 +1,76 @@
+#ifndef AOT_H
+#define AOT_H
+
+#include "common.h"
+#include "cpu.h"
+#include "memory.h"
+#include "instruction_set.h"
+
+#define AOT_UNCHECKED 0
+#define AOT_VALID 1
+#define AOT_STALE 2
+
+typedef struct {
+    uint64_t executed;
+    uint64_t limit;
+    unsigned int epoch;
+    int status;
+} AotRun;
+
+typedef void (*AotBlock)(CPU *cpu, AotRun *run);
+
+// A block covers the bytes from addr up to and including last
+typedef struct {
+    uint32_t addr;
+    uint32_t last;
+    AotBlock block;
+} AotEntry;
+
+// One image compiled by hexa_aot; its blocks are only used while memory still holds the same code
+typedef struct {
+    const char *name;
+    uint32_t addr;
+    uint32_t size;
+    const uint8_t *code;
+    const AotEntry *entries;
+    size_t entry_count;
+} AotImage;
+
+void aot_register(const AotImage *image);
+size_t aot_image_count();
+int aot_run(CPU *cpu, uint64_t limit, uint64_t *executed);
+void aot_invalidate(Machine *machine, uint32_t addr, uint32_t len);
+
+// Called by compiled blocks after every instruction, exactly where the interpreter ticks; false ends the block
+static inline bool aot_retire(CPU *cpu, AotRun *run, uint32_t next) {
+    tick_core(cpu);
+
+    return ++run->executed < run->limit && cpu->pc == next && !(cpu->flags & (FLAG_HALTED | FLAG_RESET))
+        && atomic_load_explicit(&cpu->machine->aot_epoch, memory_order_relaxed) == run->epoch;
+}
+
+// Faults are raised the way step_program raises them, so the caller sees the same status
+static inline void aot_fault(CPU *cpu, AotRun *run, int status) {
+    cpu_exception(cpu, status);
+    run->status = status;
+}
+
+// Instructions without native code go through the interpreter in place; the literal hexa_aot
+// writes has no handler selected yet
+static inline bool aot_interpret(CPU *cpu, AotRun *run, Instruction inst, uint32_t next) {
+    select_form(&inst);
+
+    int status = step_program(cpu, inst);
+
+    sync_flags(cpu);
+
+    if (status) {
+        run->status = status;
+
+        return false;
+    }
+
+    return aot_retire(cpu, run, next);
+}
+
+#endif
@@ -1,442 +1,1557 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 #include <stdint.h>
 #include <ctype.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include "cpu.h"
 #include "instruction_set.h"
+#include "object.h"
+
+#define MNEMONIC_TABLE_SIZE 512
+#define SYMBOL_TABLE_INIT 1024
+
+#define ITEM_INST 0x00
+#define ITEM_DATA 0x01
+#define ITEM_ORG 0x02
+
+#define MAX_JUMP_CHAIN 16
+
+enum TOKENS {
+    TOK_EOF,
+    TOK_NEWLINE,
+    TOK_IDENT,
+    TOK_NUMBER,
+    TOK_CHAR,
+    TOK_HASH,
+    TOK_COMMA,
+    TOK_COLON,
+    TOK_LBRACKET,
+    TOK_RBRACKET,
+    TOK_PLUS,
+    TOK_MINUS,
+    TOK_INVALID
+};
 
-#define MAX_LABELS 256
-#define MAX_LINE_LEN 128
+typedef struct {
+    int type;
+    const char *start;
+    size_t len;
+    uint32_t value;
+    int line;
+} Token;
+
+typedef struct {
+    const char *pos;
+    const char *line_start;
+    const char *tok_line_start;
+    int line;
+    Token tok;
+} Lexer;
+
+typedef struct {
+    const char *name;
+    uint8_t opcode;
+} Mnemonic;
+
+typedef struct {
+    char *name;
+    size_t item;
+    uint32_t addr;
+    bool defined;
+} Symbol;
 
 typedef struct {
-    char name[32];
+    uint8_t kind;
+    Instruction inst;
     uint32_t addr;
-} Label;
+    uint32_t data;
+    uint32_t size;
+    uint32_t target;
+    int line;
+    const char *text;
+    size_t text_len;
+} Item;
 
-Label label_table[MAX_LABELS];
+typedef struct {
+    size_t item;
+    uint8_t operand;
+    uint32_t offset;
+    size_t sym;
+    int line;
+} Fixup;
+
+typedef struct {
+    uint8_t mode;
+    uint16_t value;
+    bool is_reg;
+    bool is_address;
+    bool has_sym;
+    size_t sym;
+} Operand;
+
+const Mnemonic mnemonics[] = {
+    {"MOV", MOV}, {"LD", LD}, {"ST", ST}, {"PUSH", PUSH}, {"POP", POP},
+    {"ADD", ADD}, {"SUB", SUB}, {"INC", INC}, {"DEC", DEC}, {"AND", AND},
+    {"OR", OR}, {"XOR", XOR}, {"NOT", NOT}, {"SHL", SHL}, {"SHR", SHR},
+    {"CMP", CMP}, {"JMP", JMP}, {"JZ", JZ}, {"JNZ", JNZ}, {"JE", JE},
+    {"JNE", JNE}, {"JL", JL}, {"JLE", JLE}, {"JG", JG}, {"JGE", JGE},
+    {"CALL", CALL}, {"RET", RET}, {"IRET", IRET}, {"INT", INT}, {"CLI", CLI},
+    {"STI", STI}, {"NOP", NOP}, {"HLT", HLT}, {"BCOPY", BCOPY}, {"BFILL", BFILL},
+    {"BCMP", BCMP}, {"MUL", MUL}, {"MULH", MULH}, {"IMULH", IMULH}, {"DIV", DIV},
+    {"IDIV", IDIV}, {"MOD", MOD}, {"IMOD", IMOD}, {"CMOVZ", CMOVZ}, {"CMOVNZ", CMOVNZ},
+    {"CMOVE", CMOVE}, {"CMOVNE", CMOVNE}, {"CMOVL", CMOVL}, {"CMOVLE", CMOVLE}, {"CMOVG", CMOVG},
+    {"CMOVGE", CMOVGE}, {"SETZ", SETZ}, {"SETNZ", SETNZ}, {"SETE", SETE}, {"SETNE", SETNE},
+    {"SETL", SETL}, {"SETLE", SETLE}, {"SETG", SETG}, {"SETGE", SETGE}, {"LOOP", LOOP},
+    {"DJNZ", LOOP}, {"XCHG", XCHG}, {"CAS", CAS}
+};
+
+const Mnemonic registers[] = {
+    {"R0", R0}, {"R1", R1}, {"R2", R2}, {"R3", R3}, {"R4", R4}, {"R5", R5}, {"R6", R6}, {"R7", R7},
+    {"CS", CS}, {"SS", SS}, {"DS", DS}, {"US", US}, {"PC", PC}, {"IP", IP}, {"SP", SP}, {"FLAGS", FLAGS},
+    {"ES", ES}, {"ID", ID}
+};
+
+int16_t mnemonic_table[MNEMONIC_TABLE_SIZE];
+uint32_t mnemonic_seed;
+
+Symbol *symbols = NULL;
+size_t symbol_cap = 0;
+size_t symbol_count = 0;
+size_t *symbol_slots = NULL;
+size_t slot_cap = 0;
 size_t label_count = 0;
 
+Item *items = NULL;
+size_t item_count = 0;
+size_t item_cap = 0;
+
+uint8_t *data_pool = NULL;
+size_t data_len = 0;
+size_t data_cap = 0;
+
+Fixup *fixups = NULL;
+size_t fixup_count = 0;
+size_t fixup_cap = 0;
+
 uint32_t origin_addr = START_ADDR;
-uint16_t origin_seg;
-uint16_t origin_off;
 uint32_t pc;
+bool origin_set = false;
+bool object_mode = false;
+bool verbose = false;
+bool optimize = false;
+bool compact = false;
+char *list_file = NULL;
+char *map_file = NULL;
 
 const char* get_file_ext(const char* filename) {
     const char* dot = strrchr(filename, '.');
-    
+
     if (!dot || dot == filename) return "";
-    
+
     return dot + 1;
 }
 
-int quoted_space(const char *str) {
-    int len = strlen(str);
+void *grow(void *ptr, size_t *cap, size_t count, size_t elem_size) {
+    if (count < *cap)
+        return ptr;
 
-    if (len >= 3 && str[0] == '\'' && str[len - 1] == '\'') return 1;
+    size_t new_cap = *cap ? *cap * 2 : 256;
+    void *new_ptr = realloc(ptr, new_cap * elem_size);
 
-    return 0;
+    if (!new_ptr) {
+        printf("Memory allocation failed\n");
+
+        exit(1);
+    }
+
+    *cap = new_cap;
+
+    return new_ptr;
 }
 
-void trim(char *str) {
-    if (quoted_space(str)) return;
-    
-    char *start = str;
-    char *end;
+uint32_t hash_name(const char *str, size_t len, uint32_t seed) {
+    uint32_t hash = 2166136261u ^ seed;
+
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (uint8_t)toupper((unsigned char)str[i]);
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+uint32_t mnemonic_slot(const char *str, size_t len, uint32_t seed) {
+    uint32_t hash = hash_name(str, len, seed);
+
+    return (hash ^ (hash >> 16)) % MNEMONIC_TABLE_SIZE;
+}
+
+void init_mnemonics() {
+    size_t count = sizeof(mnemonics) / sizeof(mnemonics[0]);
 
-    while (isspace((unsigned char)*start)) start++;
+    for (mnemonic_seed = 0;; mnemonic_seed++) {
+        bool collision = false;
 
-    if (*start == 0) {
-        *str = 0;
+        memset(mnemonic_table, 0xff, sizeof(mnemonic_table));
 
-        return;
+        for (size_t i = 0; i < count && !collision; i++) {
+            uint32_t slot = mnemonic_slot(mnemonics[i].name, strlen(mnemonics[i].name), mnemonic_seed);
+
+            if (mnemonic_table[slot] >= 0)
+                collision = true;
+            else
+                mnemonic_table[slot] = (int16_t)i;
+        }
+
+        if (!collision)
+            return;
     }
+}
+
+int parse_opcode(const char *str, size_t len) {
+    int16_t index = mnemonic_table[mnemonic_slot(str, len, mnemonic_seed)];
 
-    end = start + strlen(start) - 1;
+    if (index < 0 || strlen(mnemonics[index].name) != len || strncasecmp(mnemonics[index].name, str, len) != 0)
+        return -1;
 
-    while (end > start && isspace((unsigned char)*end)) end--;
+    return mnemonics[index].opcode;
+}
 
-    *(end + 1) = 0;
+int get_register(const char *str, size_t len) {
+    for (size_t i = 0; i < sizeof(registers) / sizeof(registers[0]); i++)
+        if (strlen(registers[i].name) == len && strncasecmp(registers[i].name, str, len) == 0)
+            return registers[i].opcode;
 
-    if (start != str)
-        memmove(str, start, strlen(start) + 1);
+    return -1;
 }
 
-void add_label(const char *label, uint32_t addr) {
-    if (label_count <= MAX_LABELS) {
-        printf("Found label: { %s, 0x%05x }\n", label, addr);
+size_t find_symbol(const char *name, size_t len) {
+    if (symbol_count * 2 >= slot_cap) {
+        size_t new_cap = slot_cap ? slot_cap * 2 : SYMBOL_TABLE_INIT;
+        size_t *slots = malloc(new_cap * sizeof(size_t));
+
+        if (!slots) {
+            printf("Memory allocation failed\n");
+
+            exit(1);
+        }
+
+        memset(slots, 0xff, new_cap * sizeof(size_t));
+
+        for (size_t i = 0; i < symbol_count; i++) {
+            uint32_t slot = hash_name(symbols[i].name, strlen(symbols[i].name), 0) & (new_cap - 1);
+
+            while (slots[slot] != SIZE_MAX)
+                slot = (slot + 1) & (new_cap - 1);
 
-        strncpy(label_table[label_count].name, label, 32);
-        label_table[label_count].addr = addr & ADDR_MASK;
-        label_count++;
+            slots[slot] = i;
+        }
+
+        free(symbol_slots);
+
+        symbol_slots = slots;
+        slot_cap = new_cap;
+    }
+
+    uint32_t slot = hash_name(name, len, 0) & (slot_cap - 1);
+
+    while (symbol_slots[slot] != SIZE_MAX) {
+        Symbol *sym = &symbols[symbol_slots[slot]];
+
+        if (strncmp(sym->name, name, len) == 0 && sym->name[len] == '\0')
+            return symbol_slots[slot];
+
+        slot = (slot + 1) & (slot_cap - 1);
     }
+
+    symbols = grow(symbols, &symbol_cap, symbol_count, sizeof(Symbol));
+    symbols[symbol_count].name = strndup(name, len);
+    symbols[symbol_count].defined = false;
+    symbol_slots[slot] = symbol_count;
+
+    return symbol_count++;
 }
 
-uint32_t find_label(const char *label) {
-    for (int i = 0; i < label_count; i++)
-        if (strcmp(label_table[i].name, label) == 0) return label_table[i].addr;
+Item *add_item(uint8_t kind, int line, const char *text, size_t text_len) {
+    items = grow(items, &item_cap, item_count, sizeof(Item));
 
-    return 0;
+    Item *item = &items[item_count++];
+
+    memset(item, 0, sizeof(Item));
+
+    item->kind = kind;
+    item->addr = pc;
+    item->line = line;
+    item->text = text;
+    item->text_len = text_len;
+
+    return item;
 }
 
-uint8_t parse_opcode(const char *str) {
-    if (strcasecmp(str, "MOV") == 0) return MOV;
-    else if (strcasecmp(str, "LD") == 0) return LD;
-    else if (strcasecmp(str, "ST") == 0) return ST;
-    else if (strcasecmp(str, "PUSH") == 0) return PUSH;
-    else if (strcasecmp(str, "POP") == 0) return POP;
-    else if (strcasecmp(str, "ADD") == 0) return ADD;
-    else if (strcasecmp(str, "SUB") == 0) return SUB;
-    else if (strcasecmp(str, "INC") == 0) return INC;
-    else if (strcasecmp(str, "DEC") == 0) return DEC;
-    else if (strcasecmp(str, "AND") == 0) return AND;
-    else if (strcasecmp(str, "OR") == 0) return OR;
-    else if (strcasecmp(str, "XOR") == 0) return XOR;
-    else if (strcasecmp(str, "NOT") == 0) return NOT;
-    else if (strcasecmp(str, "SHL") == 0) return SHL;
-    else if (strcasecmp(str, "SHR") == 0) return SHR;
-    else if (strcasecmp(str, "CMP") == 0) return CMP;
-    else if (strcasecmp(str, "JMP") == 0) return JMP;
-    else if (strcasecmp(str, "JZ") == 0) return JZ;
-    else if (strcasecmp(str, "JNZ") == 0) return JNZ;
-    else if (strcasecmp(str, "JE") == 0) return JE;
-    else if (strcasecmp(str, "JNE") == 0) return JNE;
-    else if (strcasecmp(str, "JL") == 0) return JL;
-    else if (strcasecmp(str, "JLE") == 0) return JLE;
-    else if (strcasecmp(str, "JG") == 0) return JG;
-    else if (strcasecmp(str, "JGE") == 0) return JGE;
-    else if (strcasecmp(str, "CALL") == 0) return CALL;
-    else if (strcasecmp(str, "RET") == 0) return RET;
-    else if (strcasecmp(str, "IRET") == 0) return IRET;
-    else if (strcasecmp(str, "INT") == 0) return INT;
-    else if (strcasecmp(str, "CLI") == 0) return CLI;
-    else if (strcasecmp(str, "STI") == 0) return STI;
-    else if (strcasecmp(str, "INT") == 0) return INT;
-    else if (strcasecmp(str, "NOP") == 0) return NOP;
-    else if (strcasecmp(str, "HLT") == 0) return HLT;
+void add_data(Item *item, uint8_t byte) {
+    if (item->size == 0)
+        item->data = data_len;
+
+    data_pool = grow(data_pool, &data_cap, data_len, 1);
+    data_pool[data_len++] = byte;
+    item->size++;
+}
+
+void add_fixup(size_t item, uint8_t operand, uint32_t offset, size_t sym, int line) {
+    fixups = grow(fixups, &fixup_cap, fixup_count, sizeof(Fixup));
+
+    fixups[fixup_count].item = item;
+    fixups[fixup_count].operand = operand;
+    fixups[fixup_count].offset = offset;
+    fixups[fixup_count].sym = sym;
+    fixups[fixup_count].line = line;
+    fixup_count++;
+}
+
+int escape_char(char c) {
+    switch (c) {
+        case 'n': return '\n';
+        case 't': return '\t';
+        case 'r': return '\r';
+        case '0': return '\0';
+        case '\'': return '\'';
+        case '\\': return '\\';
+        case 'b': return '\b';
+        case 'f': return '\f';
+        case 'v': return '\v';
+        case 'a': return '\a';
+    }
 
     return -1;
 }
 
-uint16_t get_register(const char *str) {
-    if (str[0] == 'R')
-        return str[1] - '0';
-    else if (strcmp(str, "SP") == 0)
-        return SP;
-    else if (strcmp(str, "PC") == 0)
-        return PC;
-    else if (strcmp(str, "FLAGS") == 0)
-        return FLAGS;
-    else if (strcmp(str, "CS") == 0)
-        return CS;
-    else if (strcmp(str, "SS") == 0)
-        return SS;
-    else if (strcmp(str, "DS") == 0)
-        return DS;
-    else if (strcmp(str, "US") == 0)
-        return US;
-    
+Token *next_token(Lexer *lex) {
+    Token *tok = &lex->tok;
+    const char *p = lex->pos;
+
+    while (*p == ' ' || *p == '\t' || *p == '\r')
+        p++;
+
+    if (*p == ';')
+        while (*p && *p != '\n')
+            p++;
+
+    tok->start = p;
+    tok->line = lex->line;
+    tok->value = 0;
+    lex->tok_line_start = lex->line_start;
+
+    if (*p == '\0') {
+        tok->type = TOK_EOF;
+    } else if (*p == '\n') {
+        tok->type = TOK_NEWLINE;
+        p++;
+
+        lex->line++;
+        lex->line_start = p;
+    } else if (isalpha((unsigned char)*p) || *p == '_' || *p == '.') {
+        tok->type = TOK_IDENT;
+
+        while (isalnum((unsigned char)*p) || *p == '_' || *p == '.')
+            p++;
+    } else if (isdigit((unsigned char)*p)) {
+        tok->type = TOK_NUMBER;
+
+        while (isalnum((unsigned char)*p) || *p == '_')
+            p++;
+    } else if (*p == '\'') {
+        int ch;
+
+        tok->type = TOK_CHAR;
+        p++;
+
+        if (*p == '\\') {
+            ch = escape_char(p[1]);
+            p += 2;
+        } else
+            ch = (uint8_t)*p++;
+
+        if (ch < 0 || *p != '\'')
+            tok->type = TOK_INVALID;
+        else
+            p++;
+
+        tok->value = (uint32_t)ch;
+    } else {
+        switch (*p) {
+            case '#': tok->type = TOK_HASH; break;
+            case ',': tok->type = TOK_COMMA; break;
+            case ':': tok->type = TOK_COLON; break;
+            case '[': tok->type = TOK_LBRACKET; break;
+            case ']': tok->type = TOK_RBRACKET; break;
+            case '+': tok->type = TOK_PLUS; break;
+            case '-': tok->type = TOK_MINUS; break;
+            default: tok->type = TOK_INVALID; break;
+        }
+
+        p++;
+    }
+
+    tok->len = p - tok->start;
+    lex->pos = p;
+
+    return tok;
+}
+
+bool parse_number(Token *tok, int base, uint32_t *value) {
+    char buf[32];
+    char *end;
+
+    if ((tok->type != TOK_NUMBER && tok->type != TOK_IDENT) || tok->len >= sizeof(buf))
+        return false;
+
+    memcpy(buf, tok->start, tok->len);
+    buf[tok->len] = '\0';
+
+    *value = (uint32_t)strtoul(buf, &end, base);
+
+    return *end == '\0';
+}
+
+const char *line_text(Lexer *lex, size_t *len) {
+    const char *start = lex->tok_line_start;
+    const char *end = start;
+
+    while (*start == ' ' || *start == '\t')
+        start++;
+
+    end = start;
+
+    while (*end && *end != '\n')
+        end++;
+
+    while (end > start && isspace((unsigned char)end[-1]))
+        end--;
+
+    *len = end - start;
+
+    return start;
+}
+
+int syntax_error(Lexer *lex, const char *msg) {
+    size_t len;
+    const char *text = line_text(lex, &len);
+
+    printf("Error on line %d: %s\n  > %.*s\n", lex->tok.line, msg, (int)len, text);
+
+    return 1;
+}
+
+int define_label(Lexer *lex, const char *name, size_t len) {
+    size_t sym = find_symbol(name, len);
+
+    if (symbols[sym].defined)
+        return syntax_error(lex, "Duplicate label");
+
+    if (label_count++ == 0 && !object_mode && strcmp(symbols[sym].name, "start") != 0) {
+        printf("Error: Could not find label 'start'\n  > found label '%s' instead\n", symbols[sym].name);
+
+        return 1;
+    }
+
+    symbols[sym].defined = true;
+    symbols[sym].item = item_count;
+    symbols[sym].addr = pc & ADDR_MASK;
+
+    if (verbose)
+        printf("Found label: { %s, 0x%05x }\n", symbols[sym].name, symbols[sym].addr);
+
     return 0;
 }
 
-uint32_t first_pass(FILE *file) {
-    char line[MAX_LINE_LEN];
-    pc = START_ADDR;
+int parse_org(Lexer *lex) {
+    uint32_t seg, off;
 
-    while (fgets(line, sizeof(line), file)) {
-        trim(line);
-        
-        if (line[0] == '\0' || line[0] == '\n' || line[0] == ';') continue;
+    if (!parse_number(next_token(lex), 16, &seg))
+        return syntax_error(lex, "Invalid origin");
 
-        if (strncmp(line, "org", 3) == 0) {
-            unsigned int seg = 0, off = 0;
+    if (next_token(lex)->type == TOK_COLON) {
+        if (!parse_number(next_token(lex), 16, &off))
+            return syntax_error(lex, "Invalid origin");
 
-            if (strchr(line, ':')) {
-                sscanf(line + 3, "%x:%x", &seg, &off);
+        next_token(lex);
 
-                origin_seg = seg & 0xffff;
-                origin_off = off & 0xffff;
+        seg = seg_offset(seg & 0xffff, off & 0xffff);
+    }
 
-                origin_addr = seg_offset(origin_seg, origin_off);
-            } else {
-                sscanf(line + 3, "%x", &origin_addr);
-                
-                origin_seg = origin_addr >> SEG_SHIFT;
-                origin_off = origin_addr & 0x0f;
-            }
-            
-            pc = origin_addr;
+    seg &= ADDR_MASK;
 
-            continue;
-        }
+    if (!origin_set && item_count == 0) {
+        origin_addr = seg;
+        origin_set = true;
+    } else if (seg < pc) {
+        return syntax_error(lex, "Origin moves backwards");
+    } else if (seg > pc) {
+        size_t len;
+        const char *text = line_text(lex, &len);
+        Item *item = add_item(ITEM_ORG, lex->tok.line, text, len);
 
-        if (strncmp(line, "db", 2) == 0) {
-            pc++;
+        item->size = seg - pc;
+        item->target = seg;
+    }
 
-            continue;
-        } else if (strncmp(line, "dw", 2) == 0) {
-            pc += 2;
+    pc = seg;
 
-            continue;
+    return 0;
+}
+
+int parse_data(Lexer *lex, uint32_t width) {
+    size_t len;
+    const char *text = line_text(lex, &len);
+    Item *item = add_item(ITEM_DATA, lex->tok.line, text, len);
+    size_t index = item_count - 1;
+
+    do {
+        Token *tok = next_token(lex);
+        uint32_t value;
+
+        if (tok->type == TOK_HASH)
+            tok = next_token(lex);
+
+        if (tok->type == TOK_CHAR)
+            value = tok->value;
+        else if (!parse_number(tok, 16, &value)) {
+            if (tok->type != TOK_IDENT || width != 2)
+                return syntax_error(lex, "Invalid data");
+
+            add_fixup(index, 0, item->size, find_symbol(tok->start, tok->len), tok->line);
+            value = 0;
         }
 
-        char *colon = strchr(line, ':');
+        if (width == 2)
+            add_data(item, (value >> 8) & 0xff);
+
+        add_data(item, value & 0xff);
+        pc += width;
+    } while (next_token(lex)->type == TOK_COMMA);
 
-        if (colon) {
-            *colon = '\0';
+    return 0;
+}
+
+int parse_gpr(Lexer *lex) {
+    Token *tok = &lex->tok;
+    int reg = (tok->type == TOK_IDENT) ? get_register(tok->start, tok->len) : -1;
+
+    if (reg < R0 || reg > R7)
+        return -1;
+
+    next_token(lex);
+
+    return reg;
+}
+
+int parse_address(Lexer *lex, Operand *op) {
+    Token *tok = next_token(lex);
+    bool pre_dec = false;
+
+    op->is_address = true;
+
+    if (tok->type == TOK_MINUS) {
+        pre_dec = true;
+        next_token(lex);
+    }
+
+    int base = parse_gpr(lex);
+
+    if (base < 0)
+        return syntax_error(lex, "Expected a general purpose base register");
+
+    op->value = (uint16_t)base;
+
+    if (pre_dec)
+        op->mode = MODE_PRE_DEC;
+    else if (tok->type == TOK_PLUS || tok->type == TOK_MINUS) {
+        bool negate = tok->type == TOK_MINUS;
 
-            trim(line);
-            add_label(line, pc);
+        next_token(lex);
 
-            if (label_count == 1 && strcmp(line, "start") != 0) {
-                printf("Error: Could not find label 'start'\n  > found label '%s' instead\n", line);
+        if (!negate && tok->type == TOK_RBRACKET)
+            op->mode = MODE_POST_INC;
+        else {
+            int index = negate ? -1 : parse_gpr(lex);
 
-                return -1;
+            if (index >= 0) {
+                op->mode = MODE_BASE_INDEX | (base << MODE_BASE_SHIFT);
+                op->value = (uint16_t)index;
+            } else {
+                uint32_t value;
+
+                op->mode = MODE_BASE_DISP | (base << MODE_BASE_SHIFT);
+
+                if (tok->type == TOK_HASH)
+                    next_token(lex);
+
+                if (tok->type == TOK_NUMBER || tok->type == TOK_CHAR) {
+                    value = tok->value;
+
+                    if (tok->type == TOK_NUMBER && !parse_number(tok, 0, &value))
+                        return syntax_error(lex, "Invalid number");
+
+                    op->value = (uint16_t)(negate ? -value : value);
+                } else if (tok->type == TOK_IDENT && !negate && get_register(tok->start, tok->len) < 0) {
+                    op->value = 0;
+                    op->has_sym = true;
+                    op->sym = find_symbol(tok->start, tok->len);
+                } else
+                    return syntax_error(lex, "Invalid displacement");
+
+                next_token(lex);
             }
+        }
+    }
 
-            continue;
+    if (tok->type != TOK_RBRACKET)
+        return syntax_error(lex, "Expected ']'");
+
+    next_token(lex);
+
+    return 0;
+}
+
+int parse_operand(Lexer *lex, Operand *op, bool is_jump) {
+    Token *tok = &lex->tok;
+    bool negate = false;
+
+    op->mode = MODE_VAL_IND;
+    op->value = 0;
+    op->is_reg = false;
+    op->is_address = false;
+    op->has_sym = false;
+
+    if (tok->type == TOK_LBRACKET)
+        return parse_address(lex, op);
+
+    if (tok->type == TOK_HASH) {
+        op->mode = MODE_VAL_IMM;
+        next_token(lex);
+    }
+
+    if (tok->type == TOK_MINUS) {
+        negate = true;
+        next_token(lex);
+    }
+
+    switch (tok->type) {
+        case TOK_NUMBER:
+        case TOK_CHAR: {
+            uint32_t value = tok->value;
+
+            if (tok->type == TOK_NUMBER && !parse_number(tok, 0, &value))
+                return syntax_error(lex, "Invalid number");
+
+            op->value = (uint16_t)(negate ? -value : value);
+
+            break;
         }
 
-        char mnemonic[16];
+        case TOK_IDENT: {
+            int reg = get_register(tok->start, tok->len);
 
-        sscanf(line, "%s", mnemonic);
+            if (reg >= 0 && op->mode == MODE_VAL_IND && !negate && !is_jump) {
+                op->value = (uint16_t)reg;
+                op->is_reg = true;
+            } else if (!negate) {
+                op->has_sym = true;
+                op->sym = find_symbol(tok->start, tok->len);
+            } else
+                return syntax_error(lex, "Invalid operand");
 
-        Instruction dummy = {.opcode = parse_opcode(mnemonic)};
+            break;
+        }
 
-        pc += INST_SIZE;
+        default:
+            return syntax_error(lex, "Invalid operand");
     }
 
-    rewind(file);
+    next_token(lex);
 
-    return pc;
+    return 0;
 }
 
-int second_pass(FILE *in, FILE *out) {
-    char line[MAX_LINE_LEN];
-    int curr_line = 0;
-    pc = origin_addr;
+uint32_t inst_size(const Instruction *inst) {
+    if (compact && inst->opcode != BCOPY && inst->opcode != BFILL && inst->opcode != BCMP && inst->opcode != CAS && inst->mode1 <= MODE_VAL_IND && inst->mode2 <= MODE_VAL_IND &&
+        inst->operand1 <= 0xff && inst->operand2 <= 0xff)
+        return COMPACT_INST_SIZE;
 
-    fputc(0x88, out);
-    fputc(0xcc, out);
+    return INST_SIZE;
+}
 
-    fputc((pc >> 16) & 0x0f, out);
-    fputc((pc >> 8) & 0xff, out);
-    fputc(pc & 0xff, out);
-    fputc(0, out);
+int parse_instruction_line(Lexer *lex, Token mnemonic) {
+    int opcode = parse_opcode(mnemonic.start, mnemonic.len);
 
-    fputc(0, out);
-    fputc(0, out);
-    fputc(0, out);
-    fputc(0, out);
+    if (opcode < 0) {
+        printf("Error on line %d: Unknown instruction\n  > %.*s\n", mnemonic.line, (int)mnemonic.len, mnemonic.start);
 
-    while (fgets(line, sizeof(line), in)) {
-        curr_line++;
-        trim(line);
+        return 1;
+    }
 
-        if (line[0] == '\0' || line[0] == '\n' || line[0] == ';') continue;
-        if (strncmp(line, "org", 3) == 0) continue;
-        if (strchr(line, ':')) continue;
+    bool is_jump = opcode == JMP || opcode == JZ || opcode == JNZ || opcode == JE || opcode == JNE || opcode == JL || opcode == JLE || opcode == JG || opcode == JGE || opcode == CALL;
+    bool is_block = opcode == BCOPY || opcode == BFILL || opcode == BCMP;
+    bool is_atomic = opcode == XCHG || opcode == CAS;
+    Operand ops[3];
+    int count = 0;
+    size_t len;
+    const char *text = line_text(lex, &len);
 
-        if (strncmp(line, "db", 2) == 0) {
-            unsigned int byte;
+    next_token(lex);
 
-            if (sscanf(line + 2, "%x", &byte) == 1)
-                fputc(byte & 0xff, out);
-            
-            pc++;
+    while (lex->tok.type != TOK_NEWLINE && lex->tok.type != TOK_EOF) {
+        if (count == ((is_block || opcode == CAS) ? 3 : 2))
+            return syntax_error(lex, "Too many operands");
 
-            continue;
-        } else if (strncmp(line, "dw", 2) == 0) {
-            unsigned int word;
+        if (count > 0) {
+            if (lex->tok.type != TOK_COMMA)
+                return syntax_error(lex, "Expected ','");
 
-            if (sscanf(line + 2, "%x", &word) == 1) {
-                fputc((word >> 8) & 0xff, out);
-                fputc(word & 0xff, out);
-            }
+            next_token(lex);
+        }
+
+        if (parse_operand(lex, &ops[count], is_jump && count == 0))
+            return 1;
+
+        count++;
+    }
+
+    if (is_block && (count != 3 || !ops[2].is_reg || ops[2].value > R7))
+        return syntax_error(lex, "Expected a general purpose count register");
+
+    if (opcode == CAS && (count != 3 || !ops[2].is_reg || ops[2].value > R7))
+        return syntax_error(lex, "Expected a general purpose new value register");
+
+    for (int i = 0; i < count; i++)
+        if (ops[i].is_address && !(((opcode == LD || is_atomic) && i == 1) || (opcode == ST && i == 0)))
+            return syntax_error(lex, "Memory operands are only allowed as the address of ld/st/xchg/cas");
+
+    Item *item = add_item(ITEM_INST, mnemonic.line, text, len);
 
-            pc += 2;
+    item->inst.opcode = (uint8_t)opcode;
+    item->inst.mode1 = MODE_VAL_IND;
+    item->inst.mode2 = MODE_VAL_IND;
+
+    if (is_block || opcode == CAS) {
+        item->inst.padding = (uint8_t)ops[2].value;
+        count = 2;
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (i == 0) {
+            item->inst.mode1 = ops[i].mode;
+            item->inst.operand1 = ops[i].value;
+        } else {
+            item->inst.mode2 = ops[i].mode;
+            item->inst.operand2 = ops[i].value;
+        }
+
+        if (ops[i].has_sym)
+            add_fixup(item_count - 1, (uint8_t)(i + 1), 0, ops[i].sym, mnemonic.line);
+    }
+
+    item->size = (count < 1 || !ops[0].has_sym) && (count < 2 || !ops[1].has_sym) ? inst_size(&item->inst) : INST_SIZE;
+    pc += item->size;
+
+    return 0;
+}
+
+int parse_source(const char *src) {
+    Lexer lex = {.pos = src, .line_start = src, .line = 1};
+    Token *tok = next_token(&lex);
+
+    while (tok->type != TOK_EOF) {
+        if (tok->type == TOK_NEWLINE) {
+            tok = next_token(&lex);
 
             continue;
         }
 
-        char mnemonic[16] = {0}, op1[32] = {0}, op2[32] = {0};
-        int parts = sscanf(line, "%s %[^,], %s", mnemonic, op1, op2);
-        uint8_t opcode = parse_opcode(mnemonic);
+        if (tok->type != TOK_IDENT)
+            return syntax_error(&lex, "Expected label or instruction");
 
-        if (opcode > 0xff) {
-            printf("Error on line %d: Unknown instruction\n  > %s\n", curr_line, mnemonic);
+        Token first = *tok;
+        Lexer saved = lex;
 
-            return 1;
+        if (first.len == 3 && strncasecmp(first.start, "org", 3) == 0) {
+            if (parse_org(&lex))
+                return 1;
+        } else if (first.len == 2 && (strncasecmp(first.start, "db", 2) == 0 || strncasecmp(first.start, "dw", 2) == 0)) {
+            if (parse_data(&lex, (tolower((unsigned char)first.start[1]) == 'w') ? 2 : 1))
+                return 1;
+        } else if (next_token(&lex)->type == TOK_COLON) {
+            if (define_label(&lex, first.start, first.len))
+                return 1;
+
+            tok = next_token(&lex);
+
+            continue;
+        } else {
+            lex = saved;
+
+            if (parse_instruction_line(&lex, first))
+                return 1;
         }
 
-        Instruction inst = {
-            .opcode = opcode,
-            .mode1 = MODE_VAL_IND,
-            .operand1 = 0,
-            .mode2 = MODE_VAL_IND,
-            .operand2 = 0,
-            .padding = 0
-        };
-
-        if (parts >= 2 && op1[0] == '#')
-            inst.mode1 = MODE_VAL_IMM;
-        
-        if (parts == 3 && op2[0] == '#')
-            inst.mode2 = MODE_VAL_IMM;
-        
-        if (parts >= 2) {
-            if (inst.opcode == JMP || inst.opcode == JZ || inst.opcode == JNZ || inst.opcode == JE || inst.opcode == JNE || inst.opcode == JL || inst.opcode == JLE || inst.opcode == JG || inst.opcode == JGE || inst.opcode == CALL) {
-                char *value = op1;
-                
-                if (value[0] == '#') value++;
+        if (tok->type != TOK_NEWLINE && tok->type != TOK_EOF)
+            return syntax_error(&lex, "Unexpected token");
+    }
 
-                char *endptr;
+    return 0;
+}
 
-                inst.operand1 = (uint32_t)strtol(value, &endptr, 0);
+bool is_gpr_operand(size_t item, uint8_t mode, uint16_t value, int fixup) {
+    return mode == MODE_VAL_IND && value <= R7 && fixup < 0 && items[item].kind == ITEM_INST;
+}
 
-                if (*endptr != '\0') {
-                    inst.operand1 = find_label(op1);
+bool is_jump_opcode(uint8_t opcode) {
+    return opcode == JMP || opcode == JZ || opcode == JNZ || opcode == JE || opcode == JNE || opcode == JL || opcode == JLE || opcode == JG || opcode == JGE || opcode == CALL;
+}
+
+size_t next_kept(const bool *removed, size_t i) {
+    while (i < item_count && removed[i])
+        i++;
+
+    return i;
+}
+
+bool label_between(const bool *labeled, size_t from, size_t to) {
+    for (size_t i = from + 1; i <= to && i < item_count; i++)
+        if (labeled[i])
+            return true;
+
+    return false;
+}
 
-                    if (inst.operand1 == (uint32_t)0) {
-                        printf("Error on line %d: Undefined label\n  > %s\n", curr_line, line);
+void layout_items() {
+    uint32_t addr = origin_addr;
 
-                        return 1;
+    for (size_t i = 0; i < item_count; i++) {
+        Item *item = &items[i];
+
+        item->addr = addr;
+
+        if (item->kind == ITEM_ORG)
+            item->size = item->target - addr;
+        else if (item->kind == ITEM_INST && item->size == COMPACT_INST_SIZE)
+            item->size = inst_size(&item->inst);
+
+        addr += item->size;
+    }
+
+    pc = addr;
+
+    for (size_t i = 0; i < symbol_count; i++)
+        if (symbols[i].defined)
+            symbols[i].addr = ((symbols[i].item < item_count) ? items[symbols[i].item].addr : pc) & ADDR_MASK;
+}
+
+size_t optimize_items() {
+    bool *removed = calloc(item_count + 1, sizeof(bool));
+    bool *labeled = calloc(item_count + 1, sizeof(bool));
+    int *op_fixup = malloc((item_count + 1) * 2 * sizeof(int));
+    size_t removed_count = 0;
+    bool changed = true;
+
+    if (!removed || !labeled || !op_fixup) {
+        printf("Memory allocation failed\n");
+
+        exit(1);
+    }
+
+    for (size_t i = 0; i < item_count * 2; i++)
+        op_fixup[i] = -1;
+
+    for (size_t i = 0; i < fixup_count; i++)
+        if (fixups[i].operand != 0)
+            op_fixup[fixups[i].item * 2 + fixups[i].operand - 1] = (int)i;
+
+    for (size_t i = 0; i < symbol_count; i++)
+        if (symbols[i].defined)
+            labeled[symbols[i].item] = true;
+
+    while (changed) {
+        changed = false;
+
+        for (size_t i = next_kept(removed, 0); i < item_count; i = next_kept(removed, i + 1)) {
+            Item *item = &items[i];
+            Instruction *inst = &item->inst;
+            int fix1 = op_fixup[i * 2];
+            int fix2 = op_fixup[i * 2 + 1];
+
+            if (item->kind != ITEM_INST)
+                continue;
+
+            if (is_jump_opcode(inst->opcode) && fix1 >= 0) {
+                size_t dest = fixups[fix1].sym;
+                bool resolved = false;
+
+                for (int hops = 0; hops < MAX_JUMP_CHAIN; hops++) {
+                    if (!symbols[dest].defined)
+                        break;
+
+                    size_t target = next_kept(removed, symbols[dest].item);
+
+                    if (target >= item_count || items[target].kind != ITEM_INST || items[target].inst.opcode != JMP || op_fixup[target * 2] < 0) {
+                        resolved = true;
+
+                        break;
                     }
+
+                    dest = fixups[op_fixup[target * 2]].sym;
+                }
+
+                if (resolved && dest != fixups[fix1].sym) {
+                    fixups[fix1].sym = dest;
+                    changed = true;
+                }
+
+                Symbol *sym = &symbols[fixups[fix1].sym];
+
+                if (inst->opcode == JMP && sym->defined && next_kept(removed, sym->item) == next_kept(removed, i + 1) && sym->item > i) {
+                    removed[i] = true;
+                    removed_count++;
+                    changed = true;
+
+                    continue;
+                }
+            }
+
+            bool noop = false;
+
+            if (inst->opcode == MOV && is_gpr_operand(i, inst->mode1, inst->operand1, fix1) && is_gpr_operand(i, inst->mode2, inst->operand2, fix2))
+                noop = inst->operand1 == inst->operand2;
+            else if ((inst->opcode == ADD || inst->opcode == SUB || inst->opcode == SHL || inst->opcode == SHR || inst->opcode == OR || inst->opcode == XOR) &&
+                is_gpr_operand(i, inst->mode1, inst->operand1, fix1) && inst->mode2 == MODE_VAL_IMM && fix2 < 0)
+                noop = inst->operand2 == 0;
+
+            if (noop) {
+                removed[i] = true;
+                removed_count++;
+                changed = true;
+
+                continue;
+            }
+
+            size_t next = next_kept(removed, i + 1);
+
+            if (next >= item_count || items[next].kind != ITEM_INST)
+                continue;
+
+            Instruction *next_inst = &items[next].inst;
+            int next_fix1 = op_fixup[next * 2];
+            int next_fix2 = op_fixup[next * 2 + 1];
+
+            if (inst->opcode == JMP || inst->opcode == RET || inst->opcode == IRET) {
+                if (!label_between(labeled, i, next)) {
+                    removed[next] = true;
+                    removed_count++;
+                    changed = true;
+                }
+
+                continue;
+            }
+
+            if (inst->opcode == MOV && next_inst->opcode == MOV && is_gpr_operand(i, inst->mode1, inst->operand1, fix1) &&
+                is_gpr_operand(next, next_inst->mode1, next_inst->operand1, next_fix1)) {
+                bool next_reads_gpr = is_gpr_operand(next, next_inst->mode2, next_inst->operand2, next_fix2);
+
+                if (next_inst->operand1 == inst->operand1 && !(next_reads_gpr && next_inst->operand2 == inst->operand1)) {
+                    removed[i] = true;
+                    removed_count++;
+                    changed = true;
+
+                    continue;
+                }
+
+                if (is_gpr_operand(i, inst->mode2, inst->operand2, fix2) && next_reads_gpr && next_inst->operand1 == inst->operand2 &&
+                    next_inst->operand2 == inst->operand1 && !label_between(labeled, i, next)) {
+                    removed[next] = true;
+                    removed_count++;
+                    changed = true;
+
+                    continue;
                 }
-            } else {
-                if (inst.mode1 == MODE_VAL_IMM)
-                    inst.operand1 = (uint16_t)strtol(op1 + 1, NULL, 0);
-                else if (op1[0] == 'R' || strcmp(op1, "SP") == 0 || strcmp(op1, "PC") == 0 || strcmp(op1, "FLAGS") == 0 || strcmp(op1, "CS") == 0 || strcmp(op1, "SS") == 0 || strcmp(op1, "DS") == 0)
-                    inst.operand1 = get_register(op1);
+            }
+
+            if ((inst->opcode == INC || (inst->opcode == ADD && inst->mode2 == MODE_VAL_IMM && fix2 < 0)) && next_inst->opcode == INC &&
+                is_gpr_operand(i, inst->mode1, inst->operand1, fix1) && next_inst->mode1 == inst->mode1 && next_inst->operand1 == inst->operand1 &&
+                next_fix1 < 0 && !label_between(labeled, i, next)) {
+                if (inst->opcode == INC) {
+                    inst->opcode = ADD;
+                    inst->mode2 = MODE_VAL_IMM;
+                    inst->operand2 = 1;
+                }
+
+                inst->operand2++;
+                removed[next] = true;
+                removed_count++;
+                changed = true;
             }
         }
+    }
 
-        if (parts == 3) {
-            if (inst.mode2 == MODE_VAL_IMM) {
-                if (op2[1] == '\'' && op2[strlen(op2) - 1] == '\'') {
-                    char ch;
-
-                    if (op2[2] == '\\') {
-                        switch (op2[3]) {
-                            case 'n': ch = '\n'; break;
-                            case 't': ch = '\t'; break;
-                            case 'r': ch = '\r'; break;
-                            case '0': ch = '\0'; break;
-                            case '\'': ch = '\''; break;
-                            case '\\': ch = '\\'; break;
-                            case 'b': ch = '\b'; break;
-                            case 'f': ch = '\f'; break;
-                            case 'v': ch = '\v'; break;
-                            case 'a': ch = '\a'; break;
-                            default: {
-                                printf("Error: Unknown escape sequence '\\%c'\n", op2[3]);
-
-                                return 1;
-                            }
-                        }
-                    } else {
-                        ch = op2[2];
-
-                        printf("ch = op2[2]: %c", ch);
-                    }
+    size_t *remap = malloc((item_count + 1) * sizeof(size_t));
+    size_t kept = 0;
 
-                    inst.operand2 = (uint16_t)ch;
+    if (!remap) {
+        printf("Memory allocation failed\n");
 
-                    printf("Final operand2: '%c' -> 0x%02x (%d)\n", ch, inst.operand2, inst.operand2);
-                } else
-                    inst.operand2 = (uint16_t)strtol(op2 + 1, NULL, 0);
-            } else if (op2[0] == 'R' || strcmp(op2, "SP") == 0 || strcmp(op2, "PC") == 0 || strcmp(op2, "FLAGS") == 0 || strcmp(op2, "CS") == 0 || strcmp(op2, "SS") == 0 || strcmp(op2, "DS") == 0)
-                inst.operand2 = get_register(op2);
-            else
-                inst.operand2 = (uint16_t)strtol(op2, NULL, 0);
+        exit(1);
+    }
+
+    for (size_t i = 0; i <= item_count; i++) {
+        remap[i] = kept;
+
+        if (i < item_count && !removed[i])
+            items[kept++] = items[i];
+    }
+
+    size_t fix_kept = 0;
+
+    for (size_t i = 0; i < fixup_count; i++) {
+        if (removed[fixups[i].item])
+            continue;
+
+        fixups[fix_kept] = fixups[i];
+        fixups[fix_kept].item = remap[fixups[i].item];
+        fix_kept++;
+    }
+
+    for (size_t i = 0; i < symbol_count; i++)
+        if (symbols[i].defined)
+            symbols[i].item = remap[symbols[i].item];
+
+    item_count = kept;
+    fixup_count = fix_kept;
+
+    layout_items();
+
+    free(remap);
+    free(op_fixup);
+    free(labeled);
+    free(removed);
+
+    return removed_count;
+}
+
+int apply_fixups() {
+    for (size_t i = 0; i < fixup_count; i++) {
+        Fixup *fix = &fixups[i];
+        Symbol *sym = &symbols[fix->sym];
+        Item *item = &items[fix->item];
+
+        if (!sym->defined) {
+            if (object_mode && sym->name[0] != '.')
+                continue;
+
+            printf("Error on line %d: Undefined label\n  > %.*s\n", fix->line, (int)item->text_len, item->text);
+
+            return 1;
         }
 
-        printf("line %d: %s\n  addr: 0x%05x\n  bytes: 0x%02x 0x%02x 0x%02x 0x%02x 0x%02x 0x%02x 0x%02x 0x%02x\n",
-            curr_line, line, pc,
-            inst.opcode, inst.mode1,
-            (inst.operand1 >> 8) & 0xff,
-            inst.operand1 & 0xff,
-            inst.mode2,
-            (inst.operand2 >> 8) & 0xff,
-            inst.operand2 & 0xff,
-            inst.padding
-        );
-
-        fputc(inst.opcode, out);
-        fputc(inst.mode1, out);
-        fputc((inst.operand1 >> 8) & 0xff, out);
-        fputc(inst.operand1 & 0xff, out);
-        fputc(inst.mode2, out);
-        fputc((inst.operand2 >> 8) & 0xff, out);
-        fputc(inst.operand2 & 0xff, out);
-        fputc(inst.padding, out);
-
-        pc += INST_SIZE;
+        uint16_t value = sym->addr & 0xffff;
+
+        if (fix->operand == 0) {
+            uint8_t *data = &data_pool[item->data + fix->offset];
+
+            data[0] = (value >> 8) & 0xff;
+            data[1] = value & 0xff;
+        } else if (fix->operand == 1)
+            item->inst.operand1 = value;
+        else
+            item->inst.operand2 = value;
     }
 
     return 0;
 }
 
-int main(int argc, char *argv[]) {
-    char *in_file = NULL;
-    char *out_file = NULL;
-    char *dump_file = NULL;
+uint8_t *emit(uint32_t *size) {
+    uint32_t code_size = pc - origin_addr;
+    uint8_t *code = calloc(code_size ? code_size : 1, 1);
 
-    for (int i = 0; i < argc; i++) {
-        if (strcmp(argv[i], "-f") == 0 && i + 1 < argc)
-            in_file = argv[++i];
-        else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
-            out_file = argv[++i];
-        else if (strcmp(argv[i], "-dump") == 0 && i + 1 < argc)
-            dump_file = argv[++i];
+    if (!code) {
+        printf("Memory allocation failed\n");
+
+        exit(1);
     }
 
-    if (dump_file == NULL) {
-        const char *in_ext = get_file_ext(in_file);
+    for (size_t i = 0; i < item_count; i++) {
+        Item *item = &items[i];
+        uint8_t *out = &code[item->addr - origin_addr];
 
-        if (strcmp(in_ext, "hxa") != 0) {
-            printf("Invalid file type %s\n", in_file);
+        if (item->kind != ITEM_INST) {
+            if (item->kind == ITEM_DATA)
+                memcpy(out, &data_pool[item->data], item->size);
 
-            return 1;
+            continue;
         }
 
-        FILE *input_file = fopen(in_file, "r");
+        Instruction inst = item->inst;
+
+        if (item->size == COMPACT_INST_SIZE) {
+            out[0] = inst.opcode;
+            out[1] = INST_COMPACT | (inst.mode1 << 1) | inst.mode2;
+            out[2] = inst.operand1 & 0xff;
+            out[3] = inst.operand2 & 0xff;
+        } else {
+            out[0] = inst.opcode;
+            out[1] = inst.mode1;
+            out[2] = (inst.operand1 >> 8) & 0xff;
+            out[3] = inst.operand1 & 0xff;
+            out[4] = inst.mode2;
+            out[5] = (inst.operand2 >> 8) & 0xff;
+            out[6] = inst.operand2 & 0xff;
+            out[7] = inst.padding;
+        }
 
-        if (!input_file) {
-            printf("Unable to open file %s\n", in_file);
+        if (verbose) {
+            printf("line %d: %.*s\n  addr: 0x%05x\n  bytes:", item->line, (int)item->text_len, item->text, item->addr);
 
-            return 1;
+            for (uint32_t j = 0; j < item->size; j++)
+                printf(" 0x%02x", out[j]);
+
+            printf("\n");
         }
+    }
 
-        FILE *output_file = fopen(out_file, "wb");
+    *size = code_size;
 
-        if (!output_file) {
-            printf("Unable to create file %s\n", out_file);
-            fclose(input_file);
+    return code;
+}
 
-            return 1;
+int compare_labels(const void *a, const void *b) {
+    const Symbol *sym_a = &symbols[*(const size_t *)a];
+    const Symbol *sym_b = &symbols[*(const size_t *)b];
+
+    if (sym_a->item != sym_b->item)
+        return (sym_a->item < sym_b->item) ? -1 : 1;
+
+    return (*(const size_t *)a < *(const size_t *)b) ? -1 : 1;
+}
+
+int write_listing(const char *path, const uint8_t *code) {
+    FILE *file = fopen(path, "w");
+
+    if (!file) {
+        printf("Unable to create file %s\n", path);
+
+        return 1;
+    }
+
+    size_t *labels = malloc((symbol_count ? symbol_count : 1) * sizeof(size_t));
+    size_t labels_len = 0;
+    size_t next_label = 0;
+
+    if (!labels) {
+        printf("Memory allocation failed\n");
+
+        exit(1);
+    }
+
+    for (size_t i = 0; i < symbol_count; i++)
+        if (symbols[i].defined)
+            labels[labels_len++] = i;
+
+    qsort(labels, labels_len, sizeof(size_t), compare_labels);
+
+    for (size_t i = 0; i <= item_count; i++) {
+        while (next_label < labels_len && symbols[labels[next_label]].item == i) {
+            fprintf(file, "      %05x                            %s:\n", symbols[labels[next_label]].addr, symbols[labels[next_label]].name);
+            next_label++;
+        }
+
+        if (i == item_count)
+            break;
+
+        Item *item = &items[i];
+        uint32_t size = item->size;
+
+        if (item->kind == ITEM_ORG) {
+            fprintf(file, "%5d %05x                             %.*s\n", item->line, item->addr & ADDR_MASK, (int)item->text_len, item->text);
+
+            continue;
         }
 
-        first_pass(input_file);
+        uint32_t off = 0;
+
+        do {
+            uint32_t count = (size - off < 8) ? size - off : 8;
+
+            if (off == 0)
+                fprintf(file, "%5d ", item->line);
+            else
+                fprintf(file, "      ");
+
+            fprintf(file, "%05x  ", (item->addr + off) & ADDR_MASK);
+
+            for (uint32_t j = 0; j < 8; j++) {
+                if (j < count)
+                    fprintf(file, "%02x ", code[item->addr - origin_addr + off + j]);
+                else if (off == 0)
+                    fprintf(file, "   ");
+            }
+
+            if (off == 0)
+                fprintf(file, "  %.*s", (int)item->text_len, item->text);
+
+            fprintf(file, "\n");
+
+            off += 8;
+        } while (off < size);
+    }
+
+    free(labels);
+
+    if (fclose(file) != 0) {
+        printf("Failed to write %s\n", path);
+
+        return 1;
+    }
+
+    return 0;
+}
+
+int write_map(const char *path) {
+    MapSymbol *syms = malloc((symbol_count ? symbol_count : 1) * sizeof(MapSymbol));
+    size_t count = 0;
+
+    if (!syms) {
+        printf("Memory allocation failed\n");
+
+        exit(1);
+    }
+
+    for (size_t i = 0; i < symbol_count; i++) {
+        if (!symbols[i].defined)
+            continue;
+
+        syms[count].name = symbols[i].name;
+        syms[count].addr = symbols[i].addr;
+        count++;
+    }
+
+    int status = write_symbol_map(path, syms, count, pc & ADDR_MASK);
+
+    free(syms);
+
+    return status;
+}
+
+int emit_object(const char *out_file, uint8_t *code, uint32_t code_size) {
+    Object obj = {0};
+
+    obj.flags = (origin_set ? OBJ_FLAG_ORG : 0) | (compact ? OBJ_FLAG_COMPACT : 0);
+    obj.org = origin_addr;
+    obj.code = code;
+    obj.size = code_size;
+    obj.symbols = calloc(symbol_count ? symbol_count : 1, sizeof(ObjSymbol));
+    obj.relocs = calloc(fixup_count ? fixup_count : 1, sizeof(ObjReloc));
+
+    if (!obj.symbols || !obj.relocs) {
+        printf("Memory allocation failed\n");
+
+        exit(1);
+    }
+
+    for (size_t i = 0; i < symbol_count; i++) {
+        obj.symbols[i].name = symbols[i].name;
+        obj.symbols[i].value = symbols[i].defined ? symbols[i].addr - origin_addr : 0;
+        obj.symbols[i].flags = (symbols[i].defined ? SYM_DEFINED : 0) | (symbols[i].name[0] == '.' ? SYM_LOCAL : 0);
+    }
+
+    obj.sym_count = symbol_count;
+
+    for (size_t i = 0; i < fixup_count; i++) {
+        Fixup *fix = &fixups[i];
+        uint32_t offset = items[fix->item].addr - origin_addr;
+
+        if (fix->operand == 0)
+            offset += fix->offset;
+        else
+            offset += (fix->operand == 1) ? 2 : 5;
+
+        obj.relocs[i].offset = offset;
+        obj.relocs[i].sym = fix->sym;
+    }
+
+    obj.reloc_count = fixup_count;
+
+    int status = write_object(out_file, &obj);
+
+    if (status == 0)
+        printf("Wrote object %s (%u bytes, %u symbols, %u relocations)\n", out_file, obj.size, obj.sym_count, obj.reloc_count);
+
+    free(obj.symbols);
+    free(obj.relocs);
+
+    return status;
+}
+
+int emit_image(const char *out_file, uint8_t *code, uint32_t code_size) {
+    FILE *output_file = fopen(out_file, "wb");
+
+    if (!output_file) {
+        printf("Unable to create file %s\n", out_file);
+
+        return 1;
+    }
+
+    uint8_t header[IMAGE_HEADER_SIZE];
+    uint32_t file_size = IMAGE_HEADER_SIZE + code_size;
+
+    write_image_header(header, origin_addr, file_size, compact ? IMAGE_FLAG_COMPACT : 0);
+
+    fwrite(header, 1, IMAGE_HEADER_SIZE, output_file);
+    fwrite(code, 1, code_size, output_file);
+
+    if (fclose(output_file) != 0) {
+        printf("Failed to write %s\n", out_file);
+
+        return 1;
+    }
+
+    printf("Wrote %u bytes to %s successfully\n", file_size, out_file);
+
+    return 0;
+}
+
+// Forgets everything parsed so far while keeping the tables allocated, so another source can be
+// assembled in the same process without running init_mnemonics again
+void reset_assembler() {
+    for (size_t i = 0; i < symbol_count; i++)
+        free(symbols[i].name);
+
+    if (symbol_slots)
+        memset(symbol_slots, 0xff, slot_cap * sizeof(size_t));
+
+    symbol_count = 0;
+    label_count = 0;
+    item_count = 0;
+    data_len = 0;
+    fixup_count = 0;
+    origin_addr = object_mode ? 0 : START_ADDR;
+    origin_set = false;
+    pc = origin_addr;
+}
+
+char *read_source(const char *filename) {
+    FILE *file = fopen(filename, "rb");
+
+    if (!file)
+        return NULL;
+
+    fseek(file, 0, SEEK_END);
+
+    long size = ftell(file);
+
+    rewind(file);
+
+    char *src = malloc(size + 1);
+
+    if (!src || fread(src, 1, size, file) != (size_t)size) {
+        free(src);
+        fclose(file);
+
+        return NULL;
+    }
+
+    src[size] = '\0';
+
+    fclose(file);
+
+    return src;
+}
+
+int assemble_file(const char *in_file, const char *out_file) {
+    const char *in_ext = get_file_ext(in_file);
+
+    if (strcmp(in_ext, "hxa") != 0) {
+        printf("Invalid file type %s\n", in_file);
+
+        return 1;
+    }
+
+    char *src = read_source(in_file);
+
+    if (!src) {
+        printf("Unable to open file %s\n", in_file);
+
+        return 1;
+    }
+
+    if (object_mode)
+        origin_addr = 0;
+
+    pc = origin_addr;
+
+    if (parse_source(src))
+        return 1;
+
+    if (optimize) {
+        size_t removed = optimize_items();
+
+        if (verbose)
+            printf("Optimizer removed %zu instructions\n", removed);
+    }
+
+    if (apply_fixups())
+        return 1;
 
+    if (verbose)
         printf("\n");
 
-        second_pass(input_file, output_file);
+    uint32_t code_size;
+    uint8_t *code = emit(&code_size);
+    int status = object_mode ? emit_object(out_file, code, code_size) : emit_image(out_file, code, code_size);
+
+    if (status == 0 && list_file != NULL)
+        status = write_listing(list_file, code);
+
+    if (status == 0 && map_file != NULL)
+        status = write_map(map_file);
+
+    free(code);
+
+    return status;
+}
+
+char *object_name(const char *in_file) {
+    size_t len = strlen(in_file) - strlen(get_file_ext(in_file));
+    // an input without an extension gets the dot as well, so foo becomes foo.hxo
+    bool add_dot = len == 0 || in_file[len - 1] != '.';
+    char *name = malloc(len + 5);
+
+    if (!name) {
+        printf("Memory allocation failed\n");
+
+        exit(1);
+    }
+
+    memcpy(name, in_file, len);
+    strcpy(name + len, add_dot ? ".hxo" : "hxo");
+
+    return name;
+}
+
+bool up_to_date(const char *in_file, const char *out_file) {
+    struct stat in_st, out_st;
+
+    if (stat(in_file, &in_st) != 0 || stat(out_file, &out_st) != 0)
+        return false;
+
+    if (out_st.st_mtim.tv_sec != in_st.st_mtim.tv_sec)
+        return out_st.st_mtim.tv_sec > in_st.st_mtim.tv_sec;
+
+    return out_st.st_mtim.tv_nsec >= in_st.st_mtim.tv_nsec;
+}
 
-        fclose(input_file);
+int assemble_objects(char **files, int count, int jobs) {
+    int next = 0;
+    int running = 0;
+    int failed = 0;
 
-        fseek(output_file, 0, SEEK_END);
+    while (next < count || running > 0) {
+        if (next < count && running < jobs) {
+            char *out_file = object_name(files[next]);
+
+            if (up_to_date(files[next], out_file)) {
+                printf("%s is up to date\n", out_file);
+            } else {
+                fflush(stdout);
+
+                pid_t pid = fork();
+
+                if (pid == 0)
+                    exit(assemble_file(files[next], out_file));
+
+                if (pid < 0) {
+                    printf("Unable to start job for %s\n", files[next]);
+                    failed++;
+                } else
+                    running++;
+            }
 
-        uint32_t file_size = (uint32_t)ftell(output_file);
+            free(out_file);
+            next++;
+
+            continue;
+        }
+
+        int status;
+
+        if (wait(&status) < 0)
+            break;
+
+        running--;
+
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            failed++;
+    }
+
+    if (failed)
+        printf("%d file(s) failed to assemble\n", failed);
+
+    return failed ? 1 : 0;
+}
+
+int main(int argc, char *argv[]) {
+    char **in_files = malloc(argc * sizeof(char *));
+    int in_count = 0;
+    char *out_file = NULL;
+    char *dump_file = NULL;
+    long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-f") == 0 && i + 1 < argc)
+            in_files[in_count++] = argv[++i];
+        else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+            out_file = argv[++i];
+        else if (strcmp(argv[i], "-dump") == 0 && i + 1 < argc)
+            dump_file = argv[++i];
+        else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc)
+            list_file = argv[++i];
+        else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc)
+            map_file = argv[++i];
+        else if (strcmp(argv[i], "-v") == 0)
+            verbose = true;
+        else if (strcmp(argv[i], "-O") == 0)
+            optimize = true;
+        else if (strcmp(argv[i], "-compact") == 0)
+            compact = true;
+        else if (strcmp(argv[i], "-c") == 0)
+            object_mode = true;
+        else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+            jobs = strtol(argv[++i], NULL, 10);
+        else if (argv[i][0] != '-')
+            in_files[in_count++] = argv[i];
+    }
+
+    if (jobs < 1)
+        jobs = 1;
+
+    if (dump_file == NULL) {
+        bool single = in_count == 1 && (!object_mode || out_file != NULL);
+
+        if (in_count == 0 || (!object_mode && (in_count != 1 || out_file == NULL)) || (out_file != NULL && in_count != 1) ||
+            (!single && (list_file != NULL || map_file != NULL)) || (object_mode && map_file != NULL)) {
+            printf("Usage: hexa_asm -f <file.hxa> -o <file.bin> [-l <file.lst>] [-m <file.map>] [-O] [-compact] [-v]\n");
+            printf("       hexa_asm -c [-j <jobs>] [-O] [-compact] <file.hxa>... (writes <file.hxo> for each input)\n");
+            printf("       hexa_asm -c -f <file.hxa> -o <file.hxo> [-l <file.lst>]\n");
+
+            return 1;
+        }
 
-        fseek(output_file, 6, SEEK_SET);
-        fputc((file_size >> 16) & 0x0f, output_file);
-        fputc((file_size >> 8) & 0xff, output_file);
-        fputc(file_size & 0xff, output_file);
+        init_mnemonics();
 
-        fclose(output_file);
+        if (out_file != NULL)
+            return assemble_file(in_files[0], out_file);
 
-        printf("Wrote %d bytes to %s successfully\n", file_size, out_file);
+        return assemble_objects(in_files, in_count, (int)jobs);
     } else {
         const char *dump_ext = get_file_ext(dump_file);
 
@@ -0,0 +1,208 @@
+#include "blit.h"
+#include "cpu.h"
+#include "instruction_set.h"
+#include "memory.h"
+#include "debug.h"
+#include "pic.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+typedef struct {
+    int32_t x;
+    int32_t y;
+    int32_t src_x;
+    int32_t src_y;
+    int32_t width;
+    int32_t height;
+} BlitRect;
+
+uint16_t blit_reg(CPU *cpu, uint32_t addr) {
+    return (cpu->memory[addr] << 8) | cpu->memory[addr + 1];
+}
+
+void blit_set_reg(CPU *cpu, uint32_t addr, uint16_t value) {
+    cpu->memory[addr] = (value >> 8) & 0xff;
+    cpu->memory[addr + 1] = value & 0xff;
+}
+
+void blit_row_fill(uint8_t *dst, uint8_t color, uint32_t len) {
+    uint32_t i = 0;
+
+#ifdef __SSE2__
+    __m128i colors = _mm_set1_epi8((char)color);
+
+    for (; i + 16 <= len; i += 16)
+        _mm_storeu_si128((__m128i *)(dst + i), colors);
+#endif
+
+    for (; i < len; i++)
+        dst[i] = color;
+}
+
+void blit_row_transparent(uint8_t *dst, const uint8_t *src, uint8_t key, uint32_t len) {
+    uint32_t i = 0;
+
+#ifdef __SSE2__
+    __m128i keys = _mm_set1_epi8((char)key);
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i pixels = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i old = _mm_loadu_si128((const __m128i *)(dst + i));
+        __m128i keep = _mm_cmpeq_epi8(pixels, keys);
+
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_or_si128(_mm_and_si128(keep, old), _mm_andnot_si128(keep, pixels)));
+    }
+#endif
+
+    for (; i < len; i++) {
+        if (src[i] != key)
+            dst[i] = src[i];
+    }
+}
+
+// Clips the destination (and for copies the source) rectangle to the screen
+bool blit_clip(BlitRect *rect, bool clip_src) {
+    int32_t left = -rect->x;
+    int32_t top = -rect->y;
+
+    if (clip_src && -rect->src_x > left)
+        left = -rect->src_x;
+
+    if (clip_src && -rect->src_y > top)
+        top = -rect->src_y;
+
+    if (left > 0) {
+        rect->x += left;
+        rect->src_x += left;
+        rect->width -= left;
+    }
+
+    if (top > 0) {
+        rect->y += top;
+        rect->src_y += top;
+        rect->height -= top;
+    }
+
+    if (rect->x + rect->width > FRAMEBUFFER_WIDTH)
+        rect->width = FRAMEBUFFER_WIDTH - rect->x;
+
+    if (rect->y + rect->height > FRAMEBUFFER_HEIGHT)
+        rect->height = FRAMEBUFFER_HEIGHT - rect->y;
+
+    if (clip_src && rect->src_x + rect->width > FRAMEBUFFER_WIDTH)
+        rect->width = FRAMEBUFFER_WIDTH - rect->src_x;
+
+    if (clip_src && rect->src_y + rect->height > FRAMEBUFFER_HEIGHT)
+        rect->height = FRAMEBUFFER_HEIGHT - rect->src_y;
+
+    return rect->width > 0 && rect->height > 0;
+}
+
+bool blit_source_ok(CPU *cpu, uint32_t addr, uint32_t len) {
+    uint32_t end = addr + len;
+
+    if (end > MEM_SIZE)
+        return false;
+
+    while (addr < end) {
+        uint32_t page_end = ((addr >> PAGE_SHIFT) + 1) << PAGE_SHIFT;
+
+        if (page_end > end)
+            page_end = end;
+
+        // regions only change once inside a split page, so both ends cover it
+        if ((page_attr(cpu, addr) & (PAGE_R | PAGE_MMIO)) != PAGE_R || (page_attr(cpu, page_end - 1) & (PAGE_R | PAGE_MMIO)) != PAGE_R)
+            return false;
+
+        addr = page_end;
+    }
+
+    return true;
+}
+
+void blit_row(CPU *cpu, uint32_t dst, const uint8_t *src, uint16_t ctrl, uint8_t color, uint32_t len) {
+    uint8_t old[FRAMEBUFFER_WIDTH + 1];
+    bool watched = watch_range(cpu, dst, len, WATCH_WRITE);
+
+    if (watched)
+        memcpy(old, &cpu->memory[dst], len);
+
+    if (ctrl & BLT_CTRL_SPRITE)
+        blit_row_transparent(&cpu->memory[dst], src, color, len);
+    else if (ctrl & BLT_CTRL_COPY)
+        memmove(&cpu->memory[dst], src, len);
+    else
+        blit_row_fill(&cpu->memory[dst], color, len);
+
+    if (watched)
+        watch_dma(cpu, dst, len, WATCH_WRITE, old);
+}
+
+int blit_run(CPU *cpu, uint16_t ctrl) {
+    bool copy = ctrl & BLT_CTRL_COPY;
+    bool sprite = ctrl & BLT_CTRL_SPRITE;
+    uint8_t color = blit_reg(cpu, BLT_COLOR) & 0xff;
+    BlitRect rect = {
+        .x = (int16_t)blit_reg(cpu, BLT_DST_X),
+        .y = (int16_t)blit_reg(cpu, BLT_DST_Y),
+        .src_x = copy ? (int16_t)blit_reg(cpu, BLT_SRC_X) : 0,
+        .src_y = copy ? (int16_t)blit_reg(cpu, BLT_SRC_Y) : 0,
+        .width = blit_reg(cpu, BLT_WIDTH),
+        .height = blit_reg(cpu, BLT_HEIGHT)
+    };
+
+    if (copy && sprite)
+        return BLT_STATUS_ERROR;
+
+    uint32_t pitch = blit_reg(cpu, BLT_SRC_PITCH);
+    uint32_t sprite_addr = seg_offset(blit_reg(cpu, BLT_SRC_SEG), blit_reg(cpu, BLT_SRC_OFF));
+
+    if (pitch == 0)
+        pitch = rect.width;
+
+    if (!blit_clip(&rect, copy))
+        return BLT_STATUS_DONE;
+
+    if (sprite && !blit_source_ok(cpu, sprite_addr + rect.src_y * pitch + rect.src_x, (rect.height - 1) * pitch + rect.width))
+        return BLT_STATUS_ERROR;
+
+    uint32_t dst = FRAMEBUFFER_ADDR + rect.y * FRAMEBUFFER_WIDTH + rect.x;
+    uint32_t src = copy ? FRAMEBUFFER_ADDR + rect.src_y * FRAMEBUFFER_WIDTH + rect.src_x : sprite_addr + rect.src_y * pitch + rect.src_x;
+    int32_t dst_step = FRAMEBUFFER_WIDTH;
+    int32_t src_step = copy ? FRAMEBUFFER_WIDTH : pitch;
+
+    // walk upwards when copying down so that overlapping rows are read before they are written
+    if (copy && rect.y > rect.src_y) {
+        dst += (rect.height - 1) * FRAMEBUFFER_WIDTH;
+        src += (rect.height - 1) * FRAMEBUFFER_WIDTH;
+        dst_step = -dst_step;
+        src_step = -src_step;
+    }
+
+    for (int32_t row = 0; row < rect.height; row++) {
+        if (sprite && watch_range(cpu, src, rect.width, WATCH_READ))
+            watch_dma(cpu, src, rect.width, WATCH_READ, NULL);
+
+        blit_row(cpu, dst, &cpu->memory[src], ctrl, color, rect.width);
+        dst += dst_step;
+        src += src_step;
+    }
+
+    mark_framebuffer_dirty(cpu, FRAMEBUFFER_ADDR + rect.y * FRAMEBUFFER_WIDTH + rect.x, (rect.height - 1) * FRAMEBUFFER_WIDTH + rect.width);
+
+    return BLT_STATUS_DONE;
+}
+
+void blit_start(CPU *cpu) {
+    uint16_t ctrl = blit_reg(cpu, BLT_CTRL);
+
+    blit_set_reg(cpu, BLT_CTRL, ctrl & ~BLT_CTRL_START);
+
+    // the whole operation completes before the next instruction
+    blit_set_reg(cpu, BLT_STATUS, blit_run(cpu, ctrl));
+
+    if (ctrl & BLT_CTRL_IRQ)
+        pic_raise(cpu, BLT_IRQ);
+}
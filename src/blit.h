@@ -0,0 +1,10 @@
+#ifndef BLIT_H
+#define BLIT_H
+
+#include "common.h"
+
+void blit_row_fill(uint8_t *dst, uint8_t color, uint32_t len);
+void blit_row_transparent(uint8_t *dst, const uint8_t *src, uint8_t key, uint32_t len);
+void blit_start(CPU *cpu);
+
+#endif
@@ -7,16 +7,41 @@
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "libhexa.h"
 
 #define ADDR_MASK 0xfffff
 #define SEG_SHIFT 4
 #define INST_SIZE 8
+#define COMPACT_INST_SIZE 4
+#define INST_COMPACT 0x80
+
+#define IMAGE_FLAG_COMPACT (1 << 0)
 
 #define REG_NUM 8
 #define MEM_SIZE (1 << 20)
 
+#define PAGE_SHIFT 8
+#define PAGE_SIZE (1 << PAGE_SHIFT)
+#define PAGE_COUNT (MEM_SIZE >> PAGE_SHIFT)
+
+#define PAGE_R (1 << 0)
+#define PAGE_W (1 << 1)
+#define PAGE_X (1 << 2)
+#define PAGE_SUPER (1 << 3)
+#define PAGE_MMIO (1 << 4)
+#define PAGE_VIDEO (1 << 5)
+#define PAGE_SPLIT (1 << 7)
+
 #define MODE_VAL_IMM 0x00
 #define MODE_VAL_IND 0x01
+#define MODE_BASE_DISP 0x02
+#define MODE_BASE_INDEX 0x03
+#define MODE_POST_INC 0x04
+#define MODE_PRE_DEC 0x05
+#define MODE_MASK 0x0f
+#define MODE_BASE_SHIFT 4
 
 #define START_ADDR 0x0012c
 #define BIOS_ADDR 0xffbde
@@ -26,6 +51,9 @@
 #define FRAMEBUFFER_WIDTH 320
 #define FRAMEBUFFER_HEIGHT 200
 
+#define DEVICE_ADDR 0xefa00
+#define DEVICE_END 0xefb00
+
 #define FLAG_EQUAL (1 << 0)
 #define FLAG_LESS (1 << 1)
 #define FLAG_GREATER (1 << 2)
@@ -62,6 +90,82 @@
 #define DISK_STATUS_DONE (1 << 3)
 #define DISK_STATUS_WRITE_PROTECT (1 << 4)
 
+#define TIMER_IRQ 0x01
+
+#define DMA_SRC_SEG 0xefa00
+#define DMA_SRC_OFF 0xefa02
+#define DMA_DST_SEG 0xefa04
+#define DMA_DST_OFF 0xefa06
+#define DMA_COUNT 0xefa08
+#define DMA_STRIDE 0xefa0a
+#define DMA_CTRL 0xefa0c
+#define DMA_STATUS 0xefa0e
+
+#define DMA_CTRL_START (1 << 0)
+#define DMA_CTRL_FILL (1 << 1)
+#define DMA_CTRL_IRQ (1 << 2)
+
+#define DMA_STATUS_BUSY (1 << 0)
+#define DMA_STATUS_DONE (1 << 1)
+#define DMA_STATUS_ERROR (1 << 2)
+
+#define DMA_IRQ 0x05
+
+#define BLT_SRC_SEG 0xefa20
+#define BLT_SRC_OFF 0xefa22
+#define BLT_SRC_PITCH 0xefa24
+#define BLT_SRC_X 0xefa26
+#define BLT_SRC_Y 0xefa28
+#define BLT_DST_X 0xefa2a
+#define BLT_DST_Y 0xefa2c
+#define BLT_WIDTH 0xefa2e
+#define BLT_HEIGHT 0xefa30
+#define BLT_COLOR 0xefa32
+#define BLT_CTRL 0xefa34
+#define BLT_STATUS 0xefa36
+
+#define BLT_CTRL_START (1 << 0)
+#define BLT_CTRL_COPY (1 << 1)
+#define BLT_CTRL_SPRITE (1 << 2)
+#define BLT_CTRL_IRQ (1 << 3)
+
+#define BLT_STATUS_DONE (1 << 1)
+#define BLT_STATUS_ERROR (1 << 2)
+
+#define BLT_IRQ 0x06
+
+#define PIC_PENDING 0xefa40
+#define PIC_MASK 0xefa42
+#define PIC_IN_SERVICE 0xefa44
+#define PIC_EOI 0xefa46
+#define PIC_CTRL 0xefa48
+#define PIC_PRIORITY 0xefa4a
+
+#define PIC_CTRL_AUTO_EOI (1 << 0)
+#define PIC_CTRL_ROTATE (1 << 1)
+
+#define PIC_LINES 16
+
+#define MAX_CORES 8
+#define MAX_EVENTS 16
+#define MAX_WATCHPOINTS 64
+#define MAX_SYMBOL_NAME 256
+#define MAX_SERIAL_PATTERN 256
+#define DECODE_CACHE_SIZE 256
+
+#define SMP_CORE_COUNT 0xefa60
+#define SMP_START_SEG 0xefa62
+#define SMP_START_OFF 0xefa64
+#define SMP_START 0xefa66
+#define SMP_IPI 0xefa68
+
+#define SIGNAL_START (1 << 0)
+#define SIGNAL_IPI (1 << 1)
+
+#define IPI_IRQ 0x07
+
+typedef struct Machine Machine;
+
 enum REGS {
     R0 = 0x00,
     R1 = 0x01,
@@ -78,7 +182,9 @@ enum REGS {
     PC = 0x0c,
     IP = 0x0d,
     SP = 0x0e,
-    FLAGS = 0x0f
+    FLAGS = 0x0f,
+    ES = 0x10,
+    ID = 0x11
 };
 
 typedef struct {
@@ -88,27 +194,177 @@ typedef struct {
     uint8_t mode2;
     uint16_t operand2;
     uint8_t padding;
+    uint8_t size;
+    uint8_t form;
 } Instruction;
 
+// An entry is only used while memory still holds the bytes it was decoded from, so writes never
+// have to invalidate it; tag is the address plus one, which keeps a zeroed entry from matching
+typedef struct {
+    uint64_t bytes;
+    uint32_t tag;
+    Instruction inst;
+} DecodedInstruction;
+
 typedef struct {
     uint16_t registers[REG_NUM];
+    Machine *machine;
     uint16_t cs;
     uint16_t ss;
     uint16_t ds;
     uint16_t us;
+    uint16_t es;
     uint32_t pc;
     uint8_t ip;
     uint16_t sp;
     uint16_t flags;
+    // CMP leaves its operands here instead of the condition bits in flags; see sync_flags
+    bool flags_lazy;
+    uint16_t flags_a;
+    uint16_t flags_b;
     uint16_t cycle_count;
     uint16_t cycles_per_sleep;
-    uint8_t memory[MEM_SIZE];
+    uint16_t core_id;
+    bool pc_modified;
+    uint64_t executed;
+    atomic_uint signals;
+    atomic_uint start_addr;
+    uint8_t page_attr[PAGE_COUNT];
+    uint8_t *memory;
+    DecodedInstruction decoded[DECODE_CACHE_SIZE];
 } CPU;
 
+typedef void (*EventHandler)(CPU *cpu);
+
+typedef struct {
+    EventHandler handler;
+    uint64_t when;
+} Event;
+
+typedef struct {
+    uint32_t addr;
+    uint32_t len;
+    uint8_t type;
+} Watchpoint;
+
+typedef struct {
+    char *name;
+    uint32_t addr;
+    uint32_t size;
+} DebugSymbol;
+
+typedef struct {
+    uint16_t src_seg;
+    uint16_t src_off;
+    uint16_t dst_seg;
+    uint16_t dst_off;
+    uint16_t count;
+    uint16_t stride;
+    uint16_t value;
+    bool fill;
+    bool irq;
+} DmaTransfer;
+
+typedef struct {
+    uint16_t pending;
+    uint16_t mask;
+    uint16_t in_service;
+    uint16_t ctrl;
+    uint16_t priority;
+} PicState;
+
+// Everything one emulated machine owns; the cores, devices and debug state never touch globals
+struct Machine {
+    CPU cores[MAX_CORES];
+    uint16_t core_count;
+    uint8_t *memory;
+    bool hle_bios;
+    atomic_bool stop;
+
+    bool framebuffer_dirty;
+    uint16_t framebuffer_dirty_first;
+    uint16_t framebuffer_dirty_last;
+
+    char *disk_name;
+    const uint8_t *disk_data;
+    uint8_t *disk_buffer;
+    size_t disk_size;
+    bool disk_mapped;
+
+    char serial_pattern[MAX_SERIAL_PATTERN];
+    size_t serial_pattern_len;
+    char serial_history[MAX_SERIAL_PATTERN];
+    size_t serial_history_len;
+    bool serial_pattern_seen;
+
+    Event events[MAX_EVENTS];
+    size_t event_count;
+    _Atomic uint64_t sched_cycles;
+    _Atomic uint64_t sched_next;
+
+    DmaTransfer dma;
+    PicState pic;
+    atomic_uint pic_ready;
+    pthread_mutex_t device_mutex;
+
+    uint16_t bp_pages[PAGE_COUNT];
+    uint8_t *bp_bitmap;
+    uint8_t watch_pages[PAGE_COUNT];
+    Watchpoint watchpoints[MAX_WATCHPOINTS];
+    size_t watch_count;
+    bool watch_triggered;
+    uint32_t watch_trigger_addr;
+    uint8_t watch_trigger_type;
+
+    bool track_dirty;
+    uint8_t clean_pages[PAGE_COUNT];
+    uint16_t dirty_pages[PAGE_COUNT];
+    size_t dirty_count;
+    size_t dirty_fixed;
+    uint8_t *snapshot_memory;
+    Machine *snapshot;
+
+    uint8_t aot_pages[PAGE_COUNT];
+    atomic_uint aot_epoch;
+
+    DebugSymbol *debug_symbols;
+    size_t debug_symbol_count;
+    size_t debug_symbol_cap;
+    char symbol_buffer[MAX_SYMBOL_NAME + 16];
+
+    HexaCallbacks callbacks;
+
+    HexaStats *stats;
+    HexaStats own_stats;
+};
+
+// Stats are read by other processes and updated from every core's thread
+static inline void stat_add(uint64_t *counter, uint64_t value) {
+    __atomic_fetch_add(counter, value, __ATOMIC_RELAXED);
+}
+
+// Anything that reads flags as a whole (PUSH FLAGS, interrupt and exception entry, debuggers and
+// snapshots) calls this first; anything that writes them as a whole goes through write_flags
+static inline void sync_flags(CPU *cpu) {
+    if (!cpu->flags_lazy)
+        return;
+
+    cpu->flags &= ~(FLAG_EQUAL | FLAG_LESS | FLAG_GREATER | FLAG_ZERO);
+
+    if (cpu->flags_a == cpu->flags_b)
+        cpu->flags |= FLAG_EQUAL | FLAG_ZERO;
+    else if (cpu->flags_a < cpu->flags_b)
+        cpu->flags |= FLAG_LESS;
+    else
+        cpu->flags |= FLAG_GREATER;
+
+    cpu->flags_lazy = false;
+}
+
 void cpu_push(CPU *cpu, uint16_t val);
 uint16_t cpu_pop(CPU *cpu);
 uint32_t seg_offset(uint16_t segment, uint16_t offset);
-void cpu_interrupt(CPU *cpu, uint16_t status);
+bool cpu_interrupt(CPU *cpu, uint16_t status);
 void cpu_exception(CPU *cpu, uint16_t status);
 
 #endif
\ No newline at end of file
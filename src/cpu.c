@@ -1,13 +1,24 @@
 #include "cpu.h"
 #include "instruction_set.h"
+#include "memory.h"
+#include "debug.h"
+#include "events.h"
+#include "serial.h"
+#include "pic.h"
 
 inline void cpu_push(CPU *cpu, uint16_t val) {
     uint32_t addr;
     uint32_t curr_addr = seg_offset(cpu->ss, cpu->sp);
 
-    if (curr_addr >= BIOS_ADDR || curr_addr < START_ADDR)
+    if (!page_allowed(cpu, curr_addr, ACCESS_DATA, PAGE_MMIO))
         cpu_exception(cpu, 0x07);
 
+    uint32_t hi_addr = seg_offset(cpu->ss, cpu->sp - 1);
+    uint32_t lo_addr = seg_offset(cpu->ss, cpu->sp - 2);
+
+    if (page_watched(cpu, hi_addr, WATCH_WRITE) || page_watched(cpu, lo_addr, WATCH_WRITE))
+        watch_access(cpu, lo_addr, 2, WATCH_WRITE, (cpu->memory[hi_addr] << 8) | cpu->memory[lo_addr], val);
+
     cpu->sp--;
     addr = seg_offset(cpu->ss, cpu->sp);
     cpu->memory[addr] = (uint8_t)((val >> 8) & 0xff);
@@ -22,7 +33,7 @@ inline uint16_t cpu_pop(CPU *cpu) {
     uint8_t lo, hi;
     uint32_t curr_addr = seg_offset(cpu->ss, cpu->sp);
 
-    if (curr_addr >= BIOS_ADDR || curr_addr < START_ADDR)
+    if (!page_allowed(cpu, curr_addr, ACCESS_DATA, PAGE_MMIO))
         cpu_exception(cpu, 0x07);
 
     addr = seg_offset(cpu->ss, cpu->sp);
@@ -33,6 +44,9 @@ inline uint16_t cpu_pop(CPU *cpu) {
     hi = cpu->memory[addr];
     cpu->sp++;
 
+    if (page_watched(cpu, curr_addr, WATCH_READ) || page_watched(cpu, addr, WATCH_READ))
+        watch_access(cpu, curr_addr, 2, WATCH_READ, (hi << 8) | lo, (hi << 8) | lo);
+
     return (hi << 8) | lo;
 }
 
@@ -40,6 +54,7 @@ inline uint32_t seg_offset(uint16_t segment, uint16_t offset) {
     return (((uint32_t)segment << SEG_SHIFT) + offset) & ADDR_MASK;
 }
 
+// Puts the boot core into its reset state; the machine has already given it memory
 void init_cpu(CPU *cpu) {
     cpu->cycle_count = 0;
     cpu->cycles_per_sleep = 0;
@@ -47,9 +62,6 @@ void init_cpu(CPU *cpu) {
     cpu->pc = 0x0000;
     cpu->flags |= (FLAG_INT_DONE | FLAG_RESET);
     
-    for (size_t i = 0; i < MEM_SIZE; i++)
-        cpu->memory[i] = 0;
-    
     cpu->memory[0x00000] = 0x00;
     cpu->memory[0x00001] = 0x01;
     cpu->memory[0x00002] = 0x00;
@@ -69,20 +81,29 @@ void init_cpu(CPU *cpu) {
     
     cpu->memory[SERIAL_STATUS] |= SERIAL_STATUS_TX_READY;
     cpu->memory[DISK_STATUS] |= DISK_STATUS_READY;
+
+    pic_reset(cpu);
+    update_pages(cpu);
 }
 
-uint32_t load_bios(CPU *cpu, uint8_t *bios) {
+uint32_t load_bios(CPU *cpu, const uint8_t *bios, size_t bios_size) {
+    if (bios_size < 10)
+        return 0;
+
     uint32_t start_addr = (bios[2] << 16) | (bios[3] << 8) | bios[4];
     start_addr &= ADDR_MASK;
 
     uint32_t size = (bios[6] << 16) | (bios[7] << 8) | bios[8];
     size &= ADDR_MASK;
 
-    if (bios[0] == 0x88 && bios[1] == 0xcc) {
-        for (size_t i = 10; i < size; i++)
-            cpu->memory[(start_addr + (i - 10)) & ADDR_MASK] = bios[i];
+    if (bios[0] == 0x88 && bios[1] == 0xcc && size > 10 && size <= bios_size) {
+        uint32_t len = size - 10;
+        uint32_t first = (len < MEM_SIZE - start_addr) ? len : MEM_SIZE - start_addr;
+
+        memcpy(&cpu->memory[start_addr], bios + 10, first);
+        memcpy(cpu->memory, bios + 10 + first, len - first);
         
-        return size - 10;
+        return len;
     } else
         return 0;
 }
@@ -95,27 +116,52 @@ int step_program(CPU *cpu, Instruction inst) {
     if (status != 0) {
         cpu_exception(cpu, status);
 
-        return 1;
+        return status;
     }
 
     return 0;
 }
 
-void cpu_interrupt(CPU *cpu, uint16_t status) {
-    if (!(cpu->flags & FLAG_INT_ENABLED) || !(cpu->flags & FLAG_INT_DONE))
+// Bookkeeping after every instruction; the boot core also drives the devices and the timer
+void tick_core(CPU *cpu) {
+    cpu->executed++;
+    smp_poll(cpu);
+
+    if (cpu->core_id != 0)
         return;
 
+    sched_tick(cpu);
+    cpu->cycle_count++;
+
+    if (cpu->cycle_count >= cpu->cycles_per_sleep) {
+        cpu->cycle_count = 0;
+
+        poll_serial(cpu);
+        pic_raise(cpu, TIMER_IRQ);
+    }
+
+    if (pic_ready(cpu->machine) && (cpu->flags & (FLAG_INT_ENABLED | FLAG_INT_DONE)) == (FLAG_INT_ENABLED | FLAG_INT_DONE))
+        pic_deliver(cpu);
+}
+
+bool cpu_interrupt(CPU *cpu, uint16_t status) {
+    if (!(cpu->flags & FLAG_INT_ENABLED) || !(cpu->flags & FLAG_INT_DONE))
+        return false;
+
     if (cpu->flags & FLAG_USER_MODE)
         cpu_push(cpu, cpu->us);
     else
         cpu_push(cpu, cpu->cs);
     
-    cpu_push(cpu, cpu->pc + INST_SIZE);
+    cpu_push(cpu, cpu->pc);
+    sync_flags(cpu);
     cpu_push(cpu, cpu->flags);
     cpu_push(cpu, status);
 
     cpu->flags &= ~FLAG_USER_MODE;
 
+    stat_add(&cpu->machine->stats->interrupts[status % HEXA_STATS_VECTORS], 1);
+
     uint32_t ivt_entry = IVT_ADDR + (status * 4);
     uint16_t segment = (cpu->memory[ivt_entry] << 8) | cpu->memory[ivt_entry + 1];
     uint16_t offset = (cpu->memory[ivt_entry + 2] << 8) | cpu->memory[ivt_entry + 3];
@@ -124,28 +170,44 @@ void cpu_interrupt(CPU *cpu, uint16_t status) {
     cpu->pc = seg_offset(segment, offset);
     cpu->flags &= ~FLAG_INT_DONE;
     cpu->flags &= ~FLAG_HALTED;
+
+    return true;
 }
 
 void cpu_exception(CPU *cpu, uint16_t status) {
+    HexaCallbacks *callbacks = &cpu->machine->callbacks;
+
+    stat_add(&cpu->machine->stats->exceptions, 1);
+    sync_flags(cpu);
+
     if (!(cpu->flags & FLAG_EXCEPTION)) {
         cpu->flags |= FLAG_EXCEPTION;
         cpu->flags &= ~FLAG_INT_ENABLED;
         cpu->flags |= FLAG_HALTED;
 
-        cpu_push(cpu, cpu->pc + INST_SIZE);
+        cpu_push(cpu, cpu->pc + inst_length(cpu, cpu->pc));
         cpu_push(cpu, cpu->pc);
         cpu_push(cpu, cpu->ip);
         cpu_push(cpu, cpu->flags);
         cpu_push(cpu, status);
 
-        printf("\nError: Exception occurred\n  addr: 0x%05x\n  status: %d\n  0x%02x 0x%02x 0x%02x 0x%02x 0x%02x 0x%02x 0x%02x 0x%02x\n",
-            cpu->pc, status, cpu->memory[cpu->pc], cpu->memory[cpu->pc + 1], cpu->memory[cpu->pc + 2], cpu->memory[cpu->pc + 3],
+        if (callbacks->exception) {
+            callbacks->exception(callbacks->user, cpu->core_id, status);
+
+            return;
+        }
+
+        printf("\nError: Exception occurred\n  addr: 0x%05x%s\n  status: %d\n  0x%02x 0x%02x 0x%02x 0x%02x 0x%02x 0x%02x 0x%02x 0x%02x\n",
+            cpu->pc, symbolize(cpu->machine, cpu->pc), status, cpu->memory[cpu->pc], cpu->memory[cpu->pc + 1], cpu->memory[cpu->pc + 2], cpu->memory[cpu->pc + 3],
             cpu->memory[cpu->pc + 4], cpu->memory[cpu->pc + 5], cpu->memory[cpu->pc + 6], cpu->memory[cpu->pc + 7]);
         
         printf("\n");
     } else {
         cpu->flags |= FLAG_DOUBLE_EXCEPTION;
 
-        printf("\nError: Double exception occurred\n");
+        if (callbacks->exception)
+            callbacks->exception(callbacks->user, cpu->core_id, status);
+        else
+            printf("\nError: Double exception occurred\n");
     }
 }
\ No newline at end of file
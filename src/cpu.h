@@ -6,7 +6,8 @@
 #define CYCLES_PER_SECOND 10000000  // 10 MHz
 
 void init_cpu(CPU *cpu);
-uint32_t load_bios(CPU *cpu, uint8_t *bios);
+uint32_t load_bios(CPU *cpu, const uint8_t *bios, size_t bios_size);
 int step_program(CPU *cpu, Instruction inst);
+void tick_core(CPU *cpu);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,359 @@
+#include <stdlib.h>
+#include "debug.h"
+#include "aot.h"
+
+bool add_breakpoint(Machine *machine, uint32_t addr) {
+    addr &= ADDR_MASK;
+
+    // most machines never get a breakpoint, so the 128 KB bitmap is allocated on first use
+    if (!machine->bp_bitmap && !(machine->bp_bitmap = calloc(MEM_SIZE / 8, 1)))
+        return false;
+
+    if (machine->bp_bitmap[addr >> 3] & (1 << (addr & 7)))
+        return true;
+
+    machine->bp_bitmap[addr >> 3] |= 1 << (addr & 7);
+    machine->bp_pages[addr >> PAGE_SHIFT]++;
+
+    return true;
+}
+
+bool remove_breakpoint(Machine *machine, uint32_t addr) {
+    addr &= ADDR_MASK;
+
+    if (!machine->bp_bitmap || !(machine->bp_bitmap[addr >> 3] & (1 << (addr & 7))))
+        return false;
+
+    machine->bp_bitmap[addr >> 3] &= ~(1 << (addr & 7));
+    machine->bp_pages[addr >> PAGE_SHIFT]--;
+
+    return true;
+}
+
+void clear_breakpoints(Machine *machine) {
+    memset(machine->bp_pages, 0, sizeof(machine->bp_pages));
+
+    if (machine->bp_bitmap)
+        memset(machine->bp_bitmap, 0, MEM_SIZE / 8);
+}
+
+void rebuild_watch_pages(Machine *machine) {
+    memset(machine->watch_pages, 0, sizeof(machine->watch_pages));
+
+    for (size_t i = 0; i < machine->watch_count; i++) {
+        Watchpoint *wp = &machine->watchpoints[i];
+        uint32_t first = wp->addr >> PAGE_SHIFT;
+        uint32_t last = ((wp->addr + wp->len - 1) & ADDR_MASK) >> PAGE_SHIFT;
+
+        for (uint32_t page = first; page != last; page = (page + 1) % PAGE_COUNT)
+            machine->watch_pages[page] |= wp->type;
+
+        machine->watch_pages[last] |= wp->type;
+    }
+
+    for (uint32_t page = 0; page < PAGE_COUNT; page++) {
+        if ((machine->track_dirty && machine->clean_pages[page]) || machine->aot_pages[page])
+            machine->watch_pages[page] |= WATCH_WRITE;
+    }
+}
+
+uint8_t page_watch_type(Machine *machine, uint32_t page) {
+    uint8_t type = 0;
+
+    for (size_t i = 0; i < machine->watch_count; i++) {
+        Watchpoint *wp = &machine->watchpoints[i];
+        uint32_t first = wp->addr >> PAGE_SHIFT;
+        uint32_t last = ((wp->addr + wp->len - 1) & ADDR_MASK) >> PAGE_SHIFT;
+
+        if (((page - first) % PAGE_COUNT) <= ((last - first) % PAGE_COUNT))
+            type |= wp->type;
+    }
+
+    // clean pages and checked AOT code pages are write-watched on top of any watchpoint
+    if ((machine->track_dirty && machine->clean_pages[page]) || machine->aot_pages[page])
+        type |= WATCH_WRITE;
+
+    return type;
+}
+
+// Clean pages are write-watched, so the first store to each one after a snapshot takes the watchpoint
+// slow path, which moves it to the dirty list. Device registers are written without going through
+// that path, so the pages holding them are always treated as dirty.
+void track_dirty_pages(Machine *machine) {
+    machine->track_dirty = true;
+    machine->dirty_count = 0;
+
+    memset(machine->clean_pages, 1, sizeof(machine->clean_pages));
+
+    for (uint32_t page = 0; page <= (START_ADDR >> PAGE_SHIFT); page++) {
+        machine->clean_pages[page] = 0;
+        machine->dirty_pages[machine->dirty_count++] = page;
+    }
+
+    for (uint32_t page = DEVICE_ADDR >> PAGE_SHIFT; page < (DEVICE_END >> PAGE_SHIFT); page++) {
+        machine->clean_pages[page] = 0;
+        machine->dirty_pages[machine->dirty_count++] = page;
+    }
+
+    machine->dirty_fixed = machine->dirty_count;
+
+    rebuild_watch_pages(machine);
+}
+
+// Called once the dirty pages have been restored; only the pages that were written need to be watched again
+void reset_dirty_pages(Machine *machine) {
+    for (size_t i = machine->dirty_fixed; i < machine->dirty_count; i++) {
+        uint16_t page = machine->dirty_pages[i];
+
+        machine->clean_pages[page] = 1;
+        machine->watch_pages[page] |= WATCH_WRITE;
+    }
+
+    machine->dirty_count = machine->dirty_fixed;
+}
+
+void mark_pages_dirty(Machine *machine, uint32_t addr, uint32_t len) {
+    if (!machine->track_dirty || len == 0)
+        return;
+
+    uint32_t page = (addr & ADDR_MASK) >> PAGE_SHIFT;
+    uint32_t last = ((addr + len - 1) & ADDR_MASK) >> PAGE_SHIFT;
+
+    while (true) {
+        if (machine->clean_pages[page]) {
+            machine->clean_pages[page] = 0;
+            machine->dirty_pages[machine->dirty_count++] = page;
+            machine->watch_pages[page] = page_watch_type(machine, page);
+        }
+
+        if (page == last)
+            break;
+
+        page = (page + 1) % PAGE_COUNT;
+    }
+}
+
+bool add_watchpoint(Machine *machine, uint32_t addr, uint32_t len, uint8_t type) {
+    if (machine->watch_count >= MAX_WATCHPOINTS || len == 0 || len > MEM_SIZE || !(type & WATCH_ACCESS))
+        return false;
+
+    Watchpoint *wp = &machine->watchpoints[machine->watch_count++];
+
+    wp->addr = addr & ADDR_MASK;
+    wp->len = len;
+    wp->type = type & WATCH_ACCESS;
+
+    rebuild_watch_pages(machine);
+
+    return true;
+}
+
+bool remove_watchpoint(Machine *machine, uint32_t addr, uint32_t len, uint8_t type) {
+    addr &= ADDR_MASK;
+
+    for (size_t i = 0; i < machine->watch_count; i++) {
+        Watchpoint *wp = &machine->watchpoints[i];
+
+        if (wp->addr == addr && wp->len == len && wp->type == type) {
+            *wp = machine->watchpoints[--machine->watch_count];
+
+            rebuild_watch_pages(machine);
+
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void clear_watchpoints(Machine *machine) {
+    machine->watch_count = 0;
+    machine->watch_triggered = false;
+
+    rebuild_watch_pages(machine);
+}
+
+bool watch_range(CPU *cpu, uint32_t addr, uint32_t len, uint8_t type) {
+    uint8_t *watch_pages = cpu->machine->watch_pages;
+
+    if (len == 0)
+        return false;
+
+    uint32_t first = (addr & ADDR_MASK) >> PAGE_SHIFT;
+    uint32_t last = ((addr + len - 1) & ADDR_MASK) >> PAGE_SHIFT;
+
+    for (uint32_t page = first; page != last; page = (page + 1) % PAGE_COUNT)
+        if (watch_pages[page] & type)
+            return true;
+
+    return watch_pages[last] & type;
+}
+
+Watchpoint *find_watchpoint(Machine *machine, uint32_t addr, uint32_t len, uint8_t type) {
+    for (size_t i = 0; i < machine->watch_count; i++) {
+        Watchpoint *wp = &machine->watchpoints[i];
+
+        if (!(wp->type & type))
+            continue;
+
+        uint32_t start = (addr - wp->addr) & ADDR_MASK;
+
+        if (start < wp->len || ((wp->addr - addr) & ADDR_MASK) < len)
+            return wp;
+    }
+
+    return NULL;
+}
+
+void report_watchpoint(CPU *cpu, uint32_t addr, uint8_t type, uint16_t old_val, uint16_t new_val) {
+    Machine *machine = cpu->machine;
+
+    machine->watch_triggered = true;
+    machine->watch_trigger_addr = addr & ADDR_MASK;
+    machine->watch_trigger_type = type;
+
+    if (type == WATCH_WRITE)
+        fprintf(stderr, "\nWatchpoint: write 0x%05x at pc 0x%05x%s: 0x%04x -> 0x%04x\n", addr & ADDR_MASK, cpu->pc, symbolize(machine, cpu->pc), old_val, new_val);
+    else
+        fprintf(stderr, "\nWatchpoint: read 0x%05x at pc 0x%05x%s: 0x%04x\n", addr & ADDR_MASK, cpu->pc, symbolize(machine, cpu->pc), new_val);
+}
+
+void watch_access(CPU *cpu, uint32_t addr, uint32_t len, uint8_t type, uint16_t old_val, uint16_t new_val) {
+    if (type == WATCH_WRITE) {
+        mark_pages_dirty(cpu->machine, addr, len);
+        aot_invalidate(cpu->machine, addr, len);
+    }
+
+    if (find_watchpoint(cpu->machine, addr, len, type))
+        report_watchpoint(cpu, addr, type, old_val, new_val);
+}
+
+void watch_dma(CPU *cpu, uint32_t addr, uint32_t len, uint8_t type, const uint8_t *old_data) {
+    if (type == WATCH_WRITE) {
+        mark_pages_dirty(cpu->machine, addr, len);
+        aot_invalidate(cpu->machine, addr, len);
+    }
+
+    Watchpoint *wp = find_watchpoint(cpu->machine, addr, len, type);
+
+    if (!wp)
+        return;
+
+    uint32_t hit = ((wp->addr - addr) & ADDR_MASK) < len ? wp->addr : addr;
+    uint32_t index = (hit - addr) & ADDR_MASK & ~1u;
+    uint16_t new_val = (cpu->memory[(addr + index) & ADDR_MASK] << 8) | cpu->memory[(addr + index + 1) & ADDR_MASK];
+    uint16_t old_val = old_data ? (old_data[index] << 8) | old_data[index + 1] : new_val;
+
+    report_watchpoint(cpu, addr + index, type, old_val, new_val);
+}
+
+int compare_debug_symbols(const void *a, const void *b) {
+    const DebugSymbol *sym_a = a;
+    const DebugSymbol *sym_b = b;
+
+    if (sym_a->addr != sym_b->addr)
+        return (sym_a->addr < sym_b->addr) ? -1 : 1;
+
+    return 0;
+}
+
+bool load_symbol_map(Machine *machine, const char *path) {
+    FILE *file = fopen(path, "r");
+    char *line = NULL;
+    size_t line_cap = 0;
+
+    if (!file)
+        return false;
+
+    // labels have no length limit in the assembler, so lines are read whole and the name runs to
+    // the end of the line
+    while (getline(&line, &line_cap, file) != -1) {
+        unsigned int addr, size;
+        int name_start = 0;
+
+        if (line[0] == ';' || sscanf(line, "%x %*x:%*x %u %n", &addr, &size, &name_start) != 2 || name_start == 0)
+            continue;
+
+        char *name = line + name_start;
+
+        name[strcspn(name, " \t\r\n")] = '\0';
+
+        if (name[0] == '\0')
+            continue;
+
+        if (machine->debug_symbol_count == machine->debug_symbol_cap) {
+            size_t new_cap = machine->debug_symbol_cap ? machine->debug_symbol_cap * 2 : 256;
+            DebugSymbol *new_syms = realloc(machine->debug_symbols, new_cap * sizeof(DebugSymbol));
+
+            if (!new_syms) {
+                free(line);
+                fclose(file);
+
+                return false;
+            }
+
+            machine->debug_symbols = new_syms;
+            machine->debug_symbol_cap = new_cap;
+        }
+
+        DebugSymbol *sym = &machine->debug_symbols[machine->debug_symbol_count++];
+
+        sym->name = strdup(name);
+        sym->addr = addr & ADDR_MASK;
+        sym->size = size;
+    }
+
+    free(line);
+    fclose(file);
+
+    qsort(machine->debug_symbols, machine->debug_symbol_count, sizeof(DebugSymbol), compare_debug_symbols);
+
+    return true;
+}
+
+void free_symbol_map(Machine *machine) {
+    for (size_t i = 0; i < machine->debug_symbol_count; i++)
+        free(machine->debug_symbols[i].name);
+
+    free(machine->debug_symbols);
+
+    machine->debug_symbols = NULL;
+    machine->debug_symbol_count = 0;
+    machine->debug_symbol_cap = 0;
+}
+
+// The result lives in the machine, so it is only valid until the next call for the same machine
+const char *symbolize(Machine *machine, uint32_t addr) {
+    DebugSymbol *debug_symbols = machine->debug_symbols;
+    char *buffer = machine->symbol_buffer;
+    size_t low = 0;
+    size_t high = machine->debug_symbol_count;
+
+    addr &= ADDR_MASK;
+
+    while (low < high) {
+        size_t mid = (low + high) / 2;
+
+        if (debug_symbols[mid].addr <= addr)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    if (low == 0)
+        return "";
+
+    // names are kept whole; only the text shown here is shortened, so the offset always fits
+    DebugSymbol *sym = &debug_symbols[low - 1];
+    uint32_t offset = addr - sym->addr;
+
+    if (offset >= sym->size && offset != 0)
+        return "";
+
+    if (offset == 0)
+        snprintf(buffer, sizeof(machine->symbol_buffer), " <%.*s>", MAX_SYMBOL_NAME - 1, sym->name);
+    else
+        snprintf(buffer, sizeof(machine->symbol_buffer), " <%.*s+0x%x>", MAX_SYMBOL_NAME - 1, sym->name, offset);
+
+    return buffer;
+}
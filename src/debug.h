@@ -0,0 +1,40 @@
+#ifndef DEBUG_H
+#define DEBUG_H
+
+#include "common.h"
+
+#define WATCH_READ (1 << 0)
+#define WATCH_WRITE (1 << 1)
+#define WATCH_ACCESS (WATCH_READ | WATCH_WRITE)
+
+bool add_breakpoint(Machine *machine, uint32_t addr);
+bool remove_breakpoint(Machine *machine, uint32_t addr);
+void clear_breakpoints(Machine *machine);
+
+bool add_watchpoint(Machine *machine, uint32_t addr, uint32_t len, uint8_t type);
+bool remove_watchpoint(Machine *machine, uint32_t addr, uint32_t len, uint8_t type);
+void clear_watchpoints(Machine *machine);
+bool watch_range(CPU *cpu, uint32_t addr, uint32_t len, uint8_t type);
+void watch_access(CPU *cpu, uint32_t addr, uint32_t len, uint8_t type, uint16_t old_val, uint16_t new_val);
+void watch_dma(CPU *cpu, uint32_t addr, uint32_t len, uint8_t type, const uint8_t *old_data);
+
+uint8_t page_watch_type(Machine *machine, uint32_t page);
+
+void track_dirty_pages(Machine *machine);
+void reset_dirty_pages(Machine *machine);
+void mark_pages_dirty(Machine *machine, uint32_t addr, uint32_t len);
+
+bool load_symbol_map(Machine *machine, const char *path);
+void free_symbol_map(Machine *machine);
+const char *symbolize(Machine *machine, uint32_t addr);
+
+// bp_pages is only non-zero once the bitmap has been allocated
+static inline bool breakpoint_hit(Machine *machine, uint32_t addr) {
+    return machine->bp_pages[addr >> PAGE_SHIFT] && (machine->bp_bitmap[addr >> 3] & (1 << (addr & 7)));
+}
+
+static inline bool page_watched(CPU *cpu, uint32_t addr, uint8_t type) {
+    return cpu->machine->watch_pages[(addr & ADDR_MASK) >> PAGE_SHIFT] & type;
+}
+
+#endif
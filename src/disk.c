@@ -1,21 +1,55 @@
+#include <stdlib.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "disk.h"
 #include "instruction_set.h"
+#include "debug.h"
 
-char *disk_name = NULL;
+// Maps a file read-only; its pages are only read from disk once they are touched
+const uint8_t *map_image(const char *path, size_t *size) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
 
-void write_disk(CPU *cpu) {
-    if (disk_name == NULL) {
-        printf("disk_name == NULL\n");
+    if (fd < 0)
+        return NULL;
 
-        return;
+    if (fstat(fd, &st) < 0 || st.st_size <= 0) {
+        close(fd);
+
+        return NULL;
     }
 
-    FILE *disk = fopen(disk_name, "wb");
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
 
-    if (disk == NULL) {
-        printf("disk == NULL\n");
+    close(fd);
 
-        fclose(disk);
+    if (data == MAP_FAILED)
+        return NULL;
+
+    *size = st.st_size;
+
+    return data;
+}
+
+bool open_disk(Machine *machine, const char *name) {
+    machine->disk_name = (char *)name;
+    machine->disk_data = map_image(name, &machine->disk_size);
+    machine->disk_mapped = machine->disk_data != NULL;
+
+    return machine->disk_data != NULL;
+}
+
+// A disk handed over as a buffer (see hexa_load_disk) is read and written in place and never grows
+void write_disk(CPU *cpu) {
+    Machine *machine = cpu->machine;
+    FILE *disk = NULL;
+
+    // failures are reported to the guest through the status register; the core never prints
+    if ((machine->disk_name == NULL && machine->disk_buffer == NULL)
+        || (machine->disk_buffer == NULL && (disk = fopen(machine->disk_name, "r+b")) == NULL)) {
+        cpu->memory[DISK_STATUS] |= DISK_STATUS_ERROR;
 
         return;
     }
@@ -27,40 +61,56 @@ void write_disk(CPU *cpu) {
     uint16_t offset = cpu->registers[R7];
     uint32_t phys_addr = seg_offset(segment, offset);
 
-    if (!(*status & DISK_STATUS_READY) || (*status & DISK_STATUS_BUSY))
+    if (!(*status & DISK_STATUS_READY) || (*status & DISK_STATUS_BUSY)) {
+        if (disk)
+            fclose(disk);
+
         return;
+    }
+
+    // a transfer running off the end of guest memory would touch host memory past the mapping
+    if (phys_addr + 512 * count > MEM_SIZE) {
+        if (disk)
+            fclose(disk);
+
+        *status |= DISK_STATUS_ERROR;
+
+        return;
+    }
     
     *status &= ~DISK_STATUS_READY;
     *status |= DISK_STATUS_BUSY;
 
-    fseek(disk, lba * 512, SEEK_SET);
+    if (watch_range(cpu, phys_addr, 512 * count, WATCH_READ))
+        watch_dma(cpu, phys_addr, 512 * count, WATCH_READ, NULL);
 
-    size_t written = fwrite(&cpu->memory[phys_addr], 512, count, disk);
+    size_t written = 0;
+
+    if (disk) {
+        fseek(disk, lba * 512, SEEK_SET);
+        written = fwrite(&cpu->memory[phys_addr], 512, count, disk);
+
+        // the disk mapping shares the page cache, so it sees the new data once the file is flushed
+        fclose(disk);
+    } else if ((size_t)(lba + count) * 512 <= machine->disk_size) {
+        memcpy(&machine->disk_buffer[lba * 512], &cpu->memory[phys_addr], 512 * count);
+        written = count;
+    }
 
     if (written == count) {
         *status |= DISK_STATUS_READY;
         *status |= DISK_STATUS_DONE;
         *status &= ~DISK_STATUS_BUSY;
-    } else {
+    } else
         *status |= DISK_STATUS_ERROR;
-
-        printf("error writing to disk\n");
-    }
 }
 
 void read_disk(CPU *cpu) {
-    if (disk_name == NULL) {
-        printf("disk_name == NULL\n");
+    Machine *machine = cpu->machine;
+    const uint8_t *disk_data = machine->disk_data;
 
-        return;
-    }
-    
-    FILE *disk = fopen(disk_name, "rb");
-
-    if (disk == NULL) {
-        printf("disk == NULL\n");
-
-        fclose(disk);
+    if (machine->disk_name == NULL && disk_data == NULL) {
+        cpu->memory[DISK_STATUS] |= DISK_STATUS_ERROR;
 
         return;
     }
@@ -75,25 +125,86 @@ void read_disk(CPU *cpu) {
     if (!(*status & DISK_STATUS_READY) || (*status & DISK_STATUS_BUSY))
         return;
 
+    if (phys_addr + 512 * count > MEM_SIZE) {
+        *status |= DISK_STATUS_ERROR;
+
+        return;
+    }
+
     *status &= ~DISK_STATUS_READY;
     *status |= DISK_STATUS_BUSY;
 
-    fseek(disk, lba * 512, SEEK_SET);
+    // sectors past the end of the mapping were appended by write_disk and are read from the file
+    FILE *disk = NULL;
+
+    if (!disk_data || (size_t)(lba + count) * 512 > machine->disk_size) {
+        disk = machine->disk_name ? fopen(machine->disk_name, "rb") : NULL;
+
+        if (disk == NULL) {
+            *status |= DISK_STATUS_ERROR;
+
+            return;
+        }
+
+        fseek(disk, lba * 512, SEEK_SET);
+    }
+
+    uint8_t *old_data = NULL;
+
+    if (watch_range(cpu, phys_addr, 512 * count, WATCH_WRITE)) {
+        old_data = malloc(512 * count);
 
-    size_t read = fread(&cpu->memory[phys_addr], 512, count, disk);
+        if (old_data)
+            memcpy(old_data, &cpu->memory[phys_addr], 512 * count);
+    }
+
+    size_t read = count;
+
+    if (disk) {
+        read = fread(&cpu->memory[phys_addr], 512, count, disk);
+        fclose(disk);
+    } else
+        memcpy(&cpu->memory[phys_addr], &disk_data[lba * 512], 512 * count);
+
+    if (old_data) {
+        watch_dma(cpu, phys_addr, 512 * count, WATCH_WRITE, old_data);
+        free(old_data);
+    }
 
     if (read == count) {
         *status |= DISK_STATUS_READY;
         *status |= DISK_STATUS_DONE;
         *status &= ~DISK_STATUS_BUSY;
 
-        if (phys_addr >= FRAMEBUFFER_ADDR && phys_addr <= FRAMEBUFFER_ADDR + (FRAMEBUFFER_WIDTH * FRAMEBUFFER_HEIGHT))
-            framebuffer_dirty = true;
+        mark_framebuffer_dirty(cpu, phys_addr, 512 * count);
 
         cpu->memory[DISK_COMMAND] = 0x0000;
-    } else {
+    } else
         *status |= DISK_STATUS_ERROR;
+}
 
-        printf("error reading from disk\n");
-    }
-}
\ No newline at end of file
+// Transfers complete synchronously, so their latency is the host time spent in them
+void disk_command(CPU *cpu, uint16_t command) {
+    HexaStats *stats = cpu->machine->stats;
+    uint16_t count = (cpu->memory[DISK_COUNT] << 8) | cpu->memory[DISK_COUNT + 1];
+    struct timespec start, end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if (command == DISK_CMD_WRITE)
+        write_disk(cpu);
+    else
+        read_disk(cpu);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    uint64_t latency = (uint64_t)(end.tv_sec - start.tv_sec) * 1000000000ull + end.tv_nsec - start.tv_nsec;
+
+    stat_add(&stats->disk_commands, 1);
+    stat_add(&stats->disk_sectors, count & 0xff);
+    stat_add(&stats->disk_latency_ns, latency);
+
+    // disk commands run under the device lock, so the maximum has a single writer
+    if (latency > stats->disk_latency_max_ns)
+        __atomic_store_n(&stats->disk_latency_max_ns, latency, __ATOMIC_RELAXED);
+}
@@ -9,6 +9,9 @@ void write_disk(CPU *cpu);
 
 void read_disk(CPU *cpu);
 
-extern char *disk_name;
+void disk_command(CPU *cpu, uint16_t command);
+
+const uint8_t *map_image(const char *path, size_t *size);
+bool open_disk(Machine *machine, const char *name);
 
 #endif
\ No newline at end of file
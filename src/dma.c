@@ -0,0 +1,109 @@
+#include "dma.h"
+#include "cpu.h"
+#include "memory.h"
+#include "events.h"
+#include "pic.h"
+
+uint16_t dma_reg(CPU *cpu, uint32_t addr) {
+    return (cpu->memory[addr] << 8) | cpu->memory[addr + 1];
+}
+
+void dma_set_reg(CPU *cpu, uint32_t addr, uint16_t value) {
+    cpu->memory[addr] = (value >> 8) & 0xff;
+    cpu->memory[addr + 1] = value & 0xff;
+}
+
+void dma_finish(CPU *cpu, uint16_t status) {
+    DmaTransfer *dma = &cpu->machine->dma;
+
+    dma_set_reg(cpu, DMA_STATUS, (dma_reg(cpu, DMA_STATUS) & ~DMA_STATUS_BUSY) | status);
+
+    if (dma->irq)
+        pic_raise(cpu, DMA_IRQ);
+}
+
+bool dma_readable(CPU *cpu, uint32_t addr) {
+    return addr % 2 == 0 && (page_attr(cpu, addr) & PAGE_R);
+}
+
+bool dma_writable(CPU *cpu, uint32_t addr) {
+    return addr % 2 == 0 && (page_attr(cpu, addr) & PAGE_W);
+}
+
+void dma_run(CPU *cpu) {
+    DmaTransfer *dma = &cpu->machine->dma;
+    uint16_t chunk = (dma->count < DMA_CHUNK) ? dma->count : DMA_CHUNK;
+
+    for (uint16_t i = 0; i < chunk; i++) {
+        uint32_t dst = seg_offset(dma->dst_seg, dma->dst_off);
+        uint16_t value = dma->value;
+
+        if (!dma->fill) {
+            uint32_t src = seg_offset(dma->src_seg, dma->src_off);
+
+            if (!dma_readable(cpu, src)) {
+                dma_finish(cpu, DMA_STATUS_ERROR);
+
+                return;
+            }
+
+            value = mem_read(cpu, src);
+            dma->src_off += 2;
+        }
+
+        if (!dma_writable(cpu, dst)) {
+            dma_finish(cpu, DMA_STATUS_ERROR);
+
+            return;
+        }
+
+        mem_write(cpu, dst, value);
+        dma->dst_off += dma->stride;
+        dma->count--;
+    }
+
+    if (dma->count)
+        schedule_event(cpu, dma_run, DMA_CHUNK);
+    else
+        dma_finish(cpu, DMA_STATUS_DONE);
+}
+
+void dma_start(CPU *cpu) {
+    DmaTransfer *dma = &cpu->machine->dma;
+    uint16_t ctrl = dma_reg(cpu, DMA_CTRL);
+    uint16_t status = dma_reg(cpu, DMA_STATUS);
+
+    dma_set_reg(cpu, DMA_CTRL, ctrl & ~DMA_CTRL_START);
+
+    if (status & DMA_STATUS_BUSY)
+        return;
+
+    dma->src_seg = dma_reg(cpu, DMA_SRC_SEG);
+    dma->src_off = dma_reg(cpu, DMA_SRC_OFF);
+    dma->dst_seg = dma_reg(cpu, DMA_DST_SEG);
+    dma->dst_off = dma_reg(cpu, DMA_DST_OFF);
+    dma->count = dma_reg(cpu, DMA_COUNT);
+    dma->stride = dma_reg(cpu, DMA_STRIDE);
+    dma->fill = ctrl & DMA_CTRL_FILL;
+    dma->irq = ctrl & DMA_CTRL_IRQ;
+
+    if (dma->stride == 0)
+        dma->stride = 2;
+
+    dma_set_reg(cpu, DMA_STATUS, DMA_STATUS_BUSY);
+
+    if (dma->fill) {
+        uint32_t src = seg_offset(dma->src_seg, dma->src_off);
+
+        if (!dma_readable(cpu, src)) {
+            dma_finish(cpu, DMA_STATUS_ERROR);
+
+            return;
+        }
+
+        dma->value = mem_read(cpu, src);
+    }
+
+    // one word per cycle, completed a chunk at a time
+    schedule_event(cpu, dma_run, (dma->count < DMA_CHUNK) ? dma->count : DMA_CHUNK);
+}
@@ -0,0 +1,10 @@
+#ifndef DMA_H
+#define DMA_H
+
+#include "common.h"
+
+#define DMA_CHUNK 64
+
+void dma_start(CPU *cpu);
+
+#endif
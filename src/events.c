@@ -0,0 +1,84 @@
+#include "events.h"
+#include "smp.h"
+
+// Callers hold the device lock, since other cores schedule events from their MMIO writes
+void update_next_event(Machine *machine) {
+    uint64_t next = UINT64_MAX;
+
+    for (size_t i = 0; i < machine->event_count; i++) {
+        if (machine->events[i].when < next)
+            next = machine->events[i].when;
+    }
+
+    machine->sched_next = next;
+}
+
+void schedule_event(CPU *cpu, EventHandler handler, uint64_t delay) {
+    Machine *machine = cpu->machine;
+    Event *events = machine->events;
+
+    if (delay == 0)
+        delay = 1;
+
+    for (size_t i = 0; i < machine->event_count; i++) {
+        if (events[i].handler == handler) {
+            events[i].when = machine->sched_cycles + delay;
+            update_next_event(machine);
+
+            return;
+        }
+    }
+
+    if (machine->event_count == MAX_EVENTS) {
+        fprintf(stderr, "Too many scheduled device events\n");
+
+        return;
+    }
+
+    events[machine->event_count].handler = handler;
+    events[machine->event_count].when = machine->sched_cycles + delay;
+    machine->event_count++;
+
+    update_next_event(machine);
+}
+
+void cancel_event(CPU *cpu, EventHandler handler) {
+    Machine *machine = cpu->machine;
+
+    for (size_t i = 0; i < machine->event_count; i++) {
+        if (machine->events[i].handler == handler) {
+            machine->events[i] = machine->events[--machine->event_count];
+
+            break;
+        }
+    }
+
+    update_next_event(machine);
+}
+
+void run_events(CPU *cpu) {
+    Machine *machine = cpu->machine;
+    Event *events = machine->events;
+    size_t i = 0;
+
+    device_lock(machine);
+
+    // handlers may schedule or cancel events, so start over after each one
+    while (i < machine->event_count) {
+        if (events[i].when > machine->sched_cycles) {
+            i++;
+
+            continue;
+        }
+
+        EventHandler handler = events[i].handler;
+
+        events[i] = events[--machine->event_count];
+        update_next_event(machine);
+        handler(cpu);
+        i = 0;
+    }
+
+    update_next_event(machine);
+    device_unlock(machine);
+}
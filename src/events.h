@@ -0,0 +1,21 @@
+#ifndef EVENTS_H
+#define EVENTS_H
+
+#include "common.h"
+
+void schedule_event(CPU *cpu, EventHandler handler, uint64_t delay);
+void cancel_event(CPU *cpu, EventHandler handler);
+void run_events(CPU *cpu);
+
+// Only the boot core advances the clock, so the increment needs no locked instruction
+static inline void sched_tick(CPU *cpu) {
+    Machine *machine = cpu->machine;
+    uint64_t cycles = atomic_load_explicit(&machine->sched_cycles, memory_order_relaxed) + 1;
+
+    atomic_store_explicit(&machine->sched_cycles, cycles, memory_order_relaxed);
+
+    if (cycles >= atomic_load_explicit(&machine->sched_next, memory_order_relaxed))
+        run_events(cpu);
+}
+
+#endif
@@ -0,0 +1,558 @@
+#include <stdlib.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "gdb.h"
+#include "debug.h"
+#include "instruction_set.h"
+#include "memory.h"
+
+#define GDB_BUF_SIZE 4096
+
+bool gdb_attached = false;
+bool gdb_stepping = false;
+
+int gdb_fd = -1;
+bool gdb_skip_bp = false;
+
+const char *gdb_target_xml =
+    "<?xml version=\"1.0\"?>"
+    "<!DOCTYPE target SYSTEM \"gdb-target.dtd\">"
+    "<target version=\"1.0\">"
+    "<feature name=\"org.hexa.core\">"
+    "<reg name=\"r0\" bitsize=\"16\" type=\"uint16\"/>"
+    "<reg name=\"r1\" bitsize=\"16\" type=\"uint16\"/>"
+    "<reg name=\"r2\" bitsize=\"16\" type=\"uint16\"/>"
+    "<reg name=\"r3\" bitsize=\"16\" type=\"uint16\"/>"
+    "<reg name=\"r4\" bitsize=\"16\" type=\"uint16\"/>"
+    "<reg name=\"r5\" bitsize=\"16\" type=\"uint16\"/>"
+    "<reg name=\"r6\" bitsize=\"16\" type=\"uint16\"/>"
+    "<reg name=\"r7\" bitsize=\"16\" type=\"uint16\"/>"
+    "<reg name=\"cs\" bitsize=\"16\" type=\"uint16\"/>"
+    "<reg name=\"ss\" bitsize=\"16\" type=\"uint16\"/>"
+    "<reg name=\"ds\" bitsize=\"16\" type=\"uint16\"/>"
+    "<reg name=\"us\" bitsize=\"16\" type=\"uint16\"/>"
+    "<reg name=\"pc\" bitsize=\"32\" type=\"code_ptr\"/>"
+    "<reg name=\"ip\" bitsize=\"8\" type=\"uint8\"/>"
+    "<reg name=\"sp\" bitsize=\"16\" type=\"uint16\"/>"
+    "<reg name=\"flags\" bitsize=\"16\" type=\"uint16\"/>"
+    "<reg name=\"es\" bitsize=\"16\" type=\"uint16\"/>"
+    "</feature>"
+    "</target>";
+
+const char gdb_hex[] = "0123456789abcdef";
+
+int gdb_hex_val(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+
+    return -1;
+}
+
+int gdb_listen(const char *addr) {
+    int server;
+
+    if (strchr(addr, '/')) {
+        struct sockaddr_un sun = {.sun_family = AF_UNIX};
+
+        strncpy(sun.sun_path, addr, sizeof(sun.sun_path) - 1);
+        unlink(addr);
+
+        server = socket(AF_UNIX, SOCK_STREAM, 0);
+
+        if (server < 0 || bind(server, (struct sockaddr *)&sun, sizeof(sun)) < 0) {
+            fprintf(stderr, "Could not bind GDB socket %s\n", addr);
+
+            return -1;
+        }
+    } else {
+        struct sockaddr_in sin = {.sin_family = AF_INET};
+        int reuse = 1;
+
+        sin.sin_port = htons((uint16_t)strtol(addr, NULL, 0));
+        sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+        server = socket(AF_INET, SOCK_STREAM, 0);
+
+        if (server >= 0)
+            setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+        if (server < 0 || bind(server, (struct sockaddr *)&sin, sizeof(sin)) < 0) {
+            fprintf(stderr, "Could not bind GDB port %s\n", addr);
+
+            return -1;
+        }
+    }
+
+    listen(server, 1);
+
+    printf("Waiting for GDB on %s...\n", addr);
+
+    gdb_fd = accept(server, NULL, NULL);
+
+    close(server);
+
+    if (gdb_fd < 0) {
+        fprintf(stderr, "Failed to accept GDB connection\n");
+
+        return -1;
+    }
+
+    if (!strchr(addr, '/')) {
+        int nodelay = 1;
+
+        setsockopt(gdb_fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    }
+
+    gdb_attached = true;
+
+    return 0;
+}
+
+int gdb_getc() {
+    uint8_t c;
+
+    if (recv(gdb_fd, &c, 1, 0) != 1)
+        return -1;
+
+    return c;
+}
+
+void gdb_send_packet(const char *data) {
+    size_t len = strlen(data);
+    char *packet = malloc(len + 5);
+    uint8_t checksum = 0;
+
+    for (size_t i = 0; i < len; i++)
+        checksum += (uint8_t)data[i];
+
+    packet[0] = '$';
+    memcpy(packet + 1, data, len);
+    packet[len + 1] = '#';
+    packet[len + 2] = gdb_hex[checksum >> 4];
+    packet[len + 3] = gdb_hex[checksum & 0x0f];
+
+    int ack;
+
+    do {
+        send(gdb_fd, packet, len + 4, 0);
+
+        ack = gdb_getc();
+    } while (ack == '-');
+
+    free(packet);
+}
+
+int gdb_read_packet(char *buf, size_t size) {
+    int c;
+
+    while (1) {
+        do {
+            c = gdb_getc();
+
+            if (c < 0)
+                return -1;
+        } while (c != '$');
+
+        size_t len = 0;
+        uint8_t checksum = 0;
+
+        while ((c = gdb_getc()) >= 0 && c != '#') {
+            if (len + 1 < size)
+                buf[len++] = (char)c;
+
+            checksum += (uint8_t)c;
+        }
+
+        if (c < 0)
+            return -1;
+
+        int hi = gdb_hex_val(gdb_getc());
+        int lo = gdb_hex_val(gdb_getc());
+
+        buf[len] = '\0';
+
+        if (hi < 0 || lo < 0 || ((hi << 4) | lo) != checksum) {
+            send(gdb_fd, "-", 1, 0);
+
+            continue;
+        }
+
+        send(gdb_fd, "+", 1, 0);
+
+        return (int)len;
+    }
+}
+
+int gdb_reg_size(int reg) {
+    if (reg == PC)
+        return 4;
+    else if (reg == IP)
+        return 1;
+
+    return 2;
+}
+
+uint32_t gdb_read_reg(CPU *cpu, int reg) {
+    if (reg >= R0 && reg <= R7)
+        return cpu->registers[reg];
+
+    switch (reg) {
+        case CS: return cpu->cs;
+        case SS: return cpu->ss;
+        case DS: return cpu->ds;
+        case US: return cpu->us;
+        case PC: return cpu->pc;
+        case IP: return cpu->ip;
+        case SP: return cpu->sp;
+        case FLAGS: sync_flags(cpu); return cpu->flags;
+        case ES: return cpu->es;
+    }
+
+    return 0;
+}
+
+void gdb_write_reg(CPU *cpu, int reg, uint32_t val) {
+    if (reg >= R0 && reg <= R7) {
+        cpu->registers[reg] = val;
+
+        return;
+    }
+
+    switch (reg) {
+        case CS: cpu->cs = val; break;
+        case SS: cpu->ss = val; break;
+        case DS: cpu->ds = val; break;
+        case US: cpu->us = val; break;
+        case PC: cpu->pc = val & ADDR_MASK; break;
+        case IP: cpu->ip = val; break;
+        case SP: cpu->sp = val; break;
+        case FLAGS: write_flags(cpu, val); break;
+        case ES: cpu->es = val; break;
+    }
+}
+
+char *gdb_put_reg(char *out, CPU *cpu, int reg) {
+    uint32_t val = gdb_read_reg(cpu, reg);
+
+    for (int i = 0; i < gdb_reg_size(reg); i++) {
+        *out++ = gdb_hex[(val >> (i * 8 + 4)) & 0x0f];
+        *out++ = gdb_hex[(val >> (i * 8)) & 0x0f];
+    }
+
+    *out = '\0';
+
+    return out;
+}
+
+const char *gdb_get_reg(const char *in, CPU *cpu, int reg) {
+    uint32_t val = 0;
+
+    for (int i = 0; i < gdb_reg_size(reg); i++) {
+        int hi = gdb_hex_val(in[0]);
+        int lo = gdb_hex_val(in[1]);
+
+        if (hi < 0 || lo < 0)
+            return NULL;
+
+        val |= (uint32_t)((hi << 4) | lo) << (i * 8);
+        in += 2;
+    }
+
+    gdb_write_reg(cpu, reg, val);
+
+    return in;
+}
+
+void gdb_handle_xfer(const char *args, char *reply) {
+    const char *prefix = "features:read:target.xml:";
+
+    if (strncmp(args, prefix, strlen(prefix)) != 0) {
+        reply[0] = '\0';
+
+        return;
+    }
+
+    unsigned long off = 0, len = 0;
+    size_t total = strlen(gdb_target_xml);
+
+    sscanf(args + strlen(prefix), "%lx,%lx", &off, &len);
+
+    if (len > GDB_BUF_SIZE - 2)
+        len = GDB_BUF_SIZE - 2;
+
+    if (off >= total) {
+        strcpy(reply, "l");
+
+        return;
+    }
+
+    if (off + len >= total) {
+        reply[0] = 'l';
+        len = total - off;
+    } else
+        reply[0] = 'm';
+
+    memcpy(reply + 1, gdb_target_xml + off, len);
+    reply[len + 1] = '\0';
+}
+
+bool gdb_stop(CPU *cpu, int signal) {
+    char buf[GDB_BUF_SIZE];
+    char reply[GDB_BUF_SIZE * 2 + 1];
+
+    if (signal == GDB_SIGTRAP && cpu->machine->watch_triggered) {
+        const char *kind = (cpu->machine->watch_trigger_type == WATCH_WRITE) ? "watch" : "rwatch";
+
+        snprintf(reply, sizeof(reply), "T%02x%s:%x;", signal, kind, cpu->machine->watch_trigger_addr);
+    } else
+        snprintf(reply, sizeof(reply), "S%02x", signal);
+
+    cpu->machine->watch_triggered = false;
+    gdb_send_packet(reply);
+
+    while (1) {
+        if (gdb_read_packet(buf, sizeof(buf)) < 0) {
+            gdb_attached = false;
+            gdb_stepping = false;
+            clear_breakpoints(cpu->machine);
+            clear_watchpoints(cpu->machine);
+
+            return true;
+        }
+
+        reply[0] = '\0';
+
+        switch (buf[0]) {
+            case '?': {
+                snprintf(reply, sizeof(reply), "S%02x", signal);
+
+                break;
+            }
+
+            case 'g': {
+                char *out = reply;
+
+                for (int reg = R0; reg <= ES; reg++)
+                    out = gdb_put_reg(out, cpu, reg);
+
+                break;
+            }
+
+            case 'G': {
+                const char *in = buf + 1;
+
+                for (int reg = R0; reg <= ES && in; reg++)
+                    in = gdb_get_reg(in, cpu, reg);
+
+                strcpy(reply, in ? "OK" : "E01");
+
+                break;
+            }
+
+            case 'p': {
+                int reg = (int)strtol(buf + 1, NULL, 16);
+
+                if (reg >= R0 && reg <= ES)
+                    gdb_put_reg(reply, cpu, reg);
+                else
+                    strcpy(reply, "E01");
+
+                break;
+            }
+
+            case 'P': {
+                char *eq = strchr(buf, '=');
+                int reg = (int)strtol(buf + 1, NULL, 16);
+
+                if (eq && reg >= R0 && reg <= ES && gdb_get_reg(eq + 1, cpu, reg))
+                    strcpy(reply, "OK");
+                else
+                    strcpy(reply, "E01");
+
+                break;
+            }
+
+            case 'm': {
+                unsigned long addr, len;
+
+                if (sscanf(buf + 1, "%lx,%lx", &addr, &len) != 2 || len > GDB_BUF_SIZE) {
+                    strcpy(reply, "E01");
+
+                    break;
+                }
+
+                for (unsigned long i = 0; i < len; i++) {
+                    uint8_t byte = cpu->memory[(addr + i) & ADDR_MASK];
+
+                    reply[i * 2] = gdb_hex[byte >> 4];
+                    reply[i * 2 + 1] = gdb_hex[byte & 0x0f];
+                }
+
+                reply[len * 2] = '\0';
+
+                break;
+            }
+
+            case 'M': {
+                unsigned long addr, len;
+                char *data = strchr(buf, ':');
+
+                if (!data || sscanf(buf + 1, "%lx,%lx", &addr, &len) != 2 || strlen(data + 1) < len * 2) {
+                    strcpy(reply, "E01");
+
+                    break;
+                }
+
+                data++;
+
+                for (unsigned long i = 0; i < len; i++) {
+                    uint32_t phys_addr = (addr + i) & ADDR_MASK;
+
+                    cpu->memory[phys_addr] = (gdb_hex_val(data[i * 2]) << 4) | gdb_hex_val(data[i * 2 + 1]);
+                    mark_framebuffer_dirty(cpu, phys_addr, 1);
+                }
+
+                strcpy(reply, "OK");
+
+                break;
+            }
+
+            case 'c':
+            case 's': {
+                if (buf[1])
+                    cpu->pc = strtoul(buf + 1, NULL, 16) & ADDR_MASK;
+
+                gdb_stepping = (buf[0] == 's');
+                gdb_skip_bp = true;
+
+                return true;
+            }
+
+            case 'Z':
+            case 'z': {
+                unsigned long addr, len;
+                bool ok;
+
+                if (buf[1] < '0' || buf[1] > '4' || buf[1] == '1' || sscanf(buf + 2, ",%lx,%lx", &addr, &len) != 2)
+                    break;
+
+                if (buf[1] == '0')
+                    ok = (buf[0] == 'Z') ? add_breakpoint(cpu->machine, addr) : remove_breakpoint(cpu->machine, addr);
+                else {
+                    uint8_t type = (buf[1] == '2') ? WATCH_WRITE : (buf[1] == '3') ? WATCH_READ : WATCH_ACCESS;
+
+                    ok = (buf[0] == 'Z') ? add_watchpoint(cpu->machine, addr, len, type) : remove_watchpoint(cpu->machine, addr, len, type);
+                }
+
+                strcpy(reply, ok ? "OK" : "E01");
+
+                break;
+            }
+
+            case 'q': {
+                if (strncmp(buf, "qSupported", 10) == 0)
+                    snprintf(reply, sizeof(reply), "PacketSize=%x;qXfer:features:read+", GDB_BUF_SIZE);
+                else if (strncmp(buf, "qXfer:", 6) == 0)
+                    gdb_handle_xfer(buf + 6, reply);
+                else if (strcmp(buf, "qAttached") == 0)
+                    strcpy(reply, "1");
+                else if (strcmp(buf, "qC") == 0)
+                    strcpy(reply, "QC1");
+                else if (strcmp(buf, "qfThreadInfo") == 0)
+                    strcpy(reply, "m1");
+                else if (strcmp(buf, "qsThreadInfo") == 0)
+                    strcpy(reply, "l");
+
+                break;
+            }
+
+            case 'H': {
+                strcpy(reply, "OK");
+
+                break;
+            }
+
+            case 'D': {
+                gdb_send_packet("OK");
+
+                close(gdb_fd);
+                gdb_fd = -1;
+                gdb_attached = false;
+                gdb_stepping = false;
+                clear_breakpoints(cpu->machine);
+                clear_watchpoints(cpu->machine);
+
+                return true;
+            }
+
+            case 'k': {
+                close(gdb_fd);
+                gdb_fd = -1;
+                gdb_attached = false;
+
+                return false;
+            }
+        }
+
+        gdb_send_packet(reply);
+    }
+}
+
+bool gdb_pre_step(CPU *cpu, Instruction *inst) {
+    bool skip = gdb_skip_bp;
+
+    gdb_skip_bp = false;
+
+    if (!skip && breakpoint_hit(cpu->machine, cpu->pc)) {
+        if (!gdb_stop(cpu, GDB_SIGTRAP))
+            return false;
+
+        *inst = parse_instruction(cpu);
+        gdb_skip_bp = false;
+    }
+
+    while (gdb_attached && inst->opcode == INT && inst->operand1 == 8) {
+        cpu->pc = (cpu->pc + inst->size) & ADDR_MASK;
+
+        if (!gdb_stop(cpu, GDB_SIGTRAP))
+            return false;
+
+        *inst = parse_instruction(cpu);
+        gdb_skip_bp = false;
+    }
+
+    return true;
+}
+
+bool gdb_poll_interrupt() {
+    struct pollfd pfd = {.fd = gdb_fd, .events = POLLIN};
+    uint8_t c;
+
+    if (poll(&pfd, 1, 0) <= 0 || !(pfd.revents & POLLIN))
+        return false;
+
+    if (recv(gdb_fd, &c, 1, MSG_PEEK) == 1 && c == 0x03) {
+        recv(gdb_fd, &c, 1, 0);
+
+        return true;
+    }
+
+    return false;
+}
+
+int gdb_exception_signal(int status) {
+    switch (status) {
+        case 0x03: return GDB_SIGBUS;
+        case 0x04:
+        case 0x07: return GDB_SIGSEGV;
+        case 0x06: return GDB_SIGFPE;
+        case 0x08: return GDB_SIGTRAP;
+    }
+
+    return GDB_SIGILL;
+}
@@ -0,0 +1,22 @@
+#ifndef GDB_H
+#define GDB_H
+
+#include "common.h"
+
+#define GDB_SIGINT 2
+#define GDB_SIGILL 4
+#define GDB_SIGTRAP 5
+#define GDB_SIGFPE 8
+#define GDB_SIGBUS 10
+#define GDB_SIGSEGV 11
+
+extern bool gdb_attached;
+extern bool gdb_stepping;
+
+int gdb_listen(const char *addr);
+bool gdb_stop(CPU *cpu, int signal);
+bool gdb_pre_step(CPU *cpu, Instruction *inst);
+bool gdb_poll_interrupt();
+int gdb_exception_signal(int status);
+
+#endif
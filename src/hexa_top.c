@@ -0,0 +1,222 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "libhexa.h"
+
+#define SHM_DIR "/dev/shm"
+#define MAX_INSTANCES 256
+
+typedef struct {
+    HexaStats stats;
+    uint64_t sampled_ns;
+    bool seen;
+} Instance;
+
+Instance instances[MAX_INSTANCES];
+Instance previous[MAX_INSTANCES];
+size_t instance_count = 0;
+size_t previous_count = 0;
+
+uint64_t monotonic_ns() {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+// Copies the segment out of a read-only mapping; the emulator never waits on a reader
+bool read_stats(const char *name, HexaStats *stats) {
+    char path[sizeof(SHM_DIR) + 256];
+    struct stat st;
+    bool ok = false;
+
+    snprintf(path, sizeof(path), "%s/%s", SHM_DIR, name);
+
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0)
+        return false;
+
+    if (fstat(fd, &st) == 0 && st.st_size >= (off_t)offsetof(HexaStats, cores)) {
+        void *data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+        if (data != MAP_FAILED) {
+            const HexaStats *shared = data;
+            size_t size = (size_t)st.st_size < sizeof(HexaStats) ? (size_t)st.st_size : sizeof(HexaStats);
+
+            // a newer emulator may append fields, an older one leaves the missing ones at zero
+            memset(stats, 0, sizeof(HexaStats));
+            memcpy(stats, shared, size);
+
+            ok = stats->magic == HEXA_STATS_MAGIC && stats->version == HEXA_STATS_VERSION;
+
+            munmap(data, st.st_size);
+        }
+    }
+
+    close(fd);
+
+    return ok;
+}
+
+bool is_instance_name(const char *name) {
+    if (strncmp(name, "hexa.", 5) != 0 || !name[5])
+        return false;
+
+    for (const char *c = name + 5; *c; c++)
+        if (!isdigit((unsigned char)*c))
+            return false;
+
+    return true;
+}
+
+// Segments of emulators that were killed before they could remove them are skipped
+void sample_instances(int only_pid) {
+    DIR *dir = opendir(SHM_DIR);
+    struct dirent *entry;
+
+    memcpy(previous, instances, instance_count * sizeof(Instance));
+    previous_count = instance_count;
+    instance_count = 0;
+
+    if (!dir)
+        return;
+
+    while ((entry = readdir(dir)) != NULL && instance_count < MAX_INSTANCES) {
+        Instance *instance = &instances[instance_count];
+
+        if (!is_instance_name(entry->d_name) || !read_stats(entry->d_name, &instance->stats))
+            continue;
+
+        if (only_pid && (int)instance->stats.pid != only_pid)
+            continue;
+
+        if (kill(instance->stats.pid, 0) != 0 && errno == ESRCH)
+            continue;
+
+        instance->sampled_ns = monotonic_ns();
+        instance->seen = true;
+        instance_count++;
+    }
+
+    closedir(dir);
+}
+
+const Instance *find_previous(uint32_t pid) {
+    for (size_t i = 0; i < previous_count; i++)
+        if (previous[i].stats.pid == pid)
+            return &previous[i];
+
+    return NULL;
+}
+
+// Rates cover the last refresh, or the whole run for an instance that was just found
+double rate(uint64_t now, uint64_t before, double seconds) {
+    return seconds > 0 ? (now - before) / seconds : 0;
+}
+
+void print_instances(bool detail) {
+    uint64_t interrupts_total, interrupts_before;
+
+    printf("%7s %5s %9s %8s %14s %9s %6s %8s %8s %9s %9s %6s %6s\n",
+        "PID", "CORES", "UPTIME", "MIPS", "INSTRUCTIONS", "INT/s", "EXC", "DISK/s", "SECT/s", "LAT(us)", "SERIAL/s", "FPS", "SLACK");
+
+    for (size_t i = 0; i < instance_count; i++) {
+        const HexaStats *now = &instances[i].stats;
+        const Instance *prev = find_previous(now->pid);
+        HexaStats zero = {0};
+        const HexaStats *before = prev ? &prev->stats : &zero;
+        double seconds = prev ? (instances[i].sampled_ns - prev->sampled_ns) / 1e9 : (instances[i].sampled_ns - now->start_ns) / 1e9;
+        uint64_t commands = now->disk_commands - before->disk_commands;
+        double latency = commands ? (now->disk_latency_ns - before->disk_latency_ns) / 1e3 / commands : 0;
+        double slack = seconds > 0 ? (now->throttle_slack_ns - before->throttle_slack_ns) / 1e9 / seconds / (now->cores ? now->cores : 1) * 100 : 0;
+
+        interrupts_total = interrupts_before = 0;
+
+        for (int v = 0; v < HEXA_STATS_VECTORS; v++) {
+            interrupts_total += now->interrupts[v];
+            interrupts_before += before->interrupts[v];
+        }
+
+        printf("%7u %5u %8.0fs %8.2f %14llu %9.0f %6llu %8.0f %8.0f %9.1f %9.0f %6.1f %5.1f%%\n",
+            now->pid, now->cores, (instances[i].sampled_ns - now->start_ns) / 1e9, now->mips_milli / 1e3,
+            (unsigned long long)now->instructions, rate(interrupts_total, interrupts_before, seconds),
+            (unsigned long long)now->exceptions, rate(now->disk_commands, before->disk_commands, seconds),
+            rate(now->disk_sectors, before->disk_sectors, seconds), latency,
+            rate(now->serial_bytes, before->serial_bytes, seconds), rate(now->frames, before->frames, seconds), slack);
+
+        if (!detail)
+            continue;
+
+        printf("\n  Interrupts:");
+
+        for (int v = 0; v < HEXA_STATS_VECTORS; v++)
+            if (now->interrupts[v])
+                printf(" 0x%02x=%llu", v, (unsigned long long)now->interrupts[v]);
+
+        printf("\n  Disk: %llu commands, %llu sectors, %.1f us average, %.1f us max\n  Serial: %llu bytes  Frames: %llu\n",
+            (unsigned long long)now->disk_commands, (unsigned long long)now->disk_sectors,
+            now->disk_commands ? now->disk_latency_ns / 1e3 / now->disk_commands : 0.0, now->disk_latency_max_ns / 1e3,
+            (unsigned long long)now->serial_bytes, (unsigned long long)now->frames);
+    }
+
+    if (instance_count == 0)
+        printf("No running hexa instance publishes stats (start hexa with -stats)\n");
+}
+
+int main(int argc, char *argv[]) {
+    double delay = 1.0;
+    long iterations = 0;
+    int only_pid = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-d") == 0 && i + 1 < argc)
+            delay = strtod(argv[++i], NULL);
+        else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+            iterations = strtol(argv[++i], NULL, 10);
+        else if (isdigit((unsigned char)argv[i][0]))
+            only_pid = atoi(argv[i]);
+        else {
+            printf("Usage: hexa_top [-d <seconds>] [-n <iterations>] [pid]\n");
+
+            return 1;
+        }
+    }
+
+    if (delay <= 0)
+        delay = 1.0;
+
+    bool interactive = isatty(STDOUT_FILENO);
+
+    for (long n = 0; iterations == 0 || n < iterations; n++) {
+        if (n > 0) {
+            struct timespec pause = {(time_t)delay, (long)((delay - (time_t)delay) * 1e9)};
+
+            nanosleep(&pause, NULL);
+        }
+
+        sample_instances(only_pid);
+
+        if (interactive)
+            printf("\033[H\033[J");
+        else if (n > 0)
+            printf("\n");
+
+        print_instances(only_pid != 0);
+        fflush(stdout);
+    }
+
+    return 0;
+}
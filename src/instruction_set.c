@@ -1,697 +1,887 @@
 #include "instruction_set.h"
-#include "disk.h"
-
-bool pc_modified;
-bool framebuffer_dirty = false;
+#include "memory.h"
 
 bool is_reg(uint16_t val) {
     return val >= R0 && val <= R7;
 }
 
-Instruction parse_instruction(CPU *cpu) {
-    Instruction inst;
-
-    inst.opcode = cpu->memory[cpu->pc];
-    inst.mode1 = cpu->memory[cpu->pc + 1];
-    inst.operand1 = (cpu->memory[cpu->pc + 2] << 8) | cpu->memory[cpu->pc + 3];
-    inst.mode2 = cpu->memory[cpu->pc + 4];
-    inst.operand2 = (cpu->memory[cpu->pc + 5] << 8) | cpu->memory[cpu->pc + 6];
+// A pending CMP is tested straight from its operands, so the usual compare-and-branch never builds flags
+static inline bool condition_met(CPU *cpu, uint8_t cond) {
+    if (cpu->flags_lazy) {
+        uint16_t a = cpu->flags_a;
+        uint16_t b = cpu->flags_b;
+
+        switch (cond) {
+            case 0: case 2: return a == b;
+            case 1: case 3: return a != b;
+            case 4: return a < b;
+            case 5: return a <= b;
+            case 6: return a > b;
+            default: return a >= b;
+        }
+    }
 
-    return inst;
+    switch (cond) {
+        case 0: return cpu->flags & FLAG_ZERO;
+        case 1: return !(cpu->flags & FLAG_ZERO);
+        case 2: return cpu->flags & FLAG_EQUAL;
+        case 3: return !(cpu->flags & FLAG_EQUAL);
+        case 4: return cpu->flags & FLAG_LESS;
+        case 5: return cpu->flags & (FLAG_EQUAL | FLAG_LESS);
+        case 6: return cpu->flags & FLAG_GREATER;
+        default: return cpu->flags & (FLAG_EQUAL | FLAG_GREATER);
+    }
 }
 
-int exec_instruction(CPU *cpu, Instruction inst) {
-    pc_modified = false;
-    cpu->ip = inst.opcode;
-
-    if (cpu->pc >= BIOS_ADDR)
-        cpu->flags &= ~FLAG_RESET;
+int address_operand(CPU *cpu, uint8_t mode, uint16_t operand, uint16_t *offset, int *wb_reg, uint16_t *wb_value) {
+    uint8_t base = mode >> MODE_BASE_SHIFT;
 
-    if ((cpu->ip == INT || cpu->ip == IRET) && (cpu->flags & FLAG_USER_MODE))
-        return 5;
-
-    if ((!(cpu->flags & FLAG_RESET) && (cpu->pc < START_ADDR)) || ((cpu->flags & FLAG_USER_MODE) && (cpu->pc >= BIOS_ADDR)))
-        return 4;
-    
-    switch (inst.opcode) {
-        case MOV: {
-            bool isSP = false, isPC = false, isCS = false, isSS = false, isDS = false, isUS = false, isFLAGS = false;
+    *wb_reg = -1;
 
-            if (inst.mode1 != MODE_VAL_IND || !is_reg(inst.operand1)) {
-                switch (inst.operand1) {
-                    case SP: {
-                        isSP = true;
+    switch (mode & MODE_MASK) {
+        case MODE_VAL_IMM: {
+            *offset = operand;
 
-                        break;
-                    }
+            break;
+        }
 
-                    case PC: {
-                        isPC = true;
+        case MODE_VAL_IND: {
+            if (!is_reg(operand))
+                return 2;
 
-                        break;
-                    }
+            *offset = cpu->registers[operand];
 
-                    case CS: {
-                        isCS = true;
+            break;
+        }
 
-                        break;
-                    }
+        case MODE_BASE_DISP: {
+            if (!is_reg(base))
+                return 2;
 
-                    case SS: {
-                        isSS = true;
+            *offset = cpu->registers[base] + operand;
 
-                        break;
-                    }
+            break;
+        }
 
-                    case DS: {
-                        isDS = true;
+        case MODE_BASE_INDEX: {
+            if (!is_reg(base) || !is_reg(operand))
+                return 2;
 
-                        break;
-                    }
+            *offset = cpu->registers[base] + cpu->registers[operand];
 
-                    case US: {
-                        isUS = true;
+            break;
+        }
 
-                        break;
-                    }
+        case MODE_POST_INC: {
+            if (!is_reg(operand))
+                return 2;
 
-                    case FLAGS: {
-                        isFLAGS = true;
+            *offset = cpu->registers[operand];
+            *wb_reg = operand;
+            *wb_value = cpu->registers[operand] + 2;
 
-                        break;
-                    }
+            break;
+        }
 
-                    default:
-                        return 2;
-                }
-            }
+        case MODE_PRE_DEC: {
+            if (!is_reg(operand))
+                return 2;
 
-            if (isSP)
-                cpu->sp = (inst.mode2 == MODE_VAL_IMM) ? inst.operand2 : cpu->registers[inst.operand2];
-            else if (isPC)
-                cpu->pc = (inst.mode2 == MODE_VAL_IMM) ? inst.operand2 : cpu->registers[inst.operand2];
-            else if (isCS)
-                cpu->cs = (inst.mode2 == MODE_VAL_IMM) ? inst.operand2 : cpu->registers[inst.operand2];
-            else if (isSS)
-                cpu->ss = (inst.mode2 == MODE_VAL_IMM) ? inst.operand2 : cpu->registers[inst.operand2];
-            else if (isDS)
-                cpu->ds = (inst.mode2 == MODE_VAL_IMM) ? inst.operand2 : cpu->registers[inst.operand2];
-            else if (isUS)
-                cpu->us = (inst.mode2 == MODE_VAL_IMM) ? inst.operand2 : cpu->registers[inst.operand2];
-            else if (isFLAGS)
-                cpu->flags = (inst.mode2 == MODE_VAL_IMM) ? inst.operand2 : cpu->registers[inst.operand2];
-            else
-                cpu->registers[inst.operand1] = (inst.mode2 == MODE_VAL_IMM) ? inst.operand2 : cpu->registers[inst.operand2];
+            *offset = cpu->registers[operand] - 2;
+            *wb_reg = operand;
+            *wb_value = *offset;
 
             break;
         }
 
-        case LD: {
-            uint16_t offset = (inst.mode2 == MODE_VAL_IMM) ? inst.operand2 : cpu->registers[inst.operand2];
+        default:
+            return 2;
+    }
 
-            if (inst.mode1 != MODE_VAL_IND || !is_reg(inst.operand1))
-                return 2;
-            
-            uint32_t phys_addr = seg_offset(cpu->ds, offset);
+    return 0;
+}
 
-            if (phys_addr % 2 != 0)
-                return 3;
-            
-            cpu->registers[inst.operand1] = (cpu->memory[phys_addr] << 8) | cpu->memory[phys_addr + 1];
+// What an operand is, as far as choosing a handler goes. Mode 1 operands that are not a general
+// purpose register get a class per special register, and OPERAND_OTHER covers the rest (ALU
+// instructions read those as a memory address). From OPERAND_DISP on the classes are address
+// modes with valid registers; OPERAND_ADDRESS is any other mode above 1
+enum OPERAND_CLASS {
+    OPERAND_IMM,
+    OPERAND_REG,
+    OPERAND_CS,
+    OPERAND_SS,
+    OPERAND_DS,
+    OPERAND_US,
+    OPERAND_PC,
+    OPERAND_SP,
+    OPERAND_FLAGS,
+    OPERAND_ES,
+    OPERAND_ID,
+    OPERAND_OTHER,
+    OPERAND_DISP,
+    OPERAND_INDEX,
+    OPERAND_POST_INC,
+    OPERAND_PRE_DEC,
+    OPERAND_ADDRESS,
+    OPERAND_CLASSES
+};
+
+static const uint8_t register_classes[ID + 1] = {
+    [R0] = OPERAND_REG, [R1] = OPERAND_REG, [R2] = OPERAND_REG, [R3] = OPERAND_REG,
+    [R4] = OPERAND_REG, [R5] = OPERAND_REG, [R6] = OPERAND_REG, [R7] = OPERAND_REG,
+    [CS] = OPERAND_CS, [SS] = OPERAND_SS, [DS] = OPERAND_DS, [US] = OPERAND_US, [PC] = OPERAND_PC,
+    [IP] = OPERAND_OTHER, [SP] = OPERAND_SP, [FLAGS] = OPERAND_FLAGS, [ES] = OPERAND_ES, [ID] = OPERAND_ID
+};
+
+static inline uint8_t operand_class(uint8_t mode, uint16_t operand) {
+    uint8_t base = mode >> MODE_BASE_SHIFT;
+
+    if (mode == MODE_VAL_IMM)
+        return OPERAND_IMM;
+
+    if (mode == MODE_VAL_IND)
+        return (operand <= ID) ? register_classes[operand] : OPERAND_OTHER;
+
+    switch (mode & MODE_MASK) {
+        case MODE_BASE_DISP: return is_reg(base) ? OPERAND_DISP : OPERAND_ADDRESS;
+        case MODE_BASE_INDEX: return (is_reg(base) && is_reg(operand)) ? OPERAND_INDEX : OPERAND_ADDRESS;
+        case MODE_POST_INC: return is_reg(operand) ? OPERAND_POST_INC : OPERAND_ADDRESS;
+        case MODE_PRE_DEC: return is_reg(operand) ? OPERAND_PRE_DEC : OPERAND_ADDRESS;
+        default: return OPERAND_ADDRESS;
+    }
+}
 
-            break;
-        }
+static Instruction decode_instruction(CPU *cpu) {
+    Instruction inst;
 
-        case ST: {
-            uint16_t offset = (inst.mode1 == MODE_VAL_IMM) ? inst.operand1 : cpu->registers[inst.operand1];
-            uint16_t value = (inst.mode2 == MODE_VAL_IMM) ? inst.operand2 : cpu->registers[inst.operand2];
-            uint32_t phys_addr = seg_offset(cpu->ds, offset);
+    inst.opcode = cpu->memory[cpu->pc];
 
-            if (phys_addr >= BIOS_ADDR)
-                return 4;
+    if (cpu->memory[cpu->pc + 1] & INST_COMPACT) {
+        inst.mode1 = (cpu->memory[cpu->pc + 1] >> 1) & 0x01;
+        inst.operand1 = cpu->memory[cpu->pc + 2];
+        inst.mode2 = cpu->memory[cpu->pc + 1] & 0x01;
+        inst.operand2 = cpu->memory[cpu->pc + 3];
+        inst.padding = 0;
+        inst.size = COMPACT_INST_SIZE;
 
-            if (phys_addr % 2 != 0)
-                return 3;
+        select_form(&inst);
 
-            cpu->memory[phys_addr] = (value >> 8) & 0xff;
-            cpu->memory[phys_addr + 1] = value & 0xff;
+        return inst;
+    }
 
-            if (phys_addr == SERIAL_DATA)
-                cpu->memory[SERIAL_STATUS] |= SERIAL_STATUS_NEW_DATA;
-            
-            if (phys_addr == DISK_COMMAND) {
-                if (value == DISK_CMD_WRITE)
-                    write_disk(cpu);
-                else if (value == DISK_CMD_READ)
-                    read_disk(cpu);
-            }
-            
-            if (phys_addr >= FRAMEBUFFER_ADDR && phys_addr <= FRAMEBUFFER_ADDR + (FRAMEBUFFER_WIDTH * FRAMEBUFFER_HEIGHT))
-                framebuffer_dirty = true;
-            
-            break;
-        }
+    inst.mode1 = cpu->memory[cpu->pc + 1];
+    inst.operand1 = (cpu->memory[cpu->pc + 2] << 8) | cpu->memory[cpu->pc + 3];
+    inst.mode2 = cpu->memory[cpu->pc + 4];
+    inst.operand2 = (cpu->memory[cpu->pc + 5] << 8) | cpu->memory[cpu->pc + 6];
+    inst.padding = cpu->memory[cpu->pc + 7];
+    inst.size = INST_SIZE;
 
-        case PUSH: {
-            uint16_t value;
+    select_form(&inst);
+
+    return inst;
+}
+
+// Decoding and handler selection happen once per address; later fetches only compare the bytes
+Instruction parse_instruction(CPU *cpu) {
+    DecodedInstruction *entry = &cpu->decoded[(cpu->pc >> 2) % DECODE_CACHE_SIZE];
+    uint64_t bytes;
 
-            if (inst.mode1 == MODE_VAL_IND) {
-                if (!is_reg(inst.operand1))
-                    switch (inst.operand1) {
-                        case CS: {
-                            value = cpu->cs;
+    memcpy(&bytes, &cpu->memory[cpu->pc], sizeof(bytes));
 
-                            break;
-                        }
+    if (entry->tag == cpu->pc + 1 && entry->bytes == bytes)
+        return entry->inst;
 
-                        case SS: {
-                            value = cpu->ss;
+    entry->inst = decode_instruction(cpu);
+    entry->bytes = bytes;
+    entry->tag = cpu->pc + 1;
 
-                            break;
-                        }
+    return entry->inst;
+}
 
-                        case DS: {
-                            value = cpu->ds;
+void return_from_interrupt(CPU *cpu) {
+    uint16_t int_num = cpu_pop(cpu);
 
-                            break;
-                        }
+    write_flags(cpu, cpu_pop(cpu));
 
-                        case US: {
-                            value = cpu->us;
+    uint16_t offset = cpu_pop(cpu);
+    uint16_t segment = cpu_pop(cpu);
 
-                            break;
-                        }
+    if (cpu->flags & FLAG_USER_MODE)
+        cpu->us = segment;
+    else
+        cpu->cs = segment;
+    
+    cpu->pc = seg_offset(segment, offset);
+    cpu->pc_modified = true;
 
-                        case FLAGS: {
-                            value = cpu->flags;
+    cpu->flags |= FLAG_INT_DONE;
+}
 
-                            break;
-                        }
+// serial_int and disk_int as bios.hxa assembles them; bios_service stands in for exactly these bytes
+static const uint8_t stock_serial_int[] = {
+    0x03, 0x01, 0x00, 0x0a, 0x01, 0x00, 0x00, 0x00,
+    0x00, 0x01, 0x00, 0x0a, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x01, 0x00, 0x06, 0x00, 0x01, 0x1e, 0x00,
+    0x0d, 0x01, 0x00, 0x07, 0x00, 0x00, 0x08, 0x00,
+    0x02, 0x01, 0x00, 0x06, 0x01, 0x00, 0x07, 0x00,
+    0x00, 0x01, 0x00, 0x06, 0x00, 0x00, 0x00, 0x00,
+    0x04, 0x01, 0x00, 0x0a, 0x01, 0x00, 0x00, 0x00,
+    0x1c, 0x01, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00
+};
+
+static const uint8_t stock_disk_int[] = {
+    0x03, 0x01, 0x00, 0x0a, 0x01, 0x00, 0x00, 0x00,
+    0x00, 0x01, 0x00, 0x0a, 0x00, 0x00, 0x00, 0x00,
+    0x02, 0x00, 0x01, 0x28, 0x01, 0x00, 0x04, 0x00,
+    0x02, 0x00, 0x01, 0x2a, 0x01, 0x00, 0x05, 0x00,
+    0x02, 0x00, 0x01, 0x26, 0x00, 0x00, 0x01, 0x00,
+    0x04, 0x01, 0x00, 0x0a, 0x01, 0x00, 0x00, 0x00,
+    0x1c, 0x01, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00
+};
+
+// A vector only counts as the stock handler if it points into the ROM at the handler for its own
+// interrupt, so a repointed vector or a different -bios image runs whatever it names
+static bool is_bios_service(CPU *cpu, uint16_t int_num, uint32_t addr) {
+    const uint8_t *code = (int_num == 0x03) ? stock_serial_int : stock_disk_int;
+    size_t size = (int_num == 0x03) ? sizeof(stock_serial_int) : sizeof(stock_disk_int);
+
+    if (addr < BIOS_ADDR || addr + size > MEM_SIZE)
+        return false;
+
+    return memcmp(&cpu->memory[addr], code, size) == 0;
+}
 
-                        default:
-                            return 2;
-                    }
-                else
-                    value = cpu->registers[inst.operand1];
-            } else
-                value = inst.operand1;
+// Performs serial_int and disk_int from bios.hxa natively, including their DS save on the stack
+void bios_service(CPU *cpu, uint16_t int_num) {
+    cpu_push(cpu, cpu->ds);
+
+    if (int_num == 0x03) {
+        cpu->registers[R7] <<= 8;
+        mem_write(cpu, SERIAL_DATA, cpu->registers[R7]);
+        cpu->registers[R6] = 0x0000;
+    } else {
+        mem_write(cpu, DISK_LBA, cpu->registers[R4]);
+        mem_write(cpu, DISK_COUNT, cpu->registers[R5]);
+        mem_write(cpu, DISK_COMMAND, DISK_CMD_READ);
+    }
 
-            cpu_push(cpu, value);
+    cpu->ds = cpu_pop(cpu);
+}
+
+// The templates below are only called with constant classes and opcodes, so each handler they are
+// inlined into keeps just the code for its own form
+#define ALWAYS_INLINE static inline __attribute__((always_inline))
+
+#define CONDITION_ALWAYS -1
+
+ALWAYS_INLINE uint16_t *class_register(CPU *cpu, int class, uint16_t operand) {
+    switch (class) {
+        case OPERAND_CS: return &cpu->cs;
+        case OPERAND_SS: return &cpu->ss;
+        case OPERAND_DS: return &cpu->ds;
+        case OPERAND_US: return &cpu->us;
+        case OPERAND_SP: return &cpu->sp;
+        case OPERAND_FLAGS: return &cpu->flags;
+        case OPERAND_ES: return &cpu->es;
+        default: return &cpu->registers[operand];
+    }
+}
+
+ALWAYS_INLINE int effective_offset(CPU *cpu, uint8_t mode, uint16_t operand, int addressing, uint16_t *offset, int *wb_reg, uint16_t *wb_value) {
+    uint8_t base = mode >> MODE_BASE_SHIFT;
+
+    *wb_reg = -1;
+
+    switch (addressing) {
+        case OPERAND_IMM: *offset = operand; break;
+        case OPERAND_REG: *offset = cpu->registers[operand]; break;
+        case OPERAND_DISP: *offset = cpu->registers[base] + operand; break;
+        case OPERAND_INDEX: *offset = cpu->registers[base] + cpu->registers[operand]; break;
+
+        case OPERAND_POST_INC: {
+            *offset = cpu->registers[operand];
+            *wb_reg = operand;
+            *wb_value = cpu->registers[operand] + 2;
 
             break;
         }
 
-        case POP: {
-            if (inst.mode1 != MODE_VAL_IND)
-                return 2;
-            
-            bool isCS = false, isSS = false, isDS = false, isUS = false, isFLAGS = false;
-            
-            if (!is_reg(inst.operand1)) {
-                switch (inst.operand1) {
-                    case CS: {
-                        isCS = true;
+        case OPERAND_PRE_DEC: {
+            *offset = cpu->registers[operand] - 2;
+            *wb_reg = operand;
+            *wb_value = *offset;
 
-                        break;
-                    }
+            break;
+        }
 
-                    case SS: {
-                        isSS = true;
+        default:
+            return address_operand(cpu, mode, operand, offset, wb_reg, wb_value);
+    }
 
-                        break;
-                    }
+    return 0;
+}
 
-                    case DS: {
-                        isDS = true;
+// Special register sources go through class_register like PUSH; only the pc and flags need more
+ALWAYS_INLINE uint16_t move_source(CPU *cpu, const Instruction *inst, int from) {
+    switch (from) {
+        case OPERAND_IMM: return inst->operand2;
+        case OPERAND_REG: return cpu->registers[inst->operand2];
+        // ID is read-only and holds the index of the executing core
+        case OPERAND_ID: return cpu->core_id;
+        case OPERAND_PC: return cpu->pc;
 
-                        break;
-                    }
+        case OPERAND_FLAGS: {
+            sync_flags(cpu);
 
-                    case US: {
-                        isUS = true;
+            return cpu->flags;
+        }
 
-                        break;
-                    }
+        default: return *class_register(cpu, from, inst->operand2);
+    }
+}
 
-                    case FLAGS: {
-                        isFLAGS = true;
+ALWAYS_INLINE int move(CPU *cpu, const Instruction *inst, int to, int from) {
+    uint16_t value = move_source(cpu, inst, from);
 
-                        break;
-                    }
+    if (to == OPERAND_PC)
+        cpu->pc = value;
+    else if (to == OPERAND_FLAGS)
+        write_flags(cpu, value);
+    else
+        *class_register(cpu, to, inst->operand1) = value;
 
-                    default:
-                        return 2;
-                }
-            }
-            
-            if (isCS)
-                cpu->cs = cpu_pop(cpu);
-            else if (isSS)
-                cpu->ss = cpu_pop(cpu);
-            else if (isDS)
-                cpu->ds = cpu_pop(cpu);
-            else if (isUS)
-                cpu->us = cpu_pop(cpu);
-            else if (isFLAGS)
-                cpu->flags = cpu_pop(cpu);
-            else
-                cpu->registers[inst.operand1] = cpu_pop(cpu);
+    return 0;
+}
 
-            break;
-        }
+// An immediate MOV destination still names a special register by its number
+static int move_numbered(CPU *cpu, const Instruction *inst) {
+    int to = (inst->operand1 <= ID) ? register_classes[inst->operand1] : OPERAND_OTHER;
+    int from = operand_class(inst->mode2, inst->operand2);
 
-        case ADD:
-        case SUB: {
-            if (inst.mode1 != MODE_VAL_IND || !is_reg(inst.operand1))
-                return 2;
-            
-            uint32_t phys_addr;
+    if (to == OPERAND_REG || to == OPERAND_ID || to == OPERAND_OTHER || from == OPERAND_OTHER)
+        return 2;
 
-            if (inst.mode2 == MODE_VAL_IND && !is_reg(inst.operand2)) {
-                uint16_t offset = inst.operand2;
-                phys_addr = seg_offset(cpu->ds, offset);
+    return move(cpu, inst, to, from);
+}
 
-                if (phys_addr >= BIOS_ADDR || phys_addr < START_ADDR)
-                    return 4;
+// LD, XCHG and CAS: a register and the memory operand its addressing form describes
+ALWAYS_INLINE int access_memory(CPU *cpu, const Instruction *inst, bool user, uint8_t op, int addressing) {
+    uint16_t offset, wb_value;
+    int wb_reg;
 
-                if (phys_addr % 2 != 0)
-                    return 3;
-            }
+    if (op == CAS && !is_reg(inst->padding))
+        return 2;
 
-            uint16_t value = (inst.mode2 == MODE_VAL_IND) ? (is_reg(inst.operand2) ? cpu->registers[inst.operand2] : ((cpu->memory[phys_addr] << 8) | cpu->memory[phys_addr + 1])) : inst.operand2;
+    if (effective_offset(cpu, inst->mode2, inst->operand2, addressing, &offset, &wb_reg, &wb_value))
+        return 2;
 
-            cpu->registers[inst.operand1] = (inst.opcode == ADD) ? cpu->registers[inst.operand1] + value : cpu->registers[inst.operand1] - value;
+    uint32_t phys_addr = seg_offset(cpu->ds, offset);
+    int status = (op == LD) ? mem_check_as(cpu, phys_addr, PAGE_R, 0, user) : mem_check_as(cpu, phys_addr, ACCESS_DATA, PAGE_MMIO, user);
 
-            break;
-        }
+    if (status)
+        return status;
 
-        case INC:
-        case DEC: {
-            if (inst.mode1 != MODE_VAL_IND || !is_reg(inst.operand1))
-                return 2;
-            
-            cpu->registers[inst.operand1] = (inst.opcode == INC) ? cpu->registers[inst.operand1] + 1 : cpu->registers[inst.operand1] - 1;
+    if (op == LD) {
+        uint16_t value = mem_read(cpu, phys_addr);
 
-            break;
-        }
+        if (wb_reg >= 0)
+            cpu->registers[wb_reg] = wb_value;
 
-        case AND: {
-            if (inst.mode1 != MODE_VAL_IND || !is_reg(inst.operand1))
-                return 2;
-            
-            uint32_t phys_addr;
+        cpu->registers[inst->operand1] = value;
 
-            if (inst.mode2 == MODE_VAL_IND && !is_reg(inst.operand2)) {
-                uint16_t offset = inst.operand2;
-                phys_addr = seg_offset(cpu->ds, offset);
+        return 0;
+    }
 
-                if (phys_addr >= BIOS_ADDR || phys_addr < START_ADDR)
-                    return 4;
+    if (wb_reg >= 0)
+        cpu->registers[wb_reg] = wb_value;
 
-                if (phys_addr % 2 != 0)
-                    return 3;
-            }
-            
-            uint16_t value = (inst.mode2 == MODE_VAL_IND) ? (is_reg(inst.operand2) ? cpu->registers[inst.operand2] : ((cpu->memory[phys_addr] << 8) | cpu->memory[phys_addr + 1])) : inst.operand2;
+    if (op == XCHG) {
+        cpu->registers[inst->operand1] = mem_exchange(cpu, phys_addr, cpu->registers[inst->operand1]);
 
-            cpu->registers[inst.operand1] &= value;
+        return 0;
+    }
 
-            break;
-        }
+    cpu->flags &= ~(FLAG_EQUAL | FLAG_LESS | FLAG_GREATER | FLAG_ZERO);
+    cpu->flags_lazy = false;
 
-        case OR: {
-            if (inst.mode1 != MODE_VAL_IND || !is_reg(inst.operand1))
-                return 2;
-            
-            uint32_t phys_addr;
+    if (mem_compare_exchange(cpu, phys_addr, &cpu->registers[inst->operand1], cpu->registers[inst->padding]))
+        cpu->flags |= FLAG_EQUAL | FLAG_ZERO;
 
-            if (inst.mode2 == MODE_VAL_IND && !is_reg(inst.operand2)) {
-                uint16_t offset = inst.operand2;
-                phys_addr = seg_offset(cpu->ds, offset);
+    return 0;
+}
 
-                if (phys_addr >= BIOS_ADDR || phys_addr < START_ADDR)
-                    return 4;
+ALWAYS_INLINE int store(CPU *cpu, const Instruction *inst, bool user, int addressing, int from) {
+    uint16_t offset, wb_value;
+    int wb_reg;
 
-                if (phys_addr % 2 != 0)
-                    return 3;
-            }
+    if (effective_offset(cpu, inst->mode1, inst->operand1, addressing, &offset, &wb_reg, &wb_value))
+        return 2;
 
-            uint16_t value = (inst.mode2 == MODE_VAL_IND) ? (is_reg(inst.operand2) ? cpu->registers[inst.operand2] : ((cpu->memory[phys_addr] << 8) | cpu->memory[phys_addr + 1])) : inst.operand2;
+    uint16_t value = (from == OPERAND_IMM) ? inst->operand2 : cpu->registers[inst->operand2];
+    uint32_t phys_addr = seg_offset(cpu->ds, offset);
+    int status = mem_check_as(cpu, phys_addr, PAGE_W, 0, user);
 
-            cpu->registers[inst.operand1] |= value;
+    if (status)
+        return status;
 
-            break;
-        }
+    mem_write(cpu, phys_addr, value);
 
-        case XOR: {
-            if (inst.mode1 != MODE_VAL_IND || !is_reg(inst.operand1))
-                return 2;
-            
-            uint32_t phys_addr;
+    if (wb_reg >= 0)
+        cpu->registers[wb_reg] = wb_value;
 
-            if (inst.mode2 == MODE_VAL_IND && !is_reg(inst.operand2)) {
-                uint16_t offset = inst.operand2;
-                phys_addr = seg_offset(cpu->ds, offset);
+    return 0;
+}
 
-                if (phys_addr >= BIOS_ADDR || phys_addr < START_ADDR)
-                    return 4;
+ALWAYS_INLINE int push(CPU *cpu, const Instruction *inst, int from) {
+    if (from == OPERAND_FLAGS)
+        sync_flags(cpu);
 
-                if (phys_addr % 2 != 0)
-                    return 3;
-            }
-            
-            uint16_t value = (inst.mode2 == MODE_VAL_IND) ? (is_reg(inst.operand2) ? cpu->registers[inst.operand2] : ((cpu->memory[phys_addr] << 8) | cpu->memory[phys_addr + 1])) : inst.operand2;
+    uint16_t value = (from == OPERAND_IMM) ? inst->operand1 : (from == OPERAND_ID) ? cpu->core_id : *class_register(cpu, from, inst->operand1);
 
-            cpu->registers[inst.operand1] ^= value;
+    cpu_push(cpu, value);
 
-            break;
-        }
+    return 0;
+}
 
-        case NOT: {
-            if (inst.mode1 != MODE_VAL_IND || !is_reg(inst.operand1))
-                return 2;
-            
-            cpu->registers[inst.operand1] = ~cpu->registers[inst.operand1];
+ALWAYS_INLINE int pop(CPU *cpu, const Instruction *inst, int to) {
+    if (to == OPERAND_FLAGS)
+        write_flags(cpu, cpu_pop(cpu));
+    else
+        *class_register(cpu, to, inst->operand1) = cpu_pop(cpu);
 
-            break;
-        }
+    return 0;
+}
 
-        case SHL:
-        case SHR: {
-            if (inst.mode1 != MODE_VAL_IND || !is_reg(inst.operand1))
-                return 2;
-            
-            uint32_t phys_addr;
+// Two-operand ALU instructions; any mode 1 source that is not a register is read from memory
+ALWAYS_INLINE int arith(CPU *cpu, const Instruction *inst, bool user, uint8_t op, int from) {
+    uint16_t *dest = &cpu->registers[inst->operand1];
+    uint16_t value;
 
-            if (inst.mode2 == MODE_VAL_IND && !is_reg(inst.operand2)) {
-                uint16_t offset = inst.operand2;
-                phys_addr = seg_offset(cpu->ds, offset);
+    if (from == OPERAND_OTHER) {
+        uint32_t phys_addr = seg_offset(cpu->ds, inst->operand2);
+        int status = mem_check_as(cpu, phys_addr, ACCESS_DATA, PAGE_MMIO, user);
 
-                if (phys_addr >= BIOS_ADDR || phys_addr < START_ADDR)
-                    return 4;
+        if (status)
+            return status;
 
-                if (phys_addr % 2 != 0)
-                    return 3;
-            }
-            
-            uint16_t value = (inst.mode2 == MODE_VAL_IND) ? (is_reg(inst.operand2) ? cpu->registers[inst.operand2] : ((cpu->memory[phys_addr] << 8) | cpu->memory[phys_addr + 1])) : inst.operand2;
+        value = mem_read(cpu, phys_addr);
+    } else
+        value = (from == OPERAND_IMM) ? inst->operand2 : cpu->registers[inst->operand2];
+
+    uint16_t current = *dest;
 
-            cpu->registers[inst.operand1] = (inst.opcode == SHL) ? cpu->registers[inst.operand1] << value : cpu->registers[inst.operand1] >> value;
+    switch (op) {
+        case ADD: *dest = current + value; break;
+        case SUB: *dest = current - value; break;
+        case AND: *dest = current & value; break;
+        case OR: *dest = current | value; break;
+        case XOR: *dest = current ^ value; break;
+        case SHL: *dest = current << value; break;
+        case SHR: *dest = current >> value; break;
+
+        case CMP: {
+            cpu->flags_a = current;
+            cpu->flags_b = value;
+            cpu->flags_lazy = true;
 
             break;
         }
 
-        case CMP: {
-            if (inst.mode1 != MODE_VAL_IND || !is_reg(inst.operand1))
-                return 2;
-            
-            uint32_t phys_addr;
+        case MUL: *dest = (uint16_t)((uint32_t)current * value); break;
+        case MULH: *dest = (uint16_t)(((uint32_t)current * value) >> 16); break;
+        case IMULH: *dest = (uint16_t)(((int32_t)(int16_t)current * (int16_t)value) >> 16); break;
 
-            if (inst.mode2 == MODE_VAL_IND && !is_reg(inst.operand2)) {
-                uint16_t offset = inst.operand2;
-                phys_addr = seg_offset(cpu->ds, offset);
+        default: {
+            bool overflow = (int16_t)current == INT16_MIN && (int16_t)value == -1;
 
-                if (phys_addr >= BIOS_ADDR || phys_addr < START_ADDR)
-                    return 4;
+            if (value == 0)
+                return 6;
 
-                if (phys_addr % 2 != 0)
-                    return 3;
+            switch (op) {
+                case DIV: *dest = current / value; break;
+                case IDIV: *dest = overflow ? current : (uint16_t)((int16_t)current / (int16_t)value); break;
+                case MOD: *dest = current % value; break;
+                default: *dest = overflow ? 0 : (uint16_t)((int16_t)current % (int16_t)value); break;
             }
-            
-            uint16_t val1 = cpu->registers[inst.operand1];
-            uint16_t val2 = (inst.mode2 == MODE_VAL_IND) ? (is_reg(inst.operand2) ? cpu->registers[inst.operand2] : ((cpu->memory[phys_addr] << 8) | cpu->memory[phys_addr + 1])) : inst.operand2;
-            
-            cpu->flags &= ~(FLAG_EQUAL | FLAG_LESS | FLAG_GREATER | FLAG_ZERO);
-
-            if (val1 == val2)
-                cpu->flags |= FLAG_EQUAL | FLAG_ZERO;
-            else if (val1 < val2)
-                cpu->flags |= FLAG_LESS;
-            else if (val1 > val2)
-                cpu->flags |= FLAG_GREATER;
-            
+
             break;
         }
+    }
 
-        case JMP: {
-            uint16_t offset = inst.operand1;
-            uint16_t segment;
+    return 0;
+}
 
-            if (cpu->flags & FLAG_USER_MODE)
-                segment = cpu->us;
-            else
-                segment = cpu->cs;
-            
-            cpu->pc = seg_offset(segment, offset);
-            pc_modified = true;
+ALWAYS_INLINE int unary(CPU *cpu, const Instruction *inst, uint8_t op) {
+    uint16_t *dest = &cpu->registers[inst->operand1];
 
-            break;
-        }
+    *dest = (op == INC) ? *dest + 1 : (op == DEC) ? *dest - 1 : ~*dest;
 
-        case JZ: {
-            if (cpu->flags & FLAG_ZERO) {
-                uint16_t offset = inst.operand1;
-                uint16_t segment;
+    return 0;
+}
 
-                if (cpu->flags & FLAG_USER_MODE)
-                    segment = cpu->us;
-                else
-                    segment = cpu->cs;
+ALWAYS_INLINE int jump(CPU *cpu, uint16_t offset, bool user, int cond) {
+    if (cond != CONDITION_ALWAYS && !condition_met(cpu, cond))
+        return 0;
 
-                cpu->pc = seg_offset(segment, offset);
-                pc_modified = true;
-            }
+    cpu->pc = seg_offset(user ? cpu->us : cpu->cs, offset);
+    cpu->pc_modified = true;
 
-            break;
-        }
+    return 0;
+}
 
-        case JNZ: {
-            if (!(cpu->flags & FLAG_ZERO)) {
-                uint16_t offset = inst.operand1;
-                uint16_t segment;
-
-                if (cpu->flags & FLAG_USER_MODE)
-                    segment = cpu->us;
-                else
-                    segment = cpu->cs;
-                
-                cpu->pc = seg_offset(segment, offset);
-                pc_modified = true;
-            }
+ALWAYS_INLINE int call(CPU *cpu, const Instruction *inst, bool user) {
+    uint16_t return_addr = cpu->pc + inst->size;
+    uint16_t return_offset = return_addr - (cpu->cs << SEG_SHIFT);
+    uint16_t target_offset = inst->operand1 - (cpu->cs << SEG_SHIFT);
 
-            break;
-        }
+    cpu_push(cpu, return_offset);
 
-        case JE: {
-            if (cpu->flags & FLAG_EQUAL) {
-                uint16_t offset = inst.operand1;
-                uint16_t segment;
+    return jump(cpu, target_offset, user, CONDITION_ALWAYS);
+}
 
-                if (cpu->flags & FLAG_USER_MODE)
-                    segment = cpu->us;
-                else
-                    segment = cpu->cs;
+ALWAYS_INLINE int ret(CPU *cpu, bool user) {
+    uint16_t offset = cpu_pop(cpu);
 
-                cpu->pc = seg_offset(segment, offset);
-                pc_modified = true;
-            }
+    return jump(cpu, offset, user, CONDITION_ALWAYS);
+}
 
-            break;
-        }
+ALWAYS_INLINE int loop(CPU *cpu, const Instruction *inst, bool user) {
+    if (--cpu->registers[inst->operand1] != 0)
+        return jump(cpu, inst->operand2, user, CONDITION_ALWAYS);
 
-        case JNE: {
-            if (!(cpu->flags & FLAG_EQUAL)) {
-                uint16_t offset = inst.operand1;
-                uint16_t segment;
+    return 0;
+}
 
-                if (cpu->flags & FLAG_USER_MODE)
-                    segment = cpu->us;
-                else
-                    segment = cpu->cs;
+ALWAYS_INLINE int interrupt(CPU *cpu, const Instruction *inst, bool user) {
+    uint16_t int_num = inst->operand1;
 
-                cpu->pc = seg_offset(segment, offset);
-                pc_modified = true;
-            }
+    if (user)
+        return 5;
 
-            break;
-        }
+    cpu_push(cpu, cpu->cs);
+    cpu_push(cpu, cpu->pc + inst->size);
+    sync_flags(cpu);
+    cpu_push(cpu, cpu->flags);
+    cpu_push(cpu, int_num);
 
-        case JL: {
-            if (cpu->flags & FLAG_LESS) {
-                uint16_t offset = inst.operand1;
-                uint16_t segment;
+    if (int_num == 8)
+        return 8;
 
-                if (cpu->flags & FLAG_USER_MODE)
-                    segment = cpu->us;
-                else
-                    segment = cpu->cs;
+    uint32_t ivt_entry = IVT_ADDR + (int_num * 4);
+    uint16_t segment = (cpu->memory[ivt_entry] << 8) | cpu->memory[ivt_entry + 1];
+    uint16_t offset = (cpu->memory[ivt_entry + 2] << 8) | cpu->memory[ivt_entry + 3];
 
-                cpu->pc = seg_offset(segment, offset);
-                pc_modified = true;
-            }
+    if (cpu->machine->hle_bios && (int_num == 0x03 || int_num == 0x04) && is_bios_service(cpu, int_num, seg_offset(segment, offset))) {
+        bios_service(cpu, int_num);
+        return_from_interrupt(cpu);
 
-            break;
-        }
+        return 0;
+    }
 
-        case JLE: {
-            if (cpu->flags & (FLAG_EQUAL | FLAG_LESS)) {
-                uint16_t offset = inst.operand1;
-                uint16_t segment;
+    cpu->cs = segment;
+    cpu->pc = seg_offset(segment, offset);
 
-                if (cpu->flags & FLAG_USER_MODE)
-                    segment = cpu->us;
-                else
-                    segment = cpu->cs;
+    cpu->pc_modified = true;
 
-                cpu->pc = seg_offset(segment, offset);
-                pc_modified = true;
-            }
+    return 0;
+}
 
-            break;
-        }
+ALWAYS_INLINE int interrupt_return(CPU *cpu, bool user) {
+    if (user)
+        return 5;
 
-        case JG: {
-            if (cpu->flags & FLAG_GREATER) {
-                uint16_t offset = inst.operand1;
-                uint16_t segment;
+    return_from_interrupt(cpu);
 
-                if (cpu->flags & FLAG_USER_MODE)
-                    segment = cpu->us;
-                else
-                    segment = cpu->cs;
+    return 0;
+}
 
-                cpu->pc = seg_offset(segment, offset);
-                pc_modified = true;
-            }
+ALWAYS_INLINE int block(CPU *cpu, const Instruction *inst, uint8_t op, int to, int from) {
+    if (!is_reg(inst->padding))
+        return 2;
 
-            break;
-        }
+    uint16_t dst_offset = (to == OPERAND_IMM) ? inst->operand1 : cpu->registers[inst->operand1];
+    uint16_t value = (from == OPERAND_IMM) ? inst->operand2 : cpu->registers[inst->operand2];
+    uint32_t len = (uint32_t)cpu->registers[inst->padding] * 2;
 
-        case JGE: {
-            if (cpu->flags & (FLAG_EQUAL | FLAG_GREATER)) {
-                uint16_t offset = inst.operand1;
-                uint16_t segment;
-
-                if (cpu->flags & FLAG_USER_MODE)
-                    segment = cpu->us;
-                else
-                    segment = cpu->cs;
-                
-                cpu->pc = seg_offset(segment, offset);
-                pc_modified = true;
-            }
+    if (dst_offset + len > 0x10000 || (op != BFILL && value + len > 0x10000))
+        return 4;
 
-            break;
-        }
+    uint32_t dst = seg_offset(cpu->es, dst_offset);
+    uint8_t dst_attrs, src_attrs;
+    int status = mem_check_range(cpu, dst, len, (op == BCMP) ? PAGE_R : PAGE_W, &dst_attrs);
 
-        case CALL: {
-            uint16_t return_addr = cpu->pc + INST_SIZE;
-            uint16_t return_offset = return_addr - (cpu->cs << SEG_SHIFT);
-            uint16_t target_addr = inst.operand1;
-            uint16_t target_offset = target_addr - (cpu->cs << SEG_SHIFT);
-            uint16_t segment;
+    if (status)
+        return status;
 
-            if (cpu->flags & FLAG_USER_MODE)
-                segment = cpu->us;
-            else
-                segment = cpu->cs;
+    if (op == BFILL) {
+        mem_fill(cpu, dst, value, len, dst_attrs);
 
-            cpu_push(cpu, return_offset);
+        return 0;
+    }
 
-            cpu->pc = seg_offset(segment, target_offset);
-            pc_modified = true;
+    uint32_t src = seg_offset(cpu->ds, value);
 
-            break;
-        }
+    status = mem_check_range(cpu, src, len, PAGE_R, &src_attrs);
 
-        case RET: {
-            uint16_t offset = cpu_pop(cpu);
-            uint16_t segment;
+    if (status)
+        return status;
 
-            if (cpu->flags & FLAG_USER_MODE)
-                segment = cpu->us;
-            else
-                segment = cpu->cs;
+    if (op == BCOPY) {
+        mem_copy(cpu, dst, src, len, dst_attrs | src_attrs);
 
-            cpu->pc = seg_offset(segment, offset);
-            pc_modified = true;
+        return 0;
+    }
 
-            break;
-        }
+    int result = mem_compare(cpu, dst, src, len, dst_attrs | src_attrs);
 
-        case IRET: {
-            uint16_t int_num = cpu_pop(cpu);
+    cpu->flags &= ~(FLAG_EQUAL | FLAG_LESS | FLAG_GREATER | FLAG_ZERO);
+    cpu->flags_lazy = false;
 
-            cpu->flags = cpu_pop(cpu);
+    if (result == 0)
+        cpu->flags |= FLAG_EQUAL | FLAG_ZERO;
+    else if (result < 0)
+        cpu->flags |= FLAG_LESS;
+    else
+        cpu->flags |= FLAG_GREATER;
 
-            uint16_t offset = cpu_pop(cpu);
-            uint16_t segment = cpu_pop(cpu);
+    return 0;
+}
 
-            if (cpu->flags & FLAG_USER_MODE)
-                cpu->us = segment;
-            else
-                cpu->cs = segment;
-            
-            cpu->pc = seg_offset(segment, offset);
-            pc_modified = true;
+ALWAYS_INLINE int conditional_move(CPU *cpu, const Instruction *inst, int cond, int from) {
+    if (condition_met(cpu, cond))
+        cpu->registers[inst->operand1] = (from == OPERAND_IMM) ? inst->operand2 : cpu->registers[inst->operand2];
 
-            cpu->flags |= FLAG_INT_DONE;
+    return 0;
+}
 
-            break;
-        }
+ALWAYS_INLINE int set_condition(CPU *cpu, const Instruction *inst, int cond) {
+    cpu->registers[inst->operand1] = condition_met(cpu, cond) ? 1 : 0;
+
+    return 0;
+}
 
-        case CLI: {
-            cpu->flags &= ~FLAG_INT_ENABLED;
+ALWAYS_INLINE int set_flag(CPU *cpu, uint16_t flag, bool set) {
+    if (set)
+        cpu->flags |= flag;
+    else
+        cpu->flags &= ~flag;
 
-            break;
-        }
+    return 0;
+}
 
-        case STI: {
-            cpu->flags |= FLAG_INT_ENABLED;
+#define CLASS(name) (1u << OPERAND_##name)
+#define CLASSES_REGISTER (CLASS(CS) | CLASS(SS) | CLASS(DS) | CLASS(US) | CLASS(PC) | CLASS(SP) | CLASS(FLAGS) | CLASS(ES))
+#define CLASSES_SPECIAL (CLASS(CS) | CLASS(SS) | CLASS(DS) | CLASS(US) | CLASS(PC) | CLASS(SP) | CLASS(FLAGS) | CLASS(ES) | CLASS(ID) | CLASS(OTHER))
+#define CLASSES_VALUE (CLASS(IMM) | CLASS(REG) | CLASSES_SPECIAL)
+#define CLASSES_ANY ((1u << OPERAND_CLASSES) - 1)
+
+#define MOVE_FORMS(X, name, to) \
+    X(mov_##name##_imm, MOV, CLASS(to), CLASS(IMM), move(cpu, inst, OPERAND_##to, OPERAND_IMM)) \
+    X(mov_##name##_reg, MOV, CLASS(to), CLASS(REG), move(cpu, inst, OPERAND_##to, OPERAND_REG)) \
+    X(mov_##name##_special, MOV, CLASS(to), CLASSES_REGISTER, move(cpu, inst, OPERAND_##to, register_classes[inst->operand2])) \
+    X(mov_##name##_id, MOV, CLASS(to), CLASS(ID), move(cpu, inst, OPERAND_##to, OPERAND_ID))
+
+#define MEMORY_FORMS(X, name, op) \
+    X(name##_abs, op, CLASS(REG), CLASS(IMM), access_memory(cpu, inst, user, op, OPERAND_IMM)) \
+    X(name##_ind, op, CLASS(REG), CLASS(REG), access_memory(cpu, inst, user, op, OPERAND_REG)) \
+    X(name##_disp, op, CLASS(REG), CLASS(DISP), access_memory(cpu, inst, user, op, OPERAND_DISP)) \
+    X(name##_index, op, CLASS(REG), CLASS(INDEX), access_memory(cpu, inst, user, op, OPERAND_INDEX)) \
+    X(name##_post_inc, op, CLASS(REG), CLASS(POST_INC), access_memory(cpu, inst, user, op, OPERAND_POST_INC)) \
+    X(name##_pre_dec, op, CLASS(REG), CLASS(PRE_DEC), access_memory(cpu, inst, user, op, OPERAND_PRE_DEC)) \
+    X(name##_address, op, CLASS(REG), CLASS(ADDRESS), access_memory(cpu, inst, user, op, OPERAND_ADDRESS))
+
+#define STORE_FORMS(X, name, from) \
+    X(st_abs_##name, ST, CLASS(IMM), CLASS(from), store(cpu, inst, user, OPERAND_IMM, OPERAND_##from)) \
+    X(st_ind_##name, ST, CLASS(REG), CLASS(from), store(cpu, inst, user, OPERAND_REG, OPERAND_##from)) \
+    X(st_disp_##name, ST, CLASS(DISP), CLASS(from), store(cpu, inst, user, OPERAND_DISP, OPERAND_##from)) \
+    X(st_index_##name, ST, CLASS(INDEX), CLASS(from), store(cpu, inst, user, OPERAND_INDEX, OPERAND_##from)) \
+    X(st_post_inc_##name, ST, CLASS(POST_INC), CLASS(from), store(cpu, inst, user, OPERAND_POST_INC, OPERAND_##from)) \
+    X(st_pre_dec_##name, ST, CLASS(PRE_DEC), CLASS(from), store(cpu, inst, user, OPERAND_PRE_DEC, OPERAND_##from)) \
+    X(st_address_##name, ST, CLASS(ADDRESS), CLASS(from), store(cpu, inst, user, OPERAND_ADDRESS, OPERAND_##from))
+
+#define ARITH_FORMS(X, name, op) \
+    X(name##_imm, op, CLASS(REG), CLASS(IMM), arith(cpu, inst, user, op, OPERAND_IMM)) \
+    X(name##_reg, op, CLASS(REG), CLASS(REG), arith(cpu, inst, user, op, OPERAND_REG)) \
+    X(name##_mem, op, CLASS(REG), CLASSES_SPECIAL, arith(cpu, inst, user, op, OPERAND_OTHER))
+
+#define BLOCK_FORMS(X, name, op) \
+    X(name##_imm_imm, op, CLASS(IMM), CLASS(IMM), block(cpu, inst, op, OPERAND_IMM, OPERAND_IMM)) \
+    X(name##_imm_reg, op, CLASS(IMM), CLASS(REG), block(cpu, inst, op, OPERAND_IMM, OPERAND_REG)) \
+    X(name##_reg_imm, op, CLASS(REG), CLASS(IMM), block(cpu, inst, op, OPERAND_REG, OPERAND_IMM)) \
+    X(name##_reg_reg, op, CLASS(REG), CLASS(REG), block(cpu, inst, op, OPERAND_REG, OPERAND_REG))
+
+#define CONDITIONAL_FORMS(X, name, cond) \
+    X(j##name, J##cond, CLASSES_VALUE, CLASSES_VALUE, jump(cpu, inst->operand1, user, CONDITION_##cond)) \
+    X(cmov##name##_imm, CMOV##cond, CLASS(REG), CLASS(IMM), conditional_move(cpu, inst, CONDITION_##cond, OPERAND_IMM)) \
+    X(cmov##name##_reg, CMOV##cond, CLASS(REG), CLASS(REG), conditional_move(cpu, inst, CONDITION_##cond, OPERAND_REG)) \
+    X(set##name, SET##cond, CLASS(REG), CLASSES_VALUE, set_condition(cpu, inst, CONDITION_##cond))
+
+// Condition numbers as condition_met takes them
+#define CONDITION_Z 0
+#define CONDITION_NZ 1
+#define CONDITION_E 2
+#define CONDITION_NE 3
+#define CONDITION_L 4
+#define CONDITION_LE 5
+#define CONDITION_G 6
+#define CONDITION_GE 7
+
+// X(form, opcode, operand 1 classes, operand 2 classes, body). A form replaces any earlier one for
+// the classes they share, and every combination left without a form is an invalid instruction
+#define INSTRUCTION_FORMS(X) \
+    X(mov_numbered, MOV, CLASS(IMM), CLASSES_VALUE, move_numbered(cpu, inst)) \
+    MOVE_FORMS(X, reg, REG) \
+    MOVE_FORMS(X, sp, SP) \
+    MOVE_FORMS(X, pc, PC) \
+    MOVE_FORMS(X, cs, CS) \
+    MOVE_FORMS(X, ss, SS) \
+    MOVE_FORMS(X, ds, DS) \
+    MOVE_FORMS(X, us, US) \
+    MOVE_FORMS(X, flags, FLAGS) \
+    MOVE_FORMS(X, es, ES) \
+    MEMORY_FORMS(X, ld, LD) \
+    STORE_FORMS(X, imm, IMM) \
+    STORE_FORMS(X, reg, REG) \
+    X(push_imm, PUSH, CLASS(IMM), CLASSES_VALUE, push(cpu, inst, OPERAND_IMM)) \
+    X(push_reg, PUSH, CLASS(REG), CLASSES_VALUE, push(cpu, inst, OPERAND_REG)) \
+    X(push_cs, PUSH, CLASS(CS), CLASSES_VALUE, push(cpu, inst, OPERAND_CS)) \
+    X(push_ss, PUSH, CLASS(SS), CLASSES_VALUE, push(cpu, inst, OPERAND_SS)) \
+    X(push_ds, PUSH, CLASS(DS), CLASSES_VALUE, push(cpu, inst, OPERAND_DS)) \
+    X(push_us, PUSH, CLASS(US), CLASSES_VALUE, push(cpu, inst, OPERAND_US)) \
+    X(push_flags, PUSH, CLASS(FLAGS), CLASSES_VALUE, push(cpu, inst, OPERAND_FLAGS)) \
+    X(push_es, PUSH, CLASS(ES), CLASSES_VALUE, push(cpu, inst, OPERAND_ES)) \
+    X(push_id, PUSH, CLASS(ID), CLASSES_VALUE, push(cpu, inst, OPERAND_ID)) \
+    X(pop_reg, POP, CLASS(REG), CLASSES_VALUE, pop(cpu, inst, OPERAND_REG)) \
+    X(pop_cs, POP, CLASS(CS), CLASSES_VALUE, pop(cpu, inst, OPERAND_CS)) \
+    X(pop_ss, POP, CLASS(SS), CLASSES_VALUE, pop(cpu, inst, OPERAND_SS)) \
+    X(pop_ds, POP, CLASS(DS), CLASSES_VALUE, pop(cpu, inst, OPERAND_DS)) \
+    X(pop_us, POP, CLASS(US), CLASSES_VALUE, pop(cpu, inst, OPERAND_US)) \
+    X(pop_flags, POP, CLASS(FLAGS), CLASSES_VALUE, pop(cpu, inst, OPERAND_FLAGS)) \
+    X(pop_es, POP, CLASS(ES), CLASSES_VALUE, pop(cpu, inst, OPERAND_ES)) \
+    ARITH_FORMS(X, add, ADD) \
+    ARITH_FORMS(X, sub, SUB) \
+    ARITH_FORMS(X, and, AND) \
+    ARITH_FORMS(X, or, OR) \
+    ARITH_FORMS(X, xor, XOR) \
+    ARITH_FORMS(X, shl, SHL) \
+    ARITH_FORMS(X, shr, SHR) \
+    ARITH_FORMS(X, cmp, CMP) \
+    ARITH_FORMS(X, mul, MUL) \
+    ARITH_FORMS(X, mulh, MULH) \
+    ARITH_FORMS(X, imulh, IMULH) \
+    ARITH_FORMS(X, div, DIV) \
+    ARITH_FORMS(X, idiv, IDIV) \
+    ARITH_FORMS(X, mod, MOD) \
+    ARITH_FORMS(X, imod, IMOD) \
+    X(inc, INC, CLASS(REG), CLASSES_VALUE, unary(cpu, inst, INC)) \
+    X(dec, DEC, CLASS(REG), CLASSES_VALUE, unary(cpu, inst, DEC)) \
+    X(not, NOT, CLASS(REG), CLASSES_VALUE, unary(cpu, inst, NOT)) \
+    X(jmp, JMP, CLASSES_VALUE, CLASSES_VALUE, jump(cpu, inst->operand1, user, CONDITION_ALWAYS)) \
+    CONDITIONAL_FORMS(X, z, Z) \
+    CONDITIONAL_FORMS(X, nz, NZ) \
+    CONDITIONAL_FORMS(X, e, E) \
+    CONDITIONAL_FORMS(X, ne, NE) \
+    CONDITIONAL_FORMS(X, l, L) \
+    CONDITIONAL_FORMS(X, le, LE) \
+    CONDITIONAL_FORMS(X, g, G) \
+    CONDITIONAL_FORMS(X, ge, GE) \
+    X(call, CALL, CLASSES_VALUE, CLASSES_VALUE, call(cpu, inst, user)) \
+    X(ret, RET, CLASSES_VALUE, CLASSES_VALUE, ret(cpu, user)) \
+    X(loop, LOOP, CLASS(REG), CLASSES_VALUE, loop(cpu, inst, user)) \
+    X(iret_invalid, IRET, CLASSES_ANY, CLASSES_ANY, user ? 5 : 2) \
+    X(iret, IRET, CLASSES_VALUE, CLASSES_VALUE, interrupt_return(cpu, user)) \
+    X(int_invalid, INT, CLASSES_ANY, CLASSES_ANY, user ? 5 : 2) \
+    X(int, INT, CLASSES_VALUE, CLASSES_VALUE, interrupt(cpu, inst, user)) \
+    X(cli, CLI, CLASSES_VALUE, CLASSES_VALUE, set_flag(cpu, FLAG_INT_ENABLED, false)) \
+    X(sti, STI, CLASSES_VALUE, CLASSES_VALUE, set_flag(cpu, FLAG_INT_ENABLED, true)) \
+    X(hlt, HLT, CLASSES_VALUE, CLASSES_VALUE, set_flag(cpu, FLAG_HALTED, true)) \
+    X(nop, NOP, CLASSES_VALUE, CLASSES_VALUE, 0) \
+    BLOCK_FORMS(X, bcopy, BCOPY) \
+    BLOCK_FORMS(X, bfill, BFILL) \
+    BLOCK_FORMS(X, bcmp, BCMP) \
+    MEMORY_FORMS(X, xchg, XCHG) \
+    MEMORY_FORMS(X, cas, CAS)
+
+typedef int (*InstHandler)(CPU *cpu, const Instruction *inst);
+
+// Every form is compiled once per privilege level, so no handler tests FLAG_USER_MODE itself
+#define DEFINE_HANDLERS(form, opcode, classes1, classes2, body) \
+    static int form##_supervisor(CPU *cpu, const Instruction *inst) { const bool user = false; (void)user; return body; } \
+    static int form##_user(CPU *cpu, const Instruction *inst) { const bool user = true; (void)user; return body; }
+
+#define FORM_INDEX(form, ...) FORM_##form,
+#define SUPERVISOR_HANDLER(form, ...) [FORM_##form] = form##_supervisor,
+#define USER_HANDLER(form, ...) [FORM_##form] = form##_user,
+#define ADD_FORM(form, opcode, classes1, classes2, body) add_form(FORM_##form, opcode, classes1, classes2);
+
+INSTRUCTION_FORMS(DEFINE_HANDLERS)
+
+enum FORM {
+    FORM_INVALID,
+    INSTRUCTION_FORMS(FORM_INDEX)
+    FORM_COUNT
+};
+
+_Static_assert(FORM_COUNT <= 256, "Instruction.form holds the form index in a byte");
+
+static int invalid_form(CPU *cpu, const Instruction *inst) {
+    return 2;
+}
 
-            break;
-        }
+static const InstHandler supervisor_handlers[FORM_COUNT] = {
+    [FORM_INVALID] = invalid_form,
+    INSTRUCTION_FORMS(SUPERVISOR_HANDLER)
+};
 
-        case INT: {
-            uint16_t int_num = inst.operand1;
+static const InstHandler user_handlers[FORM_COUNT] = {
+    [FORM_INVALID] = invalid_form,
+    INSTRUCTION_FORMS(USER_HANDLER)
+};
 
-            cpu_push(cpu, cpu->cs);
-            cpu_push(cpu, cpu->pc + INST_SIZE);
-            cpu_push(cpu, cpu->flags);
-            cpu_push(cpu, int_num);
+static uint8_t form_table[256][OPERAND_CLASSES][OPERAND_CLASSES];
 
-            if (int_num == 8)
-                return 8;
+static void add_form(uint8_t form, uint8_t opcode, uint32_t classes1, uint32_t classes2) {
+    for (int class1 = 0; class1 < OPERAND_CLASSES; class1++)
+        for (int class2 = 0; class2 < OPERAND_CLASSES; class2++)
+            if ((classes1 & (1u << class1)) && (classes2 & (1u << class2)))
+                form_table[opcode][class1][class2] = form;
+}
 
-            uint32_t ivt_entry = IVT_ADDR + (int_num * 4);
-            uint16_t segment = (cpu->memory[ivt_entry] << 8) | cpu->memory[ivt_entry + 1];
-            uint16_t offset = (cpu->memory[ivt_entry + 2] << 8) | cpu->memory[ivt_entry + 3];
+// Filled before main, so the table never changes once a machine decodes anything
+__attribute__((constructor)) static void init_forms() {
+    INSTRUCTION_FORMS(ADD_FORM)
+}
 
-            cpu->cs = segment;
-            cpu->pc = seg_offset(segment, offset);
+// Done once per decode: the handler chosen here already knows the opcode and both operand classes
+void select_form(Instruction *inst) {
+    inst->form = form_table[inst->opcode][operand_class(inst->mode1, inst->operand1)][operand_class(inst->mode2, inst->operand2)];
+}
 
-            pc_modified = true;
+ALWAYS_INLINE int execute(CPU *cpu, const Instruction *inst, const InstHandler *handlers, bool user) {
+    // INT and IRET report the privilege violation even from a page that cannot be executed
+    if (!page_allowed_as(cpu, cpu->pc, PAGE_X, 0, user))
+        return (user && (inst->opcode == INT || inst->opcode == IRET)) ? 5 : 4;
 
-            break;
-        }
+    int status = handlers[inst->form](cpu, inst);
 
-        case NOP: {
-            break;
-        }
+    if (status == 0 && !cpu->pc_modified)
+        cpu->pc += inst->size;
 
-        case HLT: {
-            cpu->flags |= FLAG_HALTED;
+    return status;
+}
 
-            break;
-        }
+int exec_instruction(CPU *cpu, Instruction inst) {
+    cpu->pc_modified = false;
+    cpu->ip = inst.opcode;
 
-        default: {
-            return 2;
-        }
+    if ((cpu->flags & FLAG_RESET) && cpu->pc >= BIOS_ADDR) {
+        cpu->flags &= ~FLAG_RESET;
+
+        update_pages(cpu);
     }
 
-    if (!pc_modified)
-        cpu->pc += INST_SIZE;
+    if (cpu->flags & FLAG_USER_MODE)
+        return execute(cpu, &inst, user_handlers, true);
 
-    return 0;
-}
\ No newline at end of file
+    return execute(cpu, &inst, supervisor_handlers, false);
+}
@@ -2,6 +2,7 @@
 #define ISA_H
 
 #include "common.h"
+#include "smp.h"
 
 enum ISA {
     MOV = 0x00,
@@ -36,12 +37,74 @@ enum ISA {
     CLI = 0x1e,
     STI = 0x1f,
     NOP = 0x20,
+    BCOPY = 0x21,
+    BFILL = 0x22,
+    BCMP = 0x23,
+    MUL = 0x24,
+    MULH = 0x25,
+    IMULH = 0x26,
+    DIV = 0x27,
+    IDIV = 0x28,
+    MOD = 0x29,
+    IMOD = 0x2a,
+    CMOVZ = 0x2b,
+    CMOVNZ = 0x2c,
+    CMOVE = 0x2d,
+    CMOVNE = 0x2e,
+    CMOVL = 0x2f,
+    CMOVLE = 0x30,
+    CMOVG = 0x31,
+    CMOVGE = 0x32,
+    SETZ = 0x33,
+    SETNZ = 0x34,
+    SETE = 0x35,
+    SETNE = 0x36,
+    SETL = 0x37,
+    SETLE = 0x38,
+    SETG = 0x39,
+    SETGE = 0x3a,
+    LOOP = 0x3b,
+    XCHG = 0x3c,
+    CAS = 0x3d,
     HLT = 0xff
 };
 
-extern bool framebuffer_dirty;
-
 Instruction parse_instruction(CPU *cpu);
+void select_form(Instruction *inst);
+
+static inline uint8_t inst_length(CPU *cpu, uint32_t addr) {
+    return (cpu->memory[(addr + 1) & ADDR_MASK] & INST_COMPACT) ? COMPACT_INST_SIZE : INST_SIZE;
+}
+
 int exec_instruction(CPU *cpu, Instruction inst);
 
+// Marks the framebuffer rows covered by [addr, addr + len) for the next display update
+static inline void mark_framebuffer_dirty(CPU *cpu, uint32_t addr, uint32_t len) {
+    Machine *machine = cpu->machine;
+    uint32_t start = (addr > FRAMEBUFFER_ADDR) ? addr : FRAMEBUFFER_ADDR;
+    uint32_t end = addr + len;
+
+    if (end > FRAMEBUFFER_ADDR + FRAMEBUFFER_WIDTH * FRAMEBUFFER_HEIGHT)
+        end = FRAMEBUFFER_ADDR + FRAMEBUFFER_WIDTH * FRAMEBUFFER_HEIGHT;
+
+    if (start >= end)
+        return;
+
+    uint16_t first = (start - FRAMEBUFFER_ADDR) / FRAMEBUFFER_WIDTH;
+    uint16_t last = (end - 1 - FRAMEBUFFER_ADDR) / FRAMEBUFFER_WIDTH;
+
+    // the display thread reads and clears the range, so this is locked even with one core
+    device_lock(machine);
+
+    if (!machine->framebuffer_dirty || first < machine->framebuffer_dirty_first)
+        machine->framebuffer_dirty_first = first;
+
+    if (!machine->framebuffer_dirty || last > machine->framebuffer_dirty_last)
+        machine->framebuffer_dirty_last = last;
+
+    machine->framebuffer_dirty = true;
+
+    device_unlock(machine);
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,333 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include "libhexa.h"
+#include "cpu.h"
+#include "instruction_set.h"
+#include "debug.h"
+#include "smp.h"
+#include "memory.h"
+#include "aot.h"
+
+static void init_stats(HexaStats *stats, uint16_t cores) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    stats->magic = HEXA_STATS_MAGIC;
+    stats->version = HEXA_STATS_VERSION;
+    stats->size = sizeof(HexaStats);
+    stats->pid = getpid();
+    stats->cores = cores;
+    stats->start_ns = (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+HexaMachine *hexa_create(uint16_t cores) {
+    if (cores < 1 || cores > MAX_CORES)
+        return NULL;
+
+    Machine *machine = calloc(1, sizeof(Machine));
+
+    if (!machine)
+        return NULL;
+
+    // anonymous pages start out as the shared zero page and are only allocated once written;
+    // the slack after MEM_SIZE covers instruction fetches at the very top of memory
+    void *memory = mmap(NULL, MEM_SIZE + INST_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (memory == MAP_FAILED) {
+        free(machine);
+
+        return NULL;
+    }
+
+    if (!init_device_lock(machine)) {
+        munmap(memory, MEM_SIZE + INST_SIZE);
+        free(machine);
+
+        return NULL;
+    }
+
+    machine->memory = memory;
+    machine->stats = &machine->own_stats;
+    machine->sched_next = UINT64_MAX;
+    machine->framebuffer_dirty_last = FRAMEBUFFER_HEIGHT - 1;
+    machine->cores[0].machine = machine;
+    machine->cores[0].memory = memory;
+
+    init_stats(machine->stats, cores);
+    init_cpu(&machine->cores[0]);
+    smp_init(machine, cores);
+
+    return machine;
+}
+
+void hexa_destroy(HexaMachine *machine) {
+    if (!machine)
+        return;
+
+    if (machine->disk_mapped)
+        munmap((void *)machine->disk_data, machine->disk_size);
+
+    munmap(machine->memory, MEM_SIZE + INST_SIZE);
+    pthread_mutex_destroy(&machine->device_mutex);
+    free(machine->bp_bitmap);
+    free(machine->snapshot_memory);
+    free(machine->snapshot);
+    free_symbol_map(machine);
+    free(machine);
+}
+
+bool hexa_load_bios(HexaMachine *machine, const uint8_t *bios, size_t size) {
+    return load_bios(&machine->cores[0], bios, size) != 0;
+}
+
+// The buffer stays owned by the caller and must outlive the machine; guest writes land in it directly
+bool hexa_load_disk(HexaMachine *machine, uint8_t *disk, size_t size) {
+    if (!disk || size == 0)
+        return false;
+
+    if (machine->disk_mapped)
+        munmap((void *)machine->disk_data, machine->disk_size);
+
+    machine->disk_name = NULL;
+    machine->disk_data = disk;
+    machine->disk_buffer = disk;
+    machine->disk_size = size;
+    machine->disk_mapped = false;
+
+    return true;
+}
+
+void hexa_set_callbacks(HexaMachine *machine, const HexaCallbacks *callbacks) {
+    if (callbacks)
+        machine->callbacks = *callbacks;
+    else
+        memset(&machine->callbacks, 0, sizeof(machine->callbacks));
+}
+
+void hexa_set_hle(HexaMachine *machine, bool enabled) {
+    machine->hle_bios = enabled;
+}
+
+// Steps every core once per round on the calling thread, so a run is deterministic for a given input
+HexaExit hexa_run(HexaMachine *machine, uint64_t max_instructions, uint16_t *status) {
+    HexaExit reason = HEXA_EXIT_LIMIT;
+    uint64_t executed = 0;
+
+    machine->stop = false;
+
+    for (uint64_t i = 0; i < max_instructions && reason == HEXA_EXIT_LIMIT; i++) {
+        bool halted = true;
+
+        for (uint16_t c = 0; c < machine->core_count; c++) {
+            CPU *core = &machine->cores[c];
+
+            if (c != 0 && (core->flags & FLAG_HALTED) && !atomic_load(&core->signals))
+                continue;
+
+            int result = step_program(core, parse_instruction(core));
+
+            if (result) {
+                if (status)
+                    *status = result;
+
+                reason = HEXA_EXIT_EXCEPTION;
+
+                break;
+            }
+
+            tick_core(core);
+            executed++;
+
+            if (!(core->flags & FLAG_HALTED) || (core->flags & FLAG_INT_ENABLED))
+                halted = false;
+        }
+
+        if (reason != HEXA_EXIT_LIMIT)
+            break;
+
+        if (machine->stop)
+            reason = HEXA_EXIT_STOPPED;
+        else if (halted)
+            reason = HEXA_EXIT_HALTED;
+    }
+
+    stat_add(&machine->stats->instructions, executed);
+
+    return reason;
+}
+
+void hexa_stop(HexaMachine *machine) {
+    machine->stop = true;
+}
+
+uint64_t hexa_instructions(HexaMachine *machine) {
+    return machine->sched_cycles;
+}
+
+bool hexa_snapshot(HexaMachine *machine) {
+    if (!machine->snapshot_memory && !(machine->snapshot_memory = malloc(MEM_SIZE)))
+        return false;
+
+    if (!machine->snapshot && !(machine->snapshot = malloc(sizeof(Machine))))
+        return false;
+
+    for (uint16_t c = 0; c < machine->core_count; c++)
+        sync_flags(&machine->cores[c]);
+
+    memcpy(machine->snapshot_memory, machine->memory, MEM_SIZE);
+    memcpy(machine->snapshot, machine, sizeof(Machine));
+    track_dirty_pages(machine);
+
+    return true;
+}
+
+// Only the pages written since the snapshot (or the last restore) are copied back, so the cost
+// follows what the guest touched instead of the size of memory
+bool hexa_restore(HexaMachine *machine) {
+    Machine *snapshot = machine->snapshot;
+
+    if (!snapshot)
+        return false;
+
+    for (size_t i = 0; i < machine->dirty_count; i++) {
+        uint32_t addr = (uint32_t)machine->dirty_pages[i] << PAGE_SHIFT;
+
+        memcpy(&machine->memory[addr], &machine->snapshot_memory[addr], PAGE_SIZE);
+        aot_invalidate(machine, addr, PAGE_SIZE);
+    }
+
+    reset_dirty_pages(machine);
+
+    memcpy(machine->cores, snapshot->cores, machine->core_count * sizeof(CPU));
+    machine->stop = false;
+
+    machine->framebuffer_dirty = snapshot->framebuffer_dirty;
+    machine->framebuffer_dirty_first = snapshot->framebuffer_dirty_first;
+    machine->framebuffer_dirty_last = snapshot->framebuffer_dirty_last;
+
+    memcpy(machine->serial_history, snapshot->serial_history, snapshot->serial_history_len);
+    machine->serial_history_len = snapshot->serial_history_len;
+    machine->serial_pattern_seen = snapshot->serial_pattern_seen;
+
+    memcpy(machine->events, snapshot->events, snapshot->event_count * sizeof(Event));
+    machine->event_count = snapshot->event_count;
+    machine->sched_cycles = snapshot->sched_cycles;
+    machine->sched_next = snapshot->sched_next;
+    machine->dma = snapshot->dma;
+    machine->pic = snapshot->pic;
+    machine->pic_ready = snapshot->pic_ready;
+
+    return true;
+}
+
+static uint16_t *register_slot(CPU *cpu, int reg) {
+    if (reg >= R0 && reg <= R7)
+        return &cpu->registers[reg];
+
+    switch (reg) {
+        case CS: return &cpu->cs;
+        case SS: return &cpu->ss;
+        case DS: return &cpu->ds;
+        case US: return &cpu->us;
+        case SP: return &cpu->sp;
+        case FLAGS: return &cpu->flags;
+        case ES: return &cpu->es;
+        default: return NULL;
+    }
+}
+
+uint32_t hexa_get_reg(HexaMachine *machine, uint16_t core, int reg) {
+    if (core >= machine->core_count)
+        return 0;
+
+    CPU *cpu = &machine->cores[core];
+    uint16_t *slot = register_slot(cpu, reg);
+
+    sync_flags(cpu);
+
+    if (reg == PC)
+        return cpu->pc;
+    else if (reg == IP)
+        return cpu->ip;
+
+    return slot ? *slot : 0;
+}
+
+bool hexa_set_reg(HexaMachine *machine, uint16_t core, int reg, uint32_t value) {
+    if (core >= machine->core_count)
+        return false;
+
+    CPU *cpu = &machine->cores[core];
+    uint16_t *slot = register_slot(cpu, reg);
+
+    // a pending CMP goes first, so a FLAGS write replaces it and any other write keeps it
+    sync_flags(cpu);
+
+    uint16_t flags = cpu->flags;
+
+    if (reg == PC)
+        cpu->pc = value & ADDR_MASK;
+    else if (reg == IP)
+        cpu->ip = value;
+    else if (slot)
+        *slot = value;
+    else
+        return false;
+
+    // leaving the reset state takes away execute permission from low memory
+    if ((flags ^ cpu->flags) & FLAG_RESET)
+        update_pages(cpu);
+
+    return true;
+}
+
+bool hexa_read_memory(HexaMachine *machine, uint32_t addr, void *buffer, size_t len) {
+    if (addr > MEM_SIZE || len > MEM_SIZE - addr)
+        return false;
+
+    memcpy(buffer, &machine->memory[addr], len);
+
+    return true;
+}
+
+// Writes bypass protection and device side effects, like a debugger poking memory
+bool hexa_write_memory(HexaMachine *machine, uint32_t addr, const void *buffer, size_t len) {
+    if (addr > MEM_SIZE || len > MEM_SIZE - addr)
+        return false;
+
+    memcpy(&machine->memory[addr], buffer, len);
+    mark_framebuffer_dirty(&machine->cores[0], addr, len);
+    mark_pages_dirty(machine, addr, len);
+    aot_invalidate(machine, addr, len);
+
+    return true;
+}
+
+bool hexa_framebuffer(HexaMachine *machine, const uint8_t **pixels) {
+    device_lock(machine);
+
+    bool dirty = machine->framebuffer_dirty;
+
+    machine->framebuffer_dirty = false;
+
+    device_unlock(machine);
+
+    *pixels = &machine->memory[FRAMEBUFFER_ADDR];
+
+    if (dirty)
+        stat_add(&machine->stats->frames, 1);
+
+    return dirty;
+}
+
+const HexaStats *hexa_stats(HexaMachine *machine) {
+    return machine->stats;
+}
+
+void hexa_set_stats(HexaMachine *machine, HexaStats *stats) {
+    memcpy(stats, machine->stats, sizeof(HexaStats));
+    machine->stats = stats;
+}
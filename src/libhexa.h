@@ -0,0 +1,109 @@
+#ifndef LIBHEXA_H
+#define LIBHEXA_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// Embedding API for the emulator core. Every machine owns all of its state, so any number of
+// them can be driven from one process; a single machine must only be used by one thread at a time.
+
+typedef struct Machine HexaMachine;
+
+enum HEXA_REGS {
+    HEXA_R0 = 0x00,
+    HEXA_R1 = 0x01,
+    HEXA_R2 = 0x02,
+    HEXA_R3 = 0x03,
+    HEXA_R4 = 0x04,
+    HEXA_R5 = 0x05,
+    HEXA_R6 = 0x06,
+    HEXA_R7 = 0x07,
+    HEXA_CS = 0x08,
+    HEXA_SS = 0x09,
+    HEXA_DS = 0x0a,
+    HEXA_US = 0x0b,
+    HEXA_PC = 0x0c,
+    HEXA_IP = 0x0d,
+    HEXA_SP = 0x0e,
+    HEXA_FLAGS = 0x0f,
+    HEXA_ES = 0x10
+};
+
+typedef enum {
+    HEXA_EXIT_LIMIT,        // the instruction budget was used up
+    HEXA_EXIT_EXCEPTION,    // a core raised an exception (INT #8 included)
+    HEXA_EXIT_HALTED,       // every core is halted with interrupts disabled
+    HEXA_EXIT_STOPPED       // a callback called hexa_stop
+} HexaExit;
+
+typedef struct {
+    void *user;
+
+    // a byte the guest sent through the serial port; without it the byte goes to stdout
+    void (*serial_out)(void *user, uint8_t data);
+
+    // any guest store to an MMIO page, after the built-in devices have seen it
+    void (*mmio_write)(void *user, uint16_t core, uint32_t addr, uint16_t value);
+
+    // an exception on a core; without it the exception is reported on stdout
+    void (*exception)(void *user, uint16_t core, uint16_t status);
+} HexaCallbacks;
+
+// Counters a machine keeps while it runs, laid out so another process can read them from shared
+// memory. Fields are only ever appended; `size` tells a reader how many of them the writer has.
+#define HEXA_STATS_MAGIC 0x68787374
+#define HEXA_STATS_VERSION 1
+#define HEXA_STATS_VECTORS 16
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;
+    uint32_t pid;
+    uint64_t start_ns;              // CLOCK_MONOTONIC
+    uint64_t update_ns;             // last time instructions and mips were published
+    uint64_t instructions;          // retired, all cores
+    uint64_t mips_milli;            // over the last second, in thousandths of a MIPS
+    uint64_t interrupts[HEXA_STATS_VECTORS];
+    uint64_t exceptions;
+    uint64_t disk_commands;
+    uint64_t disk_sectors;
+    uint64_t disk_latency_ns;       // total host time spent on disk commands
+    uint64_t disk_latency_max_ns;
+    uint64_t serial_bytes;
+    uint64_t frames;                // frames presented by the frontend
+    uint64_t throttle_slack_ns;     // total time slept to hold the clock speed
+    uint16_t cores;
+    uint16_t reserved[3];
+} HexaStats;
+
+HexaMachine *hexa_create(uint16_t cores);
+void hexa_destroy(HexaMachine *machine);
+
+bool hexa_load_bios(HexaMachine *machine, const uint8_t *bios, size_t size);
+bool hexa_load_disk(HexaMachine *machine, uint8_t *disk, size_t size);
+void hexa_set_callbacks(HexaMachine *machine, const HexaCallbacks *callbacks);
+void hexa_set_hle(HexaMachine *machine, bool enabled);
+
+// A snapshot keeps the machine state and memory (but not the disk); restoring it only copies back
+// the pages that were written since, which makes it cheap enough to run once per fuzzing input
+bool hexa_snapshot(HexaMachine *machine);
+bool hexa_restore(HexaMachine *machine);
+
+HexaExit hexa_run(HexaMachine *machine, uint64_t max_instructions, uint16_t *status);
+void hexa_stop(HexaMachine *machine);
+uint64_t hexa_instructions(HexaMachine *machine);
+
+uint32_t hexa_get_reg(HexaMachine *machine, uint16_t core, int reg);
+bool hexa_set_reg(HexaMachine *machine, uint16_t core, int reg, uint32_t value);
+bool hexa_read_memory(HexaMachine *machine, uint32_t addr, void *buffer, size_t len);
+bool hexa_write_memory(HexaMachine *machine, uint32_t addr, const void *buffer, size_t len);
+bool hexa_framebuffer(HexaMachine *machine, const uint8_t **pixels);
+
+// Counting starts in storage owned by the machine; hexa_set_stats moves it (with the counts so far)
+// into caller-provided memory such as a shared mapping, which must outlive the machine
+const HexaStats *hexa_stats(HexaMachine *machine);
+void hexa_set_stats(HexaMachine *machine, HexaStats *stats);
+
+#endif
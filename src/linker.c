@@ -0,0 +1,281 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include "common.h"
+#include "object.h"
+
+#define GLOBAL_TABLE_INIT 1024
+
+typedef struct {
+    const char *name;
+    uint32_t addr;
+    int object;
+} Global;
+
+Object *objects = NULL;
+char **object_files = NULL;
+uint32_t *object_base = NULL;
+int object_count = 0;
+
+Global *globals = NULL;
+size_t global_cap = 0;
+size_t global_count = 0;
+
+uint32_t hash_symbol(const char *str) {
+    uint32_t hash = 2166136261u;
+
+    while (*str) {
+        hash ^= (uint8_t)*str++;
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+Global *find_global(const char *name) {
+    uint32_t slot = hash_symbol(name) & (global_cap - 1);
+
+    while (globals[slot].name != NULL) {
+        if (strcmp(globals[slot].name, name) == 0)
+            return &globals[slot];
+
+        slot = (slot + 1) & (global_cap - 1);
+    }
+
+    return &globals[slot];
+}
+
+int collect_globals() {
+    size_t total = 0;
+
+    for (int i = 0; i < object_count; i++)
+        total += objects[i].sym_count;
+
+    global_cap = GLOBAL_TABLE_INIT;
+
+    while (global_cap < total * 2)
+        global_cap *= 2;
+
+    globals = calloc(global_cap, sizeof(Global));
+
+    if (!globals) {
+        printf("Memory allocation failed\n");
+
+        return 1;
+    }
+
+    for (int i = 0; i < object_count; i++) {
+        for (uint32_t j = 0; j < objects[i].sym_count; j++) {
+            ObjSymbol *sym = &objects[i].symbols[j];
+
+            if (!(sym->flags & SYM_DEFINED) || (sym->flags & SYM_LOCAL))
+                continue;
+
+            Global *global = find_global(sym->name);
+
+            if (global->name != NULL) {
+                printf("Error: Duplicate symbol '%s'\n  > defined in %s and %s\n", sym->name, object_files[global->object], object_files[i]);
+
+                return 1;
+            }
+
+            global->name = sym->name;
+            global->addr = (object_base[i] + sym->value) & ADDR_MASK;
+            global->object = i;
+            global_count++;
+        }
+    }
+
+    return 0;
+}
+
+int layout(uint32_t *origin, uint32_t *end) {
+    uint32_t lc = (objects[0].flags & OBJ_FLAG_ORG) ? objects[0].org : START_ADDR;
+
+    *origin = lc;
+
+    for (int i = 0; i < object_count; i++) {
+        Object *obj = &objects[i];
+
+        if (obj->flags & OBJ_FLAG_ORG) {
+            if (obj->org < lc) {
+                printf("Error: %s at 0x%05x overlaps previous object ending at 0x%05x\n", object_files[i], obj->org, lc);
+
+                return 1;
+            }
+
+            lc = obj->org;
+        } else
+            lc = (lc + 1) & ~1u;
+
+        object_base[i] = lc;
+        lc += obj->size;
+
+        if (lc > MEM_SIZE) {
+            printf("Error: %s does not fit in memory\n", object_files[i]);
+
+            return 1;
+        }
+    }
+
+    *end = lc;
+
+    return 0;
+}
+
+int relocate(uint8_t *image, uint32_t origin) {
+    for (int i = 0; i < object_count; i++) {
+        Object *obj = &objects[i];
+        uint8_t *code = &image[object_base[i] - origin];
+
+        memcpy(code, obj->code, obj->size);
+
+        for (uint32_t j = 0; j < obj->reloc_count; j++) {
+            ObjReloc *reloc = &obj->relocs[j];
+            ObjSymbol *sym = &obj->symbols[reloc->sym];
+            uint32_t addr;
+
+            if (sym->flags & SYM_DEFINED) {
+                addr = (object_base[i] + sym->value) & ADDR_MASK;
+            } else {
+                Global *global = find_global(sym->name);
+
+                if (global->name == NULL) {
+                    printf("Error: Undefined symbol '%s'\n  > referenced in %s\n", sym->name, object_files[i]);
+
+                    return 1;
+                }
+
+                addr = global->addr;
+            }
+
+            code[reloc->offset] = (addr >> 8) & 0xff;
+            code[reloc->offset + 1] = addr & 0xff;
+        }
+    }
+
+    return 0;
+}
+
+int write_map(const char *path, uint32_t end) {
+    size_t total = 0;
+    size_t count = 0;
+
+    for (int i = 0; i < object_count; i++)
+        total += objects[i].sym_count;
+
+    MapSymbol *syms = malloc((total ? total : 1) * sizeof(MapSymbol));
+
+    if (!syms) {
+        printf("Memory allocation failed\n");
+
+        return 1;
+    }
+
+    for (int i = 0; i < object_count; i++) {
+        for (uint32_t j = 0; j < objects[i].sym_count; j++) {
+            ObjSymbol *sym = &objects[i].symbols[j];
+
+            if (!(sym->flags & SYM_DEFINED))
+                continue;
+
+            syms[count].name = sym->name;
+            syms[count].addr = (object_base[i] + sym->value) & ADDR_MASK;
+            count++;
+        }
+    }
+
+    int status = write_symbol_map(path, syms, count, end);
+
+    free(syms);
+
+    return status;
+}
+
+int main(int argc, char *argv[]) {
+    char *out_file = NULL;
+    char *map_file = NULL;
+
+    objects = calloc(argc, sizeof(Object));
+    object_files = calloc(argc, sizeof(char *));
+    object_base = calloc(argc, sizeof(uint32_t));
+
+    if (!objects || !object_files || !object_base) {
+        printf("Memory allocation failed\n");
+
+        return 1;
+    }
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+            out_file = argv[++i];
+        else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc)
+            map_file = argv[++i];
+        else
+            object_files[object_count++] = argv[i];
+    }
+
+    if (out_file == NULL || object_count == 0) {
+        printf("Usage: hexa_ld -o <file.bin> [-m <file.map>] <file.hxo>...\n");
+
+        return 1;
+    }
+
+    for (int i = 0; i < object_count; i++)
+        if (read_object(object_files[i], &objects[i]))
+            return 1;
+
+    uint32_t origin, end;
+
+    if (layout(&origin, &end) || collect_globals())
+        return 1;
+
+    uint32_t file_size = IMAGE_HEADER_SIZE + (end - origin);
+    uint8_t *image = calloc(file_size, 1);
+
+    if (!image) {
+        printf("Memory allocation failed\n");
+
+        return 1;
+    }
+
+    uint8_t flags = 0;
+
+    for (int i = 0; i < object_count; i++)
+        if (objects[i].flags & OBJ_FLAG_COMPACT)
+            flags |= IMAGE_FLAG_COMPACT;
+
+    write_image_header(image, origin, file_size, flags);
+
+    if (relocate(image + IMAGE_HEADER_SIZE, origin))
+        return 1;
+
+    FILE *output_file = fopen(out_file, "wb");
+
+    if (!output_file) {
+        printf("Unable to create file %s\n", out_file);
+
+        return 1;
+    }
+
+    fwrite(image, 1, file_size, output_file);
+
+    if (fclose(output_file) != 0) {
+        printf("Failed to write %s\n", out_file);
+
+        return 1;
+    }
+
+    if (map_file != NULL && write_map(map_file, end))
+        return 1;
+
+    printf("Linked %d object(s), %zu global symbol(s): wrote %u bytes to %s\n", object_count, global_count, file_size, out_file);
+
+    for (int i = 0; i < object_count; i++)
+        free_object(&objects[i]);
+
+    free(image);
+
+    return 0;
+}
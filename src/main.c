@@ -1,22 +1,53 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <ctype.h>
 #include <signal.h>
 #include <pthread.h>
 #include <stdatomic.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include <SDL2/SDL.h>
+#include "libhexa.h"
 #include "cpu.h"
 #include "instruction_set.h"
 #include "serial.h"
 #include "disk.h"
+#include "gdb.h"
+#include "debug.h"
+#include "events.h"
+#include "smp.h"
+#include "aot.h"
+
+#define MAX_CYCLES 100000
+#define MAX_LAG 0.1
+#define IDLE_SLEEP 0.0001
+#define MIPS_WINDOW 1.0
+
+enum {
+    FF_NONE,
+    FF_INST,
+    FF_PC,
+    FF_SERIAL
+};
 
 SDL_Window *window = NULL;
 SDL_Renderer *renderer = NULL;
 SDL_Texture *texture = NULL;
 
-CPU cpu;
+Machine *machine = NULL;
 atomic_bool running = true;
-pthread_t emu_thread;
+pthread_t emu_threads[MAX_CORES];
+bool show_startup_time = false;
+struct timespec launch_time;
+double emu_speed = 1.0;
+atomic_int ff_mode = FF_NONE;
+uint64_t ff_target = 0;
+const char *ff_pattern = NULL;
+char stats_name[64] = "";
+bool use_aot = false;
 
 void init_sdl() {
     SDL_Init(SDL_INIT_VIDEO);
@@ -29,126 +60,383 @@ void init_sdl() {
                                 SDL_PIXELFORMAT_RGB332,
                                 SDL_TEXTUREACCESS_STREAMING,
                                 FRAMEBUFFER_WIDTH, FRAMEBUFFER_HEIGHT);
+
+    SDL_UpdateTexture(texture, NULL, &machine->memory[FRAMEBUFFER_ADDR], FRAMEBUFFER_WIDTH);
 }
 
+// The emulator thread marks rows even with a single core, so the range is always taken under the lock
 void update_display(uint8_t *framebuffer) {
-    SDL_UpdateTexture(texture, NULL, framebuffer, FRAMEBUFFER_WIDTH);
+    device_lock(machine);
+
+    bool dirty = machine->framebuffer_dirty;
+    SDL_Rect rows = {0, machine->framebuffer_dirty_first, FRAMEBUFFER_WIDTH, machine->framebuffer_dirty_last - machine->framebuffer_dirty_first + 1};
+
+    machine->framebuffer_dirty = false;
+
+    device_unlock(machine);
+
+    if (!dirty)
+        return;
+
+    SDL_UpdateTexture(texture, &rows, framebuffer + rows.y * FRAMEBUFFER_WIDTH, FRAMEBUFFER_WIDTH);
     SDL_RenderClear(renderer);
     SDL_RenderCopy(renderer, texture, NULL, NULL);
     SDL_RenderPresent(renderer);
 
-    framebuffer_dirty = false;
+    stat_add(&machine->stats->frames, 1);
 }
 
 void cleanup_sdl() {
+    if (!window)
+        return;
+
     SDL_DestroyTexture(texture);
     SDL_DestroyRenderer(renderer);
     SDL_DestroyWindow(window);
     SDL_Quit();
 }
 
-uint8_t *read_file(const char *filename, size_t *size) {
-    FILE *file = fopen(filename, "rb");
+bool parse_watch(const char *spec) {
+    char *end;
+    uint32_t addr = strtoul(spec, &end, 0);
+    uint32_t len = 2;
+    uint8_t type = WATCH_WRITE;
+
+    if (end == spec)
+        return false;
+
+    if (*end == ':' && isdigit((unsigned char)end[1]))
+        len = strtoul(end + 1, &end, 0);
+
+    if (*end == ':') {
+        end++;
+
+        if (strcmp(end, "r") == 0)
+            type = WATCH_READ;
+        else if (strcmp(end, "w") == 0)
+            type = WATCH_WRITE;
+        else if (strcmp(end, "rw") == 0)
+            type = WATCH_ACCESS;
+        else
+            return false;
+    } else if (*end != '\0')
+        return false;
+
+    return add_watchpoint(machine, addr, len, type);
+}
 
-    if (!file) {
-        fprintf(stderr, "Could not open file %s\n", filename);
+double monotonic_seconds() {
+    struct timespec now;
 
-        return NULL;
-    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+void sleep_seconds(double seconds) {
+    struct timespec delay = {(time_t)seconds, (long)((seconds - (time_t)seconds) * 1e9)};
+
+    nanosleep(&delay, NULL);
+}
 
-    fseek(file, 0, SEEK_END);
+// Publishes the counters in /dev/shm/hexa.<pid>, where hexa_top finds every running instance
+bool open_stats() {
+    snprintf(stats_name, sizeof(stats_name), "/hexa.%d", (int)getpid());
 
-    long file_size = ftell(file);
+    int fd = shm_open(stats_name, O_CREAT | O_RDWR | O_TRUNC, 0644);
 
-    fseek(file, 0, SEEK_SET);
+    if (fd < 0)
+        return false;
 
-    if (file_size <= 0) {
-        fprintf(stderr, "Empty or invalid file\n");
-        fclose(file);
+    if (ftruncate(fd, sizeof(HexaStats)) < 0) {
+        close(fd);
+        shm_unlink(stats_name);
 
-        return NULL;
+        return false;
     }
 
-    uint8_t *buffer = (uint8_t *)malloc(file_size);
+    HexaStats *stats = mmap(NULL, sizeof(HexaStats), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
 
-    if (!buffer) {
-        fprintf(stderr, "Memory allocation failed\n");
-        fclose(file);
+    close(fd);
+
+    if (stats == MAP_FAILED) {
+        shm_unlink(stats_name);
 
-        return NULL;
+        return false;
     }
 
-    size_t bytes_read = fread(buffer, 1, file_size, file);
-    
-    fclose(file);
+    hexa_set_stats(machine, stats);
+
+    return true;
+}
+
+// Runs on the display thread, so the cores never wait on it
+void publish_stats() {
+    static double window_start = 0;
+    static uint64_t window_instructions = 0;
+
+    HexaStats *stats = machine->stats;
+    double now = monotonic_seconds();
+    uint64_t instructions = 0;
 
-    if (bytes_read != file_size) {
-        fprintf(stderr, "Failed to read entire file\n");
-        free(buffer);
+    for (uint16_t i = 0; i < machine->core_count; i++)
+        instructions += __atomic_load_n(&machine->cores[i].executed, __ATOMIC_RELAXED);
 
-        return NULL;
+    __atomic_store_n(&stats->instructions, instructions, __ATOMIC_RELAXED);
+    __atomic_store_n(&stats->update_ns, (uint64_t)(now * 1e9), __ATOMIC_RELAXED);
+
+    if (window_start == 0) {
+        window_start = now;
+        window_instructions = instructions;
+    } else if (now - window_start >= MIPS_WINDOW) {
+        __atomic_store_n(&stats->mips_milli, (uint64_t)((instructions - window_instructions) / (now - window_start) / 1e3), __ATOMIC_RELAXED);
+
+        window_start = now;
+        window_instructions = instructions;
     }
+}
 
-    *size = bytes_read;
-    
-    return buffer;
+bool parse_fast_forward(const char *spec) {
+    char *end;
+
+    if (strncmp(spec, "inst:", 5) == 0) {
+        ff_mode = FF_INST;
+        ff_target = strtoull(spec + 5, &end, 0);
+    } else if (strncmp(spec, "pc:", 3) == 0) {
+        ff_mode = FF_PC;
+        ff_target = strtoul(spec + 3, &end, 0) & ADDR_MASK;
+    } else if (strncmp(spec, "serial:", 7) == 0) {
+        ff_mode = FF_SERIAL;
+        ff_pattern = spec + 7;
+
+        return *ff_pattern != '\0' && strlen(ff_pattern) <= MAX_SERIAL_PATTERN;
+    } else
+        return false;
+
+    return end != spec && *end == '\0';
 }
 
+bool fast_forward_done() {
+    switch (ff_mode) {
+        case FF_INST: return machine->sched_cycles >= ff_target;
+        case FF_PC: return machine->cores[0].pc == ff_target;
+        case FF_SERIAL: return machine->serial_pattern_seen;
+        default: return true;
+    }
+}
+
+// Runs one core; the boot core also owns the scheduler, the timer, serial output and the GDB stub
 void* emulator_loop(void *arg) {
-    uint64_t last_ticks = SDL_GetPerformanceCounter();
-    uint64_t perf_freq = SDL_GetPerformanceFrequency();
+    CPU *core = arg;
+    bool boot = core->core_id == 0;
+
+    if (boot && show_startup_time) {
+        struct timespec now;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        fprintf(stderr, "Startup: %.3f ms to first instruction\n",
+            (now.tv_sec - launch_time.tv_sec) * 1e3 + (now.tv_nsec - launch_time.tv_nsec) / 1e6);
+    }
+
+    if (boot && gdb_attached && !gdb_stop(core, GDB_SIGTRAP))
+        running = false;
+
+    double base_time = 0;
+    uint64_t base_cycles = 0;
+    bool paced = false;
 
     while (running) {
-        uint64_t now_ticks = SDL_GetPerformanceCounter();
-        uint64_t elapsed_ticks = now_ticks - last_ticks;
+        uint64_t cycles_to_run = MAX_CYCLES;
+
+        // pace against an absolute target, so a late slice is made up by the next one instead of being lost
+        if (ff_mode == FF_NONE && emu_speed > 0) {
+            double rate = CYCLES_PER_SECOND * emu_speed;
+            double now = monotonic_seconds();
+            uint64_t target = base_cycles + (uint64_t)((now - base_time) * rate);
+            uint64_t slice = (uint64_t)(rate / 1000) + 1;
+            uint64_t max_lag = (uint64_t)(rate * MAX_LAG);
+
+            // after a host stall, a debugger stop or a fast-forward, drop the backlog instead of racing through it
+            if (!paced || target > core->executed + max_lag) {
+                base_time = now;
+                base_cycles = core->executed;
+                target = core->executed;
+                paced = true;
+            }
 
-        last_ticks = now_ticks;
+            if (target < core->executed + slice) {
+                double slack = (core->executed + slice - target) / rate;
 
-        double elapsed_seconds = (double)elapsed_ticks / perf_freq;
-        uint64_t cycles_to_run = (uint64_t)(elapsed_seconds * CYCLES_PER_SECOND);
-        const uint64_t MAX_CYCLES = 100000;
+                sleep_seconds(slack);
+                stat_add(&machine->stats->throttle_slack_ns, (uint64_t)(slack * 1e9));
+
+                continue;
+            }
 
-        if (cycles_to_run > MAX_CYCLES)
-            cycles_to_run = MAX_CYCLES;
+            cycles_to_run = target - core->executed;
+
+            if (cycles_to_run > MAX_CYCLES)
+                cycles_to_run = MAX_CYCLES;
+        } else
+            paced = false;
+
+        if (boot && gdb_attached && gdb_poll_interrupt() && !gdb_stop(core, GDB_SIGINT))
+            running = false;
 
         for (uint64_t i = 0; i < cycles_to_run && running; i++) {
-            Instruction inst = parse_instruction(&cpu);
-            int status = step_program(&cpu, inst);
+            // an application core that is waiting for a start or an IPI sleeps instead of spinning
+            if (!boot && (core->flags & FLAG_HALTED) && !atomic_load(&core->signals)) {
+                sleep_seconds(IDLE_SLEEP);
+
+                continue;
+            }
+
+            uint64_t compiled = 0;
+            int status = 0;
+
+            // compiled blocks tick after every instruction themselves and leave anything else to the interpreter
+            if (use_aot && ff_mode != FF_PC) {
+                uint64_t limit = cycles_to_run - i;
+
+                if (boot && ff_mode == FF_INST && ff_target > machine->sched_cycles && ff_target - machine->sched_cycles < limit)
+                    limit = ff_target - machine->sched_cycles;
+
+                status = aot_run(core, limit, &compiled);
+            }
+
+            if (compiled == 0 && status == 0) {
+                Instruction inst = parse_instruction(core);
+
+                if (boot && gdb_attached && !gdb_pre_step(core, &inst)) {
+                    running = false;
+
+                    break;
+                }
+
+                status = step_program(core, inst);
+            }
 
             if (status) {
+                if (boot && gdb_attached)
+                    gdb_stop(core, gdb_exception_signal(status));
+
                 running = false;
 
                 break;
             }
 
-            cpu.cycle_count++;
+            if (boot && gdb_attached && (gdb_stepping || machine->watch_triggered) && !gdb_stop(core, GDB_SIGTRAP)) {
+                running = false;
 
-            if (cpu.cycle_count >= cpu.cycles_per_sleep) {
-                cpu.cycle_count = 0;
+                break;
+            }
+
+            if (compiled)
+                i += compiled - 1;
+            else
+                tick_core(core);
+
+            if (boot && ff_mode != FF_NONE && fast_forward_done()) {
+                fprintf(stderr, "Fast-forward finished after %llu instructions at 0x%05x\n", (unsigned long long)machine->sched_cycles, core->pc);
+
+                ff_mode = FF_NONE;
 
-                poll_serial(&cpu);
-                cpu_interrupt(&cpu, 0x01);
+                break;
             }
         }
-
-        SDL_Delay(1);
     }
 
     return NULL;
 }
 
 int main(int argc, char* argv[]) {
+    char *gdb_addr = NULL;
+    char *disk_name = NULL;
+    bool share_stats = false;
+    unsigned long cores_requested = 1;
+
+    clock_gettime(CLOCK_MONOTONIC, &launch_time);
+
     if (argc <= 1) {
-        printf("Options:\n  -disk | Provides the emulator with a bootable disk\n  -h | Displays this list\n");
+        printf("Options:\n  -disk | Provides the emulator with a bootable disk\n  -gdb | Waits for a GDB connection on a loopback port or Unix socket path\n  -watch | Reports accesses to addr[:len][:r|w|rw]\n  -map | Loads a symbol map from hexa_asm or hexa_ld for diagnostics\n  -hle | Performs the BIOS serial (INT 0x03) and disk (INT 0x04) services natively\n  -startup-time | Reports the time from launch to the first instruction\n  -speed | Runs at N times the real clock speed (max for unthrottled)\n  -ff | Runs unthrottled until inst:N, pc:ADDR or serial:TEXT, then in real time\n  -cores | Runs N cores sharing memory (1-8)\n  -stats | Publishes counters in /dev/shm/hexa.<pid> for hexa_top\n  -aot | Runs code compiled in with hexa_aot natively\n  -h | Displays this list\n");
 
         return 0;
     }
 
+    // the machine has to exist before options such as -watch and -map can be applied to it
+    for (int i = 0; i + 1 < argc; i++) {
+        if (strcmp(argv[i], "-cores") == 0) {
+            char *end;
+
+            i++;
+            cores_requested = strtoul(argv[i], &end, 0);
+
+            if (end == argv[i] || *end != '\0' || cores_requested < 1 || cores_requested > MAX_CORES) {
+                fprintf(stderr, "Invalid core count %s\n", argv[i]);
+
+                return 1;
+            }
+        }
+    }
+
+    machine = hexa_create(cores_requested);
+
+    if (!machine) {
+        fprintf(stderr, "Memory allocation failed\n");
+
+        return 1;
+    }
+
     for (int i = 0; i < argc; i++) {
         if (strcmp(argv[i], "-disk") == 0 && i + 1 < argc)
             disk_name = argv[++i];
+        else if (strcmp(argv[i], "-gdb") == 0 && i + 1 < argc)
+            gdb_addr = argv[++i];
+        else if (strcmp(argv[i], "-map") == 0 && i + 1 < argc) {
+            if (!load_symbol_map(machine, argv[++i])) {
+                fprintf(stderr, "Could not load symbol map %s\n", argv[i]);
+
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "-watch") == 0 && i + 1 < argc) {
+            if (!parse_watch(argv[++i])) {
+                fprintf(stderr, "Invalid watchpoint %s\n", argv[i]);
+
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "-hle") == 0)
+            hexa_set_hle(machine, true);
+        else if (strcmp(argv[i], "-startup-time") == 0)
+            show_startup_time = true;
+        else if (strcmp(argv[i], "-speed") == 0 && i + 1 < argc) {
+            char *end;
+
+            i++;
+            emu_speed = (strcmp(argv[i], "max") == 0) ? 0 : strtod(argv[i], &end);
+
+            if (strcmp(argv[i], "max") != 0 && (end == argv[i] || *end != '\0' || emu_speed <= 0)) {
+                fprintf(stderr, "Invalid speed %s\n", argv[i]);
+
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "-ff") == 0 && i + 1 < argc) {
+            if (!parse_fast_forward(argv[++i]) || (ff_pattern && !set_serial_pattern(machine, ff_pattern))) {
+                fprintf(stderr, "Invalid fast-forward condition %s\n", argv[i]);
+
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "-cores") == 0 && i + 1 < argc)
+            i++;
+        else if (strcmp(argv[i], "-stats") == 0)
+            share_stats = true;
+        else if (strcmp(argv[i], "-aot") == 0)
+            use_aot = true;
         else if (strcmp(argv[i], "-h") == 0) {
-            printf("Options:\n  -disk | Provides the emulator with a bootable disk\n  -h | Displays this list\n");
+            printf("Options:\n  -disk | Provides the emulator with a bootable disk\n  -gdb | Waits for a GDB connection on a loopback port or Unix socket path\n  -watch | Reports accesses to addr[:len][:r|w|rw]\n  -map | Loads a symbol map from hexa_asm or hexa_ld for diagnostics\n  -hle | Performs the BIOS serial (INT 0x03) and disk (INT 0x04) services natively\n  -startup-time | Reports the time from launch to the first instruction\n  -speed | Runs at N times the real clock speed (max for unthrottled)\n  -ff | Runs unthrottled until inst:N, pc:ADDR or serial:TEXT, then in real time\n  -cores | Runs N cores sharing memory (1-8)\n  -stats | Publishes counters in /dev/shm/hexa.<pid> for hexa_top\n  -aot | Runs code compiled in with hexa_aot natively\n  -h | Displays this list\n");
 
             return 0;
         }
@@ -161,7 +449,7 @@ int main(int argc, char* argv[]) {
     }
 
     size_t bios_size = 0;
-    uint8_t *bios_data = read_file("bios.bin", &bios_size);
+    const uint8_t *bios_data = map_image("bios.bin", &bios_size);
 
     if (!bios_data) {
         fprintf(stderr, "Failed to read BIOS file\n");
@@ -169,49 +457,88 @@ int main(int argc, char* argv[]) {
         return 1;
     }
 
-    size_t disk_size = 0;
-    uint8_t *disk_data = read_file(disk_name, &disk_size);
-
-    if (!disk_data) {
-        fprintf(stderr, "Failed to read disk.img\n");
+    if (!open_disk(machine, disk_name)) {
+        fprintf(stderr, "Failed to read %s\n", disk_name);
 
         return 1;
     }
 
-    init_cpu(&cpu);
+    bool bios_loaded = hexa_load_bios(machine, bios_data, bios_size);
 
-    uint16_t bios_status = load_bios(&cpu, bios_data);
+    munmap((void *)bios_data, bios_size);
 
-    if (bios_status == 0) {
+    if (!bios_loaded) {
         printf("No executable BIOS found...\n");
 
         return 1;
     }
 
-    init_sdl();
-    update_display(&cpu.memory[FRAMEBUFFER_ADDR]);
+    if (use_aot && aot_image_count() == 0) {
+        fprintf(stderr, "No hexa_aot output is linked into this build\n");
+
+        return 1;
+    }
+
+    // the debugger steps and stops on single instructions, which compiled blocks do not report
+    if (gdb_addr != NULL) {
+        use_aot = false;
+
+        if (gdb_listen(gdb_addr) != 0)
+            return 1;
+    }
 
-    pthread_create(&emu_thread, NULL, emulator_loop, NULL);
+    if (share_stats && !open_stats()) {
+        fprintf(stderr, "Could not create the stats segment\n");
+
+        return 1;
+    }
+
+    for (uint16_t i = 0; i < machine->core_count; i++)
+        pthread_create(&emu_threads[i], NULL, emulator_loop, &machine->cores[i]);
 
     SDL_Event event;
 
+    // the window is only created once the guest draws something
     while (running) {
-        while (SDL_PollEvent(&event)) {
+        while (window && SDL_PollEvent(&event)) {
             if (event.type == SDL_QUIT)
                 running = false;
         }
 
-        if (framebuffer_dirty)
-            update_display(&cpu.memory[FRAMEBUFFER_ADDR]);
+        if (machine->framebuffer_dirty) {
+            if (!window)
+                init_sdl();
 
+            update_display(&machine->memory[FRAMEBUFFER_ADDR]);
+        }
+
+        publish_stats();
         SDL_Delay(16);
     }
 
-    pthread_join(emu_thread, NULL);
+    for (uint16_t i = 0; i < machine->core_count; i++)
+        pthread_join(emu_threads[i], NULL);
+
     cleanup_sdl();
 
-    printf("\nCPU:\n  Clock Speed: %d MHz\n  R0: 0x%04x  R1: 0x%04x  R2: 0x%04x  R3: 0x%04x\n  R4: 0x%04x  R5: 0x%04x  R6: 0x%04x  R7: 0x%04x\n  PC: 0x%05x IP: 0x%02x    SP: 0x%04x  CS: 0x%04x\n  DS: 0x%04x  SS: 0x%04x  US: 0x%04x  FLAGS: 0x%04x\n",
-        CYCLES_PER_SECOND / 1000000, cpu.registers[0], cpu.registers[1], cpu.registers[2], cpu.registers[3], cpu.registers[4], cpu.registers[5], cpu.registers[6], cpu.registers[7], cpu.pc, cpu.ip, cpu.sp, cpu.cs, cpu.ds, cpu.ss, cpu.us, cpu.flags);
+    for (uint16_t i = 0; i < machine->core_count; i++) {
+        CPU *core = &machine->cores[i];
+
+        sync_flags(core);
+
+        if (machine->core_count > 1)
+            printf("\nCPU %d:", i);
+        else
+            printf("\nCPU:");
+
+        printf("\n  Clock Speed: %d MHz\n  R0: 0x%04x  R1: 0x%04x  R2: 0x%04x  R3: 0x%04x\n  R4: 0x%04x  R5: 0x%04x  R6: 0x%04x  R7: 0x%04x\n  PC: 0x%05x IP: 0x%02x    SP: 0x%04x  CS: 0x%04x\n  DS: 0x%04x  SS: 0x%04x  US: 0x%04x  FLAGS: 0x%04x\n",
+            CYCLES_PER_SECOND / 1000000, core->registers[0], core->registers[1], core->registers[2], core->registers[3], core->registers[4], core->registers[5], core->registers[6], core->registers[7], core->pc, core->ip, core->sp, core->cs, core->ds, core->ss, core->us, core->flags);
+    }
+
+    if (stats_name[0])
+        shm_unlink(stats_name);
+
+    hexa_destroy(machine);
     
     return 0;
 }
\ No newline at end of file
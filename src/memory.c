@@ -0,0 +1,235 @@
+#include "memory.h"
+#include "instruction_set.h"
+#include "disk.h"
+#include "dma.h"
+#include "blit.h"
+#include "smp.h"
+#include "pic.h"
+#include "debug.h"
+
+uint8_t region_attr(CPU *cpu, uint32_t addr) {
+    if (addr < START_ADDR)
+        return PAGE_R | PAGE_W | PAGE_MMIO | ((cpu->flags & FLAG_RESET) ? PAGE_X : 0);
+    else if (addr >= BIOS_ADDR)
+        return PAGE_R | PAGE_X | PAGE_SUPER;
+    else if (addr >= FRAMEBUFFER_ADDR && addr < FRAMEBUFFER_ADDR + (FRAMEBUFFER_WIDTH * FRAMEBUFFER_HEIGHT))
+        return PAGE_R | PAGE_W | PAGE_X | PAGE_VIDEO;
+    else if (addr >= DEVICE_ADDR && addr < DEVICE_END)
+        return PAGE_R | PAGE_W | PAGE_MMIO;
+
+    return PAGE_R | PAGE_W | PAGE_X;
+}
+
+void update_pages(CPU *cpu) {
+    for (uint32_t page = 0; page < PAGE_COUNT; page++) {
+        uint32_t start = page << PAGE_SHIFT;
+        uint32_t end = start + PAGE_SIZE - 1;
+        uint8_t attr = region_attr(cpu, start);
+
+        if (region_attr(cpu, end) != attr || (start < START_ADDR && end >= START_ADDR) || (start < BIOS_ADDR && end >= BIOS_ADDR))
+            attr |= PAGE_SPLIT;
+
+        cpu->page_attr[page] = attr;
+    }
+}
+
+void mmio_write(CPU *cpu, uint32_t addr, uint16_t value) {
+    // device state and the scheduler are shared by every core
+    device_lock(cpu->machine);
+
+    if (addr == SERIAL_DATA)
+        cpu->memory[SERIAL_STATUS] |= SERIAL_STATUS_NEW_DATA;
+
+    if (addr == DISK_COMMAND && (value == DISK_CMD_WRITE || value == DISK_CMD_READ))
+        disk_command(cpu, value);
+
+    if (addr == DMA_CTRL && (value & DMA_CTRL_START))
+        dma_start(cpu);
+
+    if (addr == BLT_CTRL && (value & BLT_CTRL_START))
+        blit_start(cpu);
+
+    if (addr >= PIC_PENDING && addr <= PIC_PRIORITY)
+        pic_write(cpu, addr, value);
+
+    if (addr >= SMP_CORE_COUNT && addr <= SMP_IPI)
+        smp_write(cpu, addr, value);
+
+    if (cpu->machine->callbacks.mmio_write)
+        cpu->machine->callbacks.mmio_write(cpu->machine->callbacks.user, cpu->core_id, addr, value);
+
+    device_unlock(cpu->machine);
+}
+
+uint16_t mem_read(CPU *cpu, uint32_t addr) {
+    uint16_t value = (cpu->memory[addr] << 8) | cpu->memory[addr + 1];
+
+    if (page_watched(cpu, addr, WATCH_READ))
+        watch_access(cpu, addr, 2, WATCH_READ, value, value);
+
+    return value;
+}
+
+void mem_write(CPU *cpu, uint32_t addr, uint16_t value) {
+    uint8_t attr = page_attr(cpu, addr);
+
+    if (page_watched(cpu, addr, WATCH_WRITE))
+        watch_access(cpu, addr, 2, WATCH_WRITE, (cpu->memory[addr] << 8) | cpu->memory[addr + 1], value);
+
+    cpu->memory[addr] = (value >> 8) & 0xff;
+    cpu->memory[addr + 1] = value & 0xff;
+
+    if (attr & PAGE_MMIO)
+        mmio_write(cpu, addr, value);
+
+    if (attr & PAGE_VIDEO)
+        mark_framebuffer_dirty(cpu, addr, 2);
+}
+
+int mem_check_range(CPU *cpu, uint32_t addr, uint32_t len, uint8_t need, uint8_t *attrs) {
+    uint32_t end = addr + len;
+
+    *attrs = 0;
+
+    if (addr % 2 != 0)
+        return 3;
+
+    if (end > MEM_SIZE)
+        return 4;
+
+    while (addr < end) {
+        uint32_t page_end = ((addr >> PAGE_SHIFT) + 1) << PAGE_SHIFT;
+
+        if (page_end > end)
+            page_end = end;
+
+        if (cpu->page_attr[addr >> PAGE_SHIFT] & PAGE_SPLIT) {
+            for (uint32_t curr = addr; curr < page_end; curr += 2) {
+                if (!page_allowed(cpu, curr, need, 0))
+                    return 4;
+
+                *attrs |= page_attr(cpu, curr);
+            }
+        } else {
+            if (!page_allowed(cpu, addr, need, 0))
+                return 4;
+
+            *attrs |= page_attr(cpu, addr);
+        }
+
+        addr = page_end;
+    }
+
+    return 0;
+}
+
+void mem_copy(CPU *cpu, uint32_t dst, uint32_t src, uint32_t len, uint8_t attrs) {
+    if ((attrs & PAGE_MMIO) || watch_range(cpu, src, len, WATCH_READ) || watch_range(cpu, dst, len, WATCH_WRITE)) {
+        if (dst > src && dst < src + len) {
+            for (uint32_t off = len; off > 0; off -= 2)
+                mem_write(cpu, dst + off - 2, mem_read(cpu, src + off - 2));
+        } else {
+            for (uint32_t off = 0; off < len; off += 2)
+                mem_write(cpu, dst + off, mem_read(cpu, src + off));
+        }
+
+        return;
+    }
+
+    memmove(&cpu->memory[dst], &cpu->memory[src], len);
+
+    if (attrs & PAGE_VIDEO)
+        mark_framebuffer_dirty(cpu, dst, len);
+}
+
+void mem_fill(CPU *cpu, uint32_t dst, uint16_t value, uint32_t len, uint8_t attrs) {
+    if ((attrs & PAGE_MMIO) || watch_range(cpu, dst, len, WATCH_WRITE)) {
+        for (uint32_t off = 0; off < len; off += 2)
+            mem_write(cpu, dst + off, value);
+
+        return;
+    }
+
+    if (len == 0)
+        return;
+
+    uint8_t *out = &cpu->memory[dst];
+
+    if ((value >> 8) == (value & 0xff)) {
+        memset(out, value & 0xff, len);
+    } else {
+        uint32_t filled = 2;
+
+        out[0] = (value >> 8) & 0xff;
+        out[1] = value & 0xff;
+
+        while (filled < len) {
+            uint32_t chunk = (filled < len - filled) ? filled : len - filled;
+
+            memcpy(out + filled, out, chunk);
+            filled += chunk;
+        }
+    }
+
+    if (attrs & PAGE_VIDEO)
+        mark_framebuffer_dirty(cpu, dst, len);
+}
+
+int mem_compare(CPU *cpu, uint32_t addr1, uint32_t addr2, uint32_t len, uint8_t attrs) {
+    if (watch_range(cpu, addr1, len, WATCH_READ) || watch_range(cpu, addr2, len, WATCH_READ)) {
+        for (uint32_t off = 0; off < len; off += 2) {
+            uint16_t val1 = mem_read(cpu, addr1 + off);
+            uint16_t val2 = mem_read(cpu, addr2 + off);
+
+            if (val1 != val2)
+                return (val1 < val2) ? -1 : 1;
+        }
+
+        return 0;
+    }
+
+    return memcmp(&cpu->memory[addr1], &cpu->memory[addr2], len);
+}
+
+// Guest words are big-endian, so they are swapped before reaching the host's atomic operations
+static inline uint16_t host_word(uint16_t value) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    return __builtin_bswap16(value);
+#else
+    return value;
+#endif
+}
+
+// Both atomics are sequentially consistent, so they also order the plain accesses on either side of them
+uint16_t mem_exchange(CPU *cpu, uint32_t addr, uint16_t value) {
+    uint16_t old = host_word(__atomic_exchange_n((uint16_t *)&cpu->memory[addr], host_word(value), __ATOMIC_SEQ_CST));
+
+    if (page_watched(cpu, addr, WATCH_READ))
+        watch_access(cpu, addr, 2, WATCH_READ, old, old);
+
+    if (page_watched(cpu, addr, WATCH_WRITE))
+        watch_access(cpu, addr, 2, WATCH_WRITE, old, value);
+
+    if (page_attr(cpu, addr) & PAGE_VIDEO)
+        mark_framebuffer_dirty(cpu, addr, 2);
+
+    return old;
+}
+
+bool mem_compare_exchange(CPU *cpu, uint32_t addr, uint16_t *expected, uint16_t value) {
+    uint16_t current = host_word(*expected);
+    bool swapped = __atomic_compare_exchange_n((uint16_t *)&cpu->memory[addr], &current, host_word(value), false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+
+    *expected = host_word(current);
+
+    if (page_watched(cpu, addr, WATCH_READ))
+        watch_access(cpu, addr, 2, WATCH_READ, *expected, *expected);
+
+    if (swapped && page_watched(cpu, addr, WATCH_WRITE))
+        watch_access(cpu, addr, 2, WATCH_WRITE, *expected, value);
+
+    if (swapped && (page_attr(cpu, addr) & PAGE_VIDEO))
+        mark_framebuffer_dirty(cpu, addr, 2);
+
+    return swapped;
+}
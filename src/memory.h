@@ -0,0 +1,68 @@
+#ifndef MEMORY_H
+#define MEMORY_H
+
+#include "common.h"
+
+#define ACCESS_DATA (PAGE_R | PAGE_W)
+
+void update_pages(CPU *cpu);
+uint8_t region_attr(CPU *cpu, uint32_t addr);
+uint16_t mem_read(CPU *cpu, uint32_t addr);
+void mem_write(CPU *cpu, uint32_t addr, uint16_t value);
+int mem_check_range(CPU *cpu, uint32_t addr, uint32_t len, uint8_t need, uint8_t *attrs);
+void mem_copy(CPU *cpu, uint32_t dst, uint32_t src, uint32_t len, uint8_t attrs);
+void mem_fill(CPU *cpu, uint32_t dst, uint16_t value, uint32_t len, uint8_t attrs);
+int mem_compare(CPU *cpu, uint32_t addr1, uint32_t addr2, uint32_t len, uint8_t attrs);
+uint16_t mem_exchange(CPU *cpu, uint32_t addr, uint16_t value);
+bool mem_compare_exchange(CPU *cpu, uint32_t addr, uint16_t *expected, uint16_t value);
+
+// For every write that replaces flags as a whole: it drops a pending CMP, and entering or leaving
+// the reset state changes whether low memory is executable
+static inline void write_flags(CPU *cpu, uint16_t value) {
+    uint16_t changed = cpu->flags ^ value;
+
+    cpu->flags = value;
+    cpu->flags_lazy = false;
+
+    if (changed & FLAG_RESET)
+        update_pages(cpu);
+}
+
+static inline uint8_t page_attr(CPU *cpu, uint32_t addr) {
+    uint8_t attr = cpu->page_attr[addr >> PAGE_SHIFT];
+
+    if (attr & PAGE_SPLIT)
+        return region_attr(cpu, addr);
+
+    return attr;
+}
+
+// The _as variants take the privilege level from callers that already know it
+static inline bool page_allowed_as(CPU *cpu, uint32_t addr, uint8_t need, uint8_t deny, bool user) {
+    uint8_t attr = page_attr(cpu, addr);
+
+    if (user)
+        deny |= PAGE_SUPER;
+
+    return (attr & need) == need && !(attr & deny);
+}
+
+static inline bool page_allowed(CPU *cpu, uint32_t addr, uint8_t need, uint8_t deny) {
+    return page_allowed_as(cpu, addr, need, deny, cpu->flags & FLAG_USER_MODE);
+}
+
+static inline int mem_check_as(CPU *cpu, uint32_t addr, uint8_t need, uint8_t deny, bool user) {
+    if (!page_allowed_as(cpu, addr, need, deny, user))
+        return 4;
+
+    if (addr % 2 != 0)
+        return 3;
+
+    return 0;
+}
+
+static inline int mem_check(CPU *cpu, uint32_t addr, uint8_t need, uint8_t deny) {
+    return mem_check_as(cpu, addr, need, deny, cpu->flags & FLAG_USER_MODE);
+}
+
+#endif
@@ -0,0 +1,201 @@
+#include <stdlib.h>
+#include "object.h"
+
+void write_image_header(uint8_t *header, uint32_t origin, uint32_t size, uint8_t flags) {
+    header[0] = 0x88;
+    header[1] = 0xcc;
+    header[2] = (origin >> 16) & 0x0f;
+    header[3] = (origin >> 8) & 0xff;
+    header[4] = origin & 0xff;
+    header[5] = flags;
+    header[6] = (size >> 16) & 0x0f;
+    header[7] = (size >> 8) & 0xff;
+    header[8] = size & 0xff;
+    header[9] = 0;
+}
+
+void obj_put_u32(FILE *file, uint32_t val) {
+    fputc((val >> 24) & 0xff, file);
+    fputc((val >> 16) & 0xff, file);
+    fputc((val >> 8) & 0xff, file);
+    fputc(val & 0xff, file);
+}
+
+bool obj_get_u32(FILE *file, uint32_t *val) {
+    uint8_t bytes[4];
+
+    if (fread(bytes, 1, 4, file) != 4)
+        return false;
+
+    *val = ((uint32_t)bytes[0] << 24) | ((uint32_t)bytes[1] << 16) | ((uint32_t)bytes[2] << 8) | bytes[3];
+
+    return true;
+}
+
+int write_object(const char *path, Object *obj) {
+    FILE *file = fopen(path, "wb");
+
+    if (!file) {
+        printf("Unable to create file %s\n", path);
+
+        return 1;
+    }
+
+    fputc(OBJ_MAGIC0, file);
+    fputc(OBJ_MAGIC1, file);
+    fputc(OBJ_VERSION, file);
+    fputc(obj->flags, file);
+    obj_put_u32(file, obj->org);
+    obj_put_u32(file, obj->size);
+    obj_put_u32(file, obj->sym_count);
+    obj_put_u32(file, obj->reloc_count);
+
+    fwrite(obj->code, 1, obj->size, file);
+
+    for (uint32_t i = 0; i < obj->sym_count; i++) {
+        size_t len = strlen(obj->symbols[i].name);
+
+        obj_put_u32(file, (uint32_t)len);
+        fwrite(obj->symbols[i].name, 1, len, file);
+        obj_put_u32(file, obj->symbols[i].value);
+        fputc(obj->symbols[i].flags, file);
+    }
+
+    for (uint32_t i = 0; i < obj->reloc_count; i++) {
+        obj_put_u32(file, obj->relocs[i].offset);
+        obj_put_u32(file, obj->relocs[i].sym);
+    }
+
+    if (fclose(file) != 0) {
+        printf("Failed to write %s\n", path);
+
+        return 1;
+    }
+
+    return 0;
+}
+
+int read_object(const char *path, Object *obj) {
+    FILE *file = fopen(path, "rb");
+    uint8_t header[4];
+
+    memset(obj, 0, sizeof(Object));
+
+    if (!file) {
+        printf("Unable to open file %s\n", path);
+
+        return 1;
+    }
+
+    if (fread(header, 1, 4, file) != 4 || header[0] != OBJ_MAGIC0 || header[1] != OBJ_MAGIC1 || header[2] != OBJ_VERSION) {
+        printf("Invalid object file %s\n", path);
+        fclose(file);
+
+        return 1;
+    }
+
+    obj->flags = header[3];
+
+    if (!obj_get_u32(file, &obj->org) || !obj_get_u32(file, &obj->size) || !obj_get_u32(file, &obj->sym_count) || !obj_get_u32(file, &obj->reloc_count) || obj->size > MEM_SIZE)
+        goto invalid;
+
+    obj->code = malloc(obj->size ? obj->size : 1);
+    obj->symbols = calloc(obj->sym_count ? obj->sym_count : 1, sizeof(ObjSymbol));
+    obj->relocs = calloc(obj->reloc_count ? obj->reloc_count : 1, sizeof(ObjReloc));
+
+    if (!obj->code || !obj->symbols || !obj->relocs || fread(obj->code, 1, obj->size, file) != obj->size)
+        goto invalid;
+
+    for (uint32_t i = 0; i < obj->sym_count; i++) {
+        uint32_t len;
+        int flags;
+
+        if (!obj_get_u32(file, &len) || len > 0xffff)
+            goto invalid;
+
+        obj->symbols[i].name = calloc(len + 1, 1);
+
+        if (!obj->symbols[i].name || fread(obj->symbols[i].name, 1, len, file) != len || !obj_get_u32(file, &obj->symbols[i].value) || (flags = fgetc(file)) == EOF)
+            goto invalid;
+
+        obj->symbols[i].flags = (uint8_t)flags;
+    }
+
+    for (uint32_t i = 0; i < obj->reloc_count; i++) {
+        if (!obj_get_u32(file, &obj->relocs[i].offset) || !obj_get_u32(file, &obj->relocs[i].sym))
+            goto invalid;
+
+        if (obj->relocs[i].offset + 2 > obj->size || obj->relocs[i].sym >= obj->sym_count)
+            goto invalid;
+    }
+
+    fclose(file);
+
+    return 0;
+
+invalid:
+    printf("Invalid object file %s\n", path);
+    fclose(file);
+    free_object(obj);
+
+    return 1;
+}
+
+void free_object(Object *obj) {
+    if (obj->symbols)
+        for (uint32_t i = 0; i < obj->sym_count; i++)
+            free(obj->symbols[i].name);
+
+    free(obj->code);
+    free(obj->symbols);
+    free(obj->relocs);
+
+    memset(obj, 0, sizeof(Object));
+}
+
+int compare_map_symbols(const void *a, const void *b) {
+    const MapSymbol *sym_a = a;
+    const MapSymbol *sym_b = b;
+
+    if (sym_a->addr != sym_b->addr)
+        return (sym_a->addr < sym_b->addr) ? -1 : 1;
+
+    return strcmp(sym_a->name, sym_b->name);
+}
+
+int write_symbol_map(const char *path, MapSymbol *syms, size_t count, uint32_t end) {
+    FILE *file = fopen(path, "w");
+
+    if (!file) {
+        printf("Unable to create file %s\n", path);
+
+        return 1;
+    }
+
+    qsort(syms, count, sizeof(MapSymbol), compare_map_symbols);
+
+    fprintf(file, "; addr seg:off size name\n");
+
+    for (size_t i = 0; i < count; i++) {
+        uint32_t next = end;
+
+        for (size_t j = i + 1; j < count; j++) {
+            if (syms[j].addr != syms[i].addr) {
+                next = syms[j].addr;
+
+                break;
+            }
+        }
+
+        fprintf(file, "%05x %04x:%04x %u %s\n", syms[i].addr, (syms[i].addr >> 4) & 0xf000, syms[i].addr & 0xffff,
+            (next > syms[i].addr) ? next - syms[i].addr : 0, syms[i].name);
+    }
+
+    if (fclose(file) != 0) {
+        printf("Failed to write %s\n", path);
+
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,51 @@
+#ifndef OBJECT_H
+#define OBJECT_H
+
+#include "common.h"
+
+#define IMAGE_HEADER_SIZE 10
+
+#define OBJ_MAGIC0 0x88
+#define OBJ_MAGIC1 0xce
+#define OBJ_VERSION 0x01
+
+#define OBJ_FLAG_ORG (1 << 0)
+#define OBJ_FLAG_COMPACT (1 << 1)
+
+#define SYM_DEFINED (1 << 0)
+#define SYM_LOCAL (1 << 1)
+
+typedef struct {
+    char *name;
+    uint32_t value;
+    uint8_t flags;
+} ObjSymbol;
+
+typedef struct {
+    uint32_t offset;
+    uint32_t sym;
+} ObjReloc;
+
+typedef struct {
+    const char *name;
+    uint32_t addr;
+} MapSymbol;
+
+typedef struct {
+    uint8_t flags;
+    uint32_t org;
+    uint8_t *code;
+    uint32_t size;
+    ObjSymbol *symbols;
+    uint32_t sym_count;
+    ObjReloc *relocs;
+    uint32_t reloc_count;
+} Object;
+
+void write_image_header(uint8_t *header, uint32_t origin, uint32_t size, uint8_t flags);
+int write_object(const char *path, Object *obj);
+int read_object(const char *path, Object *obj);
+void free_object(Object *obj);
+int write_symbol_map(const char *path, MapSymbol *syms, size_t count, uint32_t end);
+
+#endif
@@ -0,0 +1,134 @@
+#include "pic.h"
+#include "cpu.h"
+#include "smp.h"
+
+void pic_set_reg(CPU *cpu, uint32_t addr, uint16_t value) {
+    cpu->memory[addr] = (value >> 8) & 0xff;
+    cpu->memory[addr + 1] = value & 0xff;
+}
+
+// Lines are ranked starting at the priority register and wrapping around, so rotating
+// the line bits right by it puts the highest-priority line in bit 0
+uint16_t pic_rotate(uint16_t lines, uint16_t priority) {
+    return (uint16_t)((lines >> priority) | (lines << (PIC_LINES - priority)));
+}
+
+uint16_t pic_unrotate(uint16_t lines, uint16_t priority) {
+    return (uint16_t)((lines << priority) | (lines >> (PIC_LINES - priority)));
+}
+
+uint16_t pic_highest(PicState *pic, uint16_t lines) {
+    return (__builtin_ctz(pic_rotate(lines, pic->priority)) + pic->priority) & (PIC_LINES - 1);
+}
+
+// The line in service holds back itself and every line ranked below it until its EOI
+uint16_t pic_blocked(PicState *pic) {
+    if (!pic->in_service)
+        return 0;
+
+    uint16_t rank = (pic_highest(pic, pic->in_service) - pic->priority) & (PIC_LINES - 1);
+
+    return pic_unrotate((uint16_t)(0xffff << rank), pic->priority);
+}
+
+// Mirrors the controller into its registers and recomputes the word the CPU polls
+void pic_update(CPU *cpu) {
+    Machine *machine = cpu->machine;
+    PicState *pic = &machine->pic;
+
+    pic_set_reg(cpu, PIC_PENDING, pic->pending);
+    pic_set_reg(cpu, PIC_MASK, pic->mask);
+    pic_set_reg(cpu, PIC_IN_SERVICE, pic->in_service);
+    pic_set_reg(cpu, PIC_EOI, 0);
+    pic_set_reg(cpu, PIC_CTRL, pic->ctrl);
+    pic_set_reg(cpu, PIC_PRIORITY, pic->priority);
+
+    atomic_store_explicit(&machine->pic_ready, pic->pending & ~pic->mask & ~pic_blocked(pic), memory_order_relaxed);
+}
+
+// Software that predates the controller never sends an EOI and expects every source to get
+// its turn, so it starts out with automatic EOI and rotating priority
+void pic_reset(CPU *cpu) {
+    PicState *pic = &cpu->machine->pic;
+
+    pic->pending = 0;
+    pic->mask = 0;
+    pic->in_service = 0;
+    pic->ctrl = PIC_CTRL_AUTO_EOI | PIC_CTRL_ROTATE;
+    pic->priority = 0;
+
+    pic_update(cpu);
+}
+
+void pic_raise(CPU *cpu, uint16_t line) {
+    Machine *machine = cpu->machine;
+    PicState *pic = &machine->pic;
+
+    // the timer raises its line on every tick, so a line that is already latched skips the lock
+    if (__atomic_load_n(&pic->pending, __ATOMIC_RELAXED) & (1 << line))
+        return;
+
+    device_lock(machine);
+
+    pic->pending |= 1 << line;
+    pic_update(cpu);
+
+    device_unlock(machine);
+}
+
+// Called from mmio_write with the device lock held
+void pic_write(CPU *cpu, uint32_t addr, uint16_t value) {
+    PicState *pic = &cpu->machine->pic;
+
+    switch (addr) {
+        case PIC_PENDING:
+            pic->pending &= ~value;
+            break;
+        case PIC_MASK:
+            pic->mask = value;
+            break;
+        case PIC_EOI:
+            if (value < PIC_LINES && (pic->in_service & (1 << value))) {
+                pic->in_service &= ~(1 << value);
+
+                if (pic->ctrl & PIC_CTRL_ROTATE)
+                    pic->priority = (value + 1) & (PIC_LINES - 1);
+            }
+            break;
+        case PIC_CTRL:
+            pic->ctrl = value & (PIC_CTRL_AUTO_EOI | PIC_CTRL_ROTATE);
+            break;
+        case PIC_PRIORITY:
+            pic->priority = value & (PIC_LINES - 1);
+            break;
+    }
+
+    pic_update(cpu);
+}
+
+void pic_deliver(CPU *cpu) {
+    Machine *machine = cpu->machine;
+    PicState *pic = &machine->pic;
+
+    device_lock(machine);
+
+    uint16_t ready = pic->pending & ~pic->mask & ~pic_blocked(pic);
+
+    if (ready) {
+        uint16_t line = pic_highest(pic, ready);
+
+        if (cpu_interrupt(cpu, line)) {
+            pic->pending &= ~(1 << line);
+
+            // a serviced line drops to the lowest priority once it ends, which is right away with automatic EOI
+            if (!(pic->ctrl & PIC_CTRL_AUTO_EOI))
+                pic->in_service |= 1 << line;
+            else if (pic->ctrl & PIC_CTRL_ROTATE)
+                pic->priority = (line + 1) & (PIC_LINES - 1);
+
+            pic_update(cpu);
+        }
+    }
+
+    device_unlock(machine);
+}
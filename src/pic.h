@@ -0,0 +1,16 @@
+#ifndef PIC_H
+#define PIC_H
+
+#include "common.h"
+
+void pic_reset(CPU *cpu);
+void pic_raise(CPU *cpu, uint16_t line);
+void pic_write(CPU *cpu, uint32_t addr, uint16_t value);
+void pic_deliver(CPU *cpu);
+
+// The only interrupt check between instructions: non-zero while a line is pending, unmasked and not held back
+static inline bool pic_ready(Machine *machine) {
+    return atomic_load_explicit(&machine->pic_ready, memory_order_relaxed) != 0;
+}
+
+#endif
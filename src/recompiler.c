@@ -0,0 +1,839 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "common.h"
+#include "instruction_set.h"
+#include "object.h"
+
+#define MAX_BLOCK_INSTS 32
+#define MAX_ENTRIES 4096
+
+typedef struct {
+    uint32_t addr;
+    uint32_t end;
+    size_t count;
+} Block;
+
+const char *opcode_names[256] = {
+    [MOV] = "mov", [LD] = "ld", [ST] = "st", [PUSH] = "push", [POP] = "pop",
+    [ADD] = "add", [SUB] = "sub", [INC] = "inc", [DEC] = "dec", [AND] = "and",
+    [OR] = "or", [XOR] = "xor", [NOT] = "not", [SHL] = "shl", [SHR] = "shr",
+    [CMP] = "cmp", [JMP] = "jmp", [JZ] = "jz", [JNZ] = "jnz", [JE] = "je",
+    [JNE] = "jne", [JL] = "jl", [JLE] = "jle", [JG] = "jg", [JGE] = "jge",
+    [CALL] = "call", [RET] = "ret", [IRET] = "iret", [INT] = "int", [CLI] = "cli",
+    [STI] = "sti", [NOP] = "nop", [HLT] = "hlt", [BCOPY] = "bcopy", [BFILL] = "bfill",
+    [BCMP] = "bcmp", [MUL] = "mul", [MULH] = "mulh", [IMULH] = "imulh", [DIV] = "div",
+    [IDIV] = "idiv", [MOD] = "mod", [IMOD] = "imod", [CMOVZ] = "cmovz", [CMOVNZ] = "cmovnz",
+    [CMOVE] = "cmove", [CMOVNE] = "cmovne", [CMOVL] = "cmovl", [CMOVLE] = "cmovle", [CMOVG] = "cmovg",
+    [CMOVGE] = "cmovge", [SETZ] = "setz", [SETNZ] = "setnz", [SETE] = "sete", [SETNE] = "setne",
+    [SETL] = "setl", [SETLE] = "setle", [SETG] = "setg", [SETGE] = "setge", [LOOP] = "loop",
+    [XCHG] = "xchg", [CAS] = "cas"
+};
+
+const char *register_names[] = {
+    "R0", "R1", "R2", "R3", "R4", "R5", "R6", "R7", "CS", "SS", "DS", "US", "PC", "IP", "SP", "FLAGS", "ES", "ID"
+};
+
+// Indexed like condition_met in instruction_set.c
+const char *conditions[] = {
+    "cpu->flags & FLAG_ZERO",
+    "!(cpu->flags & FLAG_ZERO)",
+    "cpu->flags & FLAG_EQUAL",
+    "!(cpu->flags & FLAG_EQUAL)",
+    "cpu->flags & FLAG_LESS",
+    "cpu->flags & (FLAG_EQUAL | FLAG_LESS)",
+    "cpu->flags & FLAG_GREATER",
+    "cpu->flags & (FLAG_EQUAL | FLAG_GREATER)"
+};
+
+const char *segment_expr = "(cpu->flags & FLAG_USER_MODE) ? cpu->us : cpu->cs";
+
+uint8_t *code;
+uint32_t code_addr;
+uint32_t code_size;
+uint16_t code_segment;
+
+uint8_t leader_map[MEM_SIZE / 8];
+uint32_t *pending;
+size_t pending_count = 0;
+Block *blocks;
+size_t block_count = 0;
+size_t inst_count = 0;
+size_t interpreted_count = 0;
+
+bool is_reg(uint16_t val) {
+    return val <= R7;
+}
+
+bool in_image(uint32_t addr, uint32_t len) {
+    return addr >= code_addr && addr - code_addr + len <= code_size;
+}
+
+// Mirrors parse_instruction, reading from the image instead of guest memory
+bool decode(uint32_t addr, Instruction *inst) {
+    if (!in_image(addr, 2))
+        return false;
+
+    const uint8_t *bytes = &code[addr - code_addr];
+
+    inst->opcode = bytes[0];
+
+    if (bytes[1] & INST_COMPACT) {
+        if (!in_image(addr, COMPACT_INST_SIZE))
+            return false;
+
+        inst->mode1 = (bytes[1] >> 1) & 0x01;
+        inst->operand1 = bytes[2];
+        inst->mode2 = bytes[1] & 0x01;
+        inst->operand2 = bytes[3];
+        inst->padding = 0;
+        inst->size = COMPACT_INST_SIZE;
+
+        return true;
+    }
+
+    if (!in_image(addr, INST_SIZE))
+        return false;
+
+    inst->mode1 = bytes[1];
+    inst->operand1 = (bytes[2] << 8) | bytes[3];
+    inst->mode2 = bytes[4];
+    inst->operand2 = (bytes[5] << 8) | bytes[6];
+    inst->padding = bytes[7];
+    inst->size = INST_SIZE;
+
+    return true;
+}
+
+void add_leader(uint32_t addr) {
+    addr &= ADDR_MASK;
+
+    if (!in_image(addr, 2) || (leader_map[addr >> 3] & (1 << (addr & 7))))
+        return;
+
+    leader_map[addr >> 3] |= 1 << (addr & 7);
+    pending[pending_count++] = addr;
+}
+
+uint32_t code_offset(uint16_t offset) {
+    return (((uint32_t)code_segment << SEG_SHIFT) + offset) & ADDR_MASK;
+}
+
+bool is_branch(uint8_t opcode) {
+    return opcode == JMP || (opcode >= JZ && opcode <= JGE && opcode != 0x12);
+}
+
+// Branch operands are offsets into the code segment, which is only known at run time; discovery
+// assumes the segment the image was assembled for, and the compiled code always uses the real one
+void add_successors(uint32_t addr, const Instruction *inst) {
+    uint32_t next = addr + inst->size;
+
+    if (is_branch(inst->opcode))
+        add_leader(code_offset(inst->operand1));
+    else if (inst->opcode == CALL)
+        add_leader(code_offset(inst->operand1 - (uint16_t)(code_segment << SEG_SHIFT)));
+    else if (inst->opcode == LOOP)
+        add_leader(code_offset(inst->operand2));
+
+    if ((is_branch(inst->opcode) && inst->opcode != JMP) || inst->opcode == CALL || inst->opcode == LOOP || inst->opcode == INT || inst->opcode == HLT)
+        add_leader(next);
+}
+
+bool ends_block(const Instruction *inst) {
+    switch (inst->opcode) {
+        case JMP: case JZ: case JNZ: case JE: case JNE: case JL: case JLE: case JG: case JGE:
+        case CALL: case RET: case IRET: case INT: case LOOP: case HLT:
+            return true;
+
+        // anything that can move the pc or change the mode returns to the dispatcher
+        case MOV:
+            return !(inst->mode1 == MODE_VAL_IND && is_reg(inst->operand1)) && (inst->operand1 == PC || inst->operand1 == FLAGS);
+
+        case POP:
+            return inst->operand1 == FLAGS;
+
+        default:
+            return opcode_names[inst->opcode] == NULL;
+    }
+}
+
+void format_operand(char *buf, size_t size, uint8_t mode, uint16_t operand) {
+    uint8_t base = mode >> MODE_BASE_SHIFT;
+    const char *base_name = base < 18 ? register_names[base] : "?";
+    const char *name = operand < 18 ? register_names[operand] : "?";
+
+    switch (mode & MODE_MASK) {
+        case MODE_VAL_IMM: snprintf(buf, size, "#0x%04x", operand); break;
+        case MODE_VAL_IND: (operand < 18) ? snprintf(buf, size, "%s", name) : snprintf(buf, size, "[0x%04x]", operand); break;
+        case MODE_BASE_DISP: snprintf(buf, size, "[%s + 0x%04x]", base_name, operand); break;
+        case MODE_BASE_INDEX: snprintf(buf, size, "[%s + %s]", base_name, name); break;
+        case MODE_POST_INC: snprintf(buf, size, "[%s]+", name); break;
+        case MODE_PRE_DEC: snprintf(buf, size, "-[%s]", name); break;
+        default: snprintf(buf, size, "?"); break;
+    }
+}
+
+int operand_count(uint8_t opcode) {
+    switch (opcode) {
+        case RET: case IRET: case CLI: case STI: case NOP: case HLT:
+            return 0;
+
+        case PUSH: case POP: case INC: case DEC: case NOT: case JMP: case JZ: case JNZ: case JE:
+        case JNE: case JL: case JLE: case JG: case JGE: case CALL: case INT:
+            return 1;
+
+        default:
+            return 2;
+    }
+}
+
+void emit_comment(FILE *out, uint32_t addr, const Instruction *inst) {
+    const char *name = opcode_names[inst->opcode] ? opcode_names[inst->opcode] : "?";
+    char op1[32], op2[32];
+
+    // branch operands are segment offsets, whatever their mode byte says
+    if (is_branch(inst->opcode) || inst->opcode == CALL || inst->opcode == INT)
+        snprintf(op1, sizeof(op1), "0x%04x", inst->operand1);
+    else
+        format_operand(op1, sizeof(op1), inst->mode1, inst->operand1);
+
+    if (inst->opcode == LOOP)
+        snprintf(op2, sizeof(op2), "0x%04x", inst->operand2);
+    else
+        format_operand(op2, sizeof(op2), inst->mode2, inst->operand2);
+
+    switch (operand_count(inst->opcode)) {
+        case 0: fprintf(out, "    // 0x%05x  %s\n", addr, name); break;
+        case 1: fprintf(out, "    // 0x%05x  %s %s\n", addr, name, op1); break;
+        default: fprintf(out, "    // 0x%05x  %s %s, %s\n", addr, name, op1, op2); break;
+    }
+}
+
+void emit_retire(FILE *out, uint32_t next, bool last) {
+    if (last)
+        fprintf(out, "    aot_retire(cpu, run, 0x%05x);\n", next);
+    else
+        fprintf(out, "\n    if (!aot_retire(cpu, run, 0x%05x))\n        return;\n\n", next);
+}
+
+// Control transfers always end their block, wherever they went
+void emit_branch_retire(FILE *out) {
+    fprintf(out, "    aot_retire(cpu, run, cpu->pc);\n");
+}
+
+void emit_interpret(FILE *out, const Instruction *inst, uint32_t next, bool last) {
+    fprintf(out, "    %saot_interpret(cpu, run, (Instruction){0x%02x, 0x%02x, 0x%04x, 0x%02x, 0x%04x, 0x%02x, %u}, 0x%05x)%s\n",
+        last ? "" : "if (!", inst->opcode, inst->mode1, inst->operand1, inst->mode2, inst->operand2, inst->padding, inst->size, next, last ? ";" : ")\n        return;\n");
+
+    interpreted_count++;
+}
+
+void emit_fault_check(FILE *out, const char *check) {
+    fprintf(out, "        int status = %s;\n\n        if (status) {\n            aot_fault(cpu, run, status);\n\n            return;\n        }\n\n", check);
+}
+
+const char *special_register(uint16_t reg) {
+    switch (reg) {
+        case CS: return "cpu->cs";
+        case SS: return "cpu->ss";
+        case DS: return "cpu->ds";
+        case US: return "cpu->us";
+        case SP: return "cpu->sp";
+        case ES: return "cpu->es";
+        default: return NULL;
+    }
+}
+
+// Loads the second operand of an arithmetic instruction into value, checking a memory operand like the interpreter
+void emit_source(FILE *out, const Instruction *inst) {
+    if (inst->mode2 == MODE_VAL_IMM)
+        fprintf(out, "        uint16_t value = 0x%04x;\n", inst->operand2);
+    else if (is_reg(inst->operand2))
+        fprintf(out, "        uint16_t value = cpu->registers[%u];\n", inst->operand2);
+    else {
+        fprintf(out, "        uint32_t phys_addr = seg_offset(cpu->ds, 0x%04x);\n", inst->operand2);
+        emit_fault_check(out, "mem_check(cpu, phys_addr, ACCESS_DATA, PAGE_MMIO)");
+        fprintf(out, "        uint16_t value = mem_read(cpu, phys_addr);\n");
+    }
+}
+
+// The forms address_operand accepts
+bool address_valid(uint8_t mode, uint16_t operand) {
+    uint8_t base = mode >> MODE_BASE_SHIFT;
+
+    switch (mode & MODE_MASK) {
+        case MODE_VAL_IMM: return true;
+        case MODE_BASE_DISP: return is_reg(base);
+        case MODE_BASE_INDEX: return is_reg(base) && is_reg(operand);
+        case MODE_VAL_IND: case MODE_POST_INC: case MODE_PRE_DEC: return is_reg(operand);
+        default: return false;
+    }
+}
+
+// Emits the offset of a valid address operand and the register it writes back, if any
+int emit_address(FILE *out, uint8_t mode, uint16_t operand) {
+    uint8_t base = mode >> MODE_BASE_SHIFT;
+
+    switch (mode & MODE_MASK) {
+        case MODE_VAL_IMM: fprintf(out, "        uint16_t offset = 0x%04x;\n", operand); return -1;
+        case MODE_VAL_IND: fprintf(out, "        uint16_t offset = cpu->registers[%u];\n", operand); return -1;
+        case MODE_BASE_DISP: fprintf(out, "        uint16_t offset = cpu->registers[%u] + 0x%04x;\n", base, operand); return -1;
+        case MODE_BASE_INDEX: fprintf(out, "        uint16_t offset = cpu->registers[%u] + cpu->registers[%u];\n", base, operand); return -1;
+        case MODE_POST_INC: fprintf(out, "        uint16_t offset = cpu->registers[%u];\n", operand); return operand;
+        default: fprintf(out, "        uint16_t offset = cpu->registers[%u] - 2;\n", operand); return operand;
+    }
+}
+
+// Emits one instruction with the same checks, effects and order as exec_instruction; anything it
+// does not handle natively (or that the interpreter would reject) is handed to the interpreter
+void emit_instruction(FILE *out, uint32_t addr, const Instruction *inst, bool last) {
+    uint32_t next = addr + inst->size;
+    uint8_t op = inst->opcode;
+
+    emit_comment(out, addr, inst);
+    inst_count++;
+
+    if ((inst->mode1 > MODE_VAL_IND && op != ST) || (inst->mode2 > MODE_VAL_IND && op != LD && op != XCHG && op != CAS)) {
+        emit_interpret(out, inst, next, last);
+
+        return;
+    }
+
+    bool dest_reg = inst->mode1 == MODE_VAL_IND && is_reg(inst->operand1);
+    bool src_ok = inst->mode2 == MODE_VAL_IMM || is_reg(inst->operand2);
+
+    switch (op) {
+        case MOV: {
+            const char *dest = dest_reg ? NULL : special_register(inst->operand1);
+            const char *source = (inst->mode2 == MODE_VAL_IND) ? special_register(inst->operand2) : NULL;
+            char value[32];
+
+            // IP and anything above ID are invalid sources, which the interpreter reports
+            if ((!dest_reg && !dest) || (inst->mode2 == MODE_VAL_IND && !is_reg(inst->operand2) && !source
+                && inst->operand2 != ID && inst->operand2 != PC && inst->operand2 != FLAGS)) {
+                emit_interpret(out, inst, next, last);
+
+                return;
+            }
+
+            if (inst->mode2 == MODE_VAL_IMM)
+                snprintf(value, sizeof(value), "0x%04x", inst->operand2);
+            else if (source)
+                snprintf(value, sizeof(value), "%s", source);
+            else if (inst->operand2 == ID)
+                snprintf(value, sizeof(value), "cpu->core_id");
+            // the pc is this instruction's address and flags are never left pending inside a block
+            else if (inst->operand2 == PC)
+                snprintf(value, sizeof(value), "0x%04x", addr & 0xffff);
+            else if (inst->operand2 == FLAGS)
+                snprintf(value, sizeof(value), "cpu->flags");
+            else
+                snprintf(value, sizeof(value), "cpu->registers[%u]", inst->operand2);
+
+            fprintf(out, "    cpu->ip = 0x%02x;\n", op);
+
+            if (dest_reg)
+                fprintf(out, "    cpu->registers[%u] = %s;\n", inst->operand1, value);
+            else
+                fprintf(out, "    %s = %s;\n", dest, value);
+
+            break;
+        }
+
+        case LD:
+        case ST: {
+            uint8_t mode = (op == LD) ? inst->mode2 : inst->mode1;
+            uint16_t operand = (op == LD) ? inst->operand2 : inst->operand1;
+
+            if ((op == LD && !dest_reg) || (op == ST && inst->mode2 == MODE_VAL_IND && !is_reg(inst->operand2)) || !address_valid(mode, operand)) {
+                emit_interpret(out, inst, next, last);
+
+                return;
+            }
+
+            fprintf(out, "    cpu->ip = 0x%02x;\n\n    {\n", op);
+
+            int wb_reg = emit_address(out, mode, operand);
+
+            if (op == ST) {
+                if (inst->mode2 == MODE_VAL_IMM)
+                    fprintf(out, "        uint16_t value = 0x%04x;\n", inst->operand2);
+                else
+                    fprintf(out, "        uint16_t value = cpu->registers[%u];\n", inst->operand2);
+            }
+
+            fprintf(out, "        uint32_t phys_addr = seg_offset(cpu->ds, offset);\n");
+            emit_fault_check(out, op == LD ? "mem_check(cpu, phys_addr, PAGE_R, 0)" : "mem_check(cpu, phys_addr, PAGE_W, 0)");
+
+            if (op == LD)
+                fprintf(out, "        uint16_t value = mem_read(cpu, phys_addr);\n\n");
+            else
+                fprintf(out, "        mem_write(cpu, phys_addr, value);\n");
+
+            if (wb_reg >= 0)
+                fprintf(out, "        cpu->registers[%d] = %s;\n", wb_reg, ((mode & MODE_MASK) == MODE_POST_INC) ? "offset + 2" : "offset");
+
+            if (op == LD)
+                fprintf(out, "        cpu->registers[%u] = value;\n", inst->operand1);
+
+            fprintf(out, "    }\n\n");
+
+            break;
+        }
+
+        case PUSH: {
+            const char *value = NULL;
+            char buf[32];
+
+            if (inst->mode1 == MODE_VAL_IMM) {
+                snprintf(buf, sizeof(buf), "0x%04x", inst->operand1);
+                value = buf;
+            } else if (is_reg(inst->operand1)) {
+                snprintf(buf, sizeof(buf), "cpu->registers[%u]", inst->operand1);
+                value = buf;
+            } else if (inst->operand1 == FLAGS)
+                value = "cpu->flags";
+            else if (inst->operand1 == ID)
+                value = "cpu->core_id";
+            else if (inst->operand1 != SP)
+                value = special_register(inst->operand1);
+
+            if (!value) {
+                emit_interpret(out, inst, next, last);
+
+                return;
+            }
+
+            fprintf(out, "    cpu->ip = 0x%02x;\n    cpu_push(cpu, %s);\n", op, value);
+
+            break;
+        }
+
+        case POP: {
+            const char *dest = (inst->operand1 == SP) ? NULL : special_register(inst->operand1);
+
+            if (inst->mode1 != MODE_VAL_IND || (!is_reg(inst->operand1) && !dest)) {
+                emit_interpret(out, inst, next, last);
+
+                return;
+            }
+
+            fprintf(out, "    cpu->ip = 0x%02x;\n", op);
+
+            if (is_reg(inst->operand1))
+                fprintf(out, "    cpu->registers[%u] = cpu_pop(cpu);\n", inst->operand1);
+            else
+                fprintf(out, "    %s = cpu_pop(cpu);\n", dest);
+
+            break;
+        }
+
+        case ADD: case SUB: case AND: case OR: case XOR: case SHL: case SHR: case CMP:
+        case MUL: case MULH: case IMULH: case DIV: case IDIV: case MOD: case IMOD: {
+            bool divides = op == DIV || op == IDIV || op == MOD || op == IMOD;
+
+            // shift counts past the width and constant division by zero keep the interpreter's behaviour
+            if (!dest_reg || ((op == SHL || op == SHR) && inst->mode2 == MODE_VAL_IMM && inst->operand2 >= 16) || (divides && inst->mode2 == MODE_VAL_IMM && inst->operand2 == 0)) {
+                emit_interpret(out, inst, next, last);
+
+                return;
+            }
+
+            fprintf(out, "    cpu->ip = 0x%02x;\n\n    {\n", op);
+            emit_source(out, inst);
+
+            unsigned int d = inst->operand1;
+
+            switch (op) {
+                case ADD: fprintf(out, "\n        cpu->registers[%u] = cpu->registers[%u] + value;\n", d, d); break;
+                case SUB: fprintf(out, "\n        cpu->registers[%u] = cpu->registers[%u] - value;\n", d, d); break;
+                case AND: fprintf(out, "\n        cpu->registers[%u] &= value;\n", d); break;
+                case OR: fprintf(out, "\n        cpu->registers[%u] |= value;\n", d); break;
+                case XOR: fprintf(out, "\n        cpu->registers[%u] ^= value;\n", d); break;
+                case SHL: fprintf(out, "\n        cpu->registers[%u] = cpu->registers[%u] << value;\n", d, d); break;
+                case SHR: fprintf(out, "\n        cpu->registers[%u] = cpu->registers[%u] >> value;\n", d, d); break;
+
+                case CMP:
+                    fprintf(out, "        uint16_t current = cpu->registers[%u];\n\n", d);
+                    fprintf(out, "        cpu->flags &= ~(FLAG_EQUAL | FLAG_LESS | FLAG_GREATER | FLAG_ZERO);\n\n");
+                    fprintf(out, "        if (current == value)\n            cpu->flags |= FLAG_EQUAL | FLAG_ZERO;\n");
+                    fprintf(out, "        else if (current < value)\n            cpu->flags |= FLAG_LESS;\n");
+                    fprintf(out, "        else\n            cpu->flags |= FLAG_GREATER;\n");
+
+                    break;
+
+                default:
+                    fprintf(out, "        uint16_t current = cpu->registers[%u];\n", d);
+
+                    if (op == IDIV || op == IMOD)
+                        fprintf(out, "        bool overflow = (int16_t)current == INT16_MIN && (int16_t)value == -1;\n");
+
+                    if (divides)
+                        fprintf(out, "\n        if (value == 0) {\n            aot_fault(cpu, run, 6);\n\n            return;\n        }\n");
+
+                    fprintf(out, "\n        cpu->registers[%u] = ", d);
+
+                    switch (op) {
+                        case MUL: fprintf(out, "(uint16_t)((uint32_t)current * value);\n"); break;
+                        case MULH: fprintf(out, "(uint16_t)(((uint32_t)current * value) >> 16);\n"); break;
+                        case IMULH: fprintf(out, "(uint16_t)(((int32_t)(int16_t)current * (int16_t)value) >> 16);\n"); break;
+                        case DIV: fprintf(out, "current / value;\n"); break;
+                        case IDIV: fprintf(out, "overflow ? current : (uint16_t)((int16_t)current / (int16_t)value);\n"); break;
+                        case MOD: fprintf(out, "current %% value;\n"); break;
+                        default: fprintf(out, "overflow ? 0 : (uint16_t)((int16_t)current %% (int16_t)value);\n"); break;
+                    }
+
+                    break;
+            }
+
+            fprintf(out, "    }\n\n");
+
+            break;
+        }
+
+        case INC:
+        case DEC:
+        case NOT: {
+            if (!dest_reg) {
+                emit_interpret(out, inst, next, last);
+
+                return;
+            }
+
+            fprintf(out, "    cpu->ip = 0x%02x;\n", op);
+
+            if (op == NOT)
+                fprintf(out, "    cpu->registers[%u] = ~cpu->registers[%u];\n", inst->operand1, inst->operand1);
+            else
+                fprintf(out, "    cpu->registers[%u] = cpu->registers[%u] %c 1;\n", inst->operand1, inst->operand1, op == INC ? '+' : '-');
+
+            break;
+        }
+
+        case JMP:
+            fprintf(out, "    cpu->ip = 0x%02x;\n    cpu->pc = seg_offset(%s, 0x%04x);\n", op, segment_expr, inst->operand1);
+            emit_branch_retire(out);
+
+            return;
+
+        case JZ: case JNZ: case JE: case JNE: case JL: case JLE: case JG: case JGE: {
+            int cond = (op == JZ) ? 0 : op - JNZ + 1;
+
+            fprintf(out, "    cpu->ip = 0x%02x;\n    cpu->pc = (%s) ? seg_offset(%s, 0x%04x) : 0x%05x;\n", op, conditions[cond], segment_expr, inst->operand1, next);
+            emit_branch_retire(out);
+
+            return;
+        }
+
+        case LOOP:
+            if (!dest_reg) {
+                emit_interpret(out, inst, next, last);
+
+                return;
+            }
+
+            fprintf(out, "    cpu->ip = 0x%02x;\n    cpu->pc = (--cpu->registers[%u] != 0) ? seg_offset(%s, 0x%04x) : 0x%05x;\n", op, inst->operand1, segment_expr, inst->operand2, next);
+            emit_branch_retire(out);
+
+            return;
+
+        case CALL:
+            fprintf(out, "    cpu->ip = 0x%02x;\n\n    {\n", op);
+            fprintf(out, "        uint16_t return_offset = (uint16_t)0x%05x - (cpu->cs << SEG_SHIFT);\n", next);
+            fprintf(out, "        uint16_t target_offset = (uint16_t)0x%04x - (cpu->cs << SEG_SHIFT);\n", inst->operand1);
+            fprintf(out, "        uint16_t segment = %s;\n\n", segment_expr);
+            fprintf(out, "        cpu_push(cpu, return_offset);\n\n        cpu->pc = seg_offset(segment, target_offset);\n    }\n\n");
+            emit_branch_retire(out);
+
+            return;
+
+        case RET:
+            fprintf(out, "    cpu->ip = 0x%02x;\n\n    {\n        uint16_t offset = cpu_pop(cpu);\n\n", op);
+            fprintf(out, "        cpu->pc = seg_offset(%s, offset);\n    }\n\n", segment_expr);
+            emit_branch_retire(out);
+
+            return;
+
+        case CLI:
+        case STI:
+            fprintf(out, "    cpu->ip = 0x%02x;\n    cpu->flags %s FLAG_INT_ENABLED;\n", op, op == CLI ? "&= ~" : "|=");
+
+            break;
+
+        case CMOVZ: case CMOVNZ: case CMOVE: case CMOVNE: case CMOVL: case CMOVLE: case CMOVG: case CMOVGE:
+            if (!dest_reg || !src_ok) {
+                emit_interpret(out, inst, next, last);
+
+                return;
+            }
+
+            fprintf(out, "    cpu->ip = 0x%02x;\n\n    if (%s)\n        cpu->registers[%u] = ", op, conditions[op - CMOVZ], inst->operand1);
+
+            if (inst->mode2 == MODE_VAL_IMM)
+                fprintf(out, "0x%04x;\n\n", inst->operand2);
+            else
+                fprintf(out, "cpu->registers[%u];\n\n", inst->operand2);
+
+            break;
+
+        case SETZ: case SETNZ: case SETE: case SETNE: case SETL: case SETLE: case SETG: case SETGE:
+            if (!dest_reg) {
+                emit_interpret(out, inst, next, last);
+
+                return;
+            }
+
+            fprintf(out, "    cpu->ip = 0x%02x;\n    cpu->registers[%u] = (%s) ? 1 : 0;\n", op, inst->operand1, conditions[op - SETZ]);
+
+            break;
+
+        case NOP:
+            fprintf(out, "    cpu->ip = 0x%02x;\n", op);
+
+            break;
+
+        case HLT:
+            fprintf(out, "    cpu->ip = 0x%02x;\n    cpu->flags |= FLAG_HALTED;\n", op);
+
+            break;
+
+        default:
+            emit_interpret(out, inst, next, last);
+
+            return;
+    }
+
+    fprintf(out, "    cpu->pc = 0x%05x;\n", next);
+    emit_retire(out, next, last);
+}
+
+// Collects the instructions of the block starting at addr; it stops after anything that leaves the
+// straight line, before code it cannot decode, and before it would span more than a page
+void build_block(uint32_t addr) {
+    Block *block = &blocks[block_count];
+    uint32_t curr = addr;
+    bool ended = false;
+    Instruction inst;
+
+    block->addr = addr;
+    block->count = 0;
+
+    while (!ended && block->count < MAX_BLOCK_INSTS && decode(curr, &inst) && curr + inst.size - addr <= PAGE_SIZE) {
+        block->count++;
+        add_successors(curr, &inst);
+        curr += inst.size;
+        ended = ends_block(&inst);
+    }
+
+    if (block->count == 0)
+        return;
+
+    block->end = curr;
+
+    // a block cut short continues in another one
+    if (!ended)
+        add_leader(curr);
+
+    block_count++;
+}
+
+int compare_blocks(const void *a, const void *b) {
+    const Block *block_a = a;
+    const Block *block_b = b;
+
+    return (block_a->addr > block_b->addr) - (block_a->addr < block_b->addr);
+}
+
+void emit_block(FILE *out, const Block *block) {
+    uint32_t curr = block->addr;
+    Instruction inst;
+
+    fprintf(out, "static void block_%05x(CPU *cpu, AotRun *run) {\n", block->addr);
+
+    for (size_t i = 0; i < block->count; i++) {
+        decode(curr, &inst);
+        emit_instruction(out, curr, &inst, i == block->count - 1);
+        curr += inst.size;
+    }
+
+    fprintf(out, "}\n\n");
+}
+
+int write_source(const char *path, const char *name) {
+    FILE *out = fopen(path, "w");
+
+    if (!out) {
+        printf("Unable to create file %s\n", path);
+
+        return 1;
+    }
+
+    fprintf(out, "// Generated by hexa_aot from %s; link it into hexa by placing it in aot/\n#include \"aot.h\"\n\n", name);
+    fprintf(out, "static const uint8_t code[] = {");
+
+    for (uint32_t i = 0; i < code_size; i++)
+        fprintf(out, "%s0x%02x,", (i % 16 == 0) ? "\n    " : " ", code[i]);
+
+    fprintf(out, "\n};\n\n");
+
+    for (size_t i = 0; i < block_count; i++)
+        emit_block(out, &blocks[i]);
+
+    fprintf(out, "static const AotEntry entries[] = {\n");
+
+    for (size_t i = 0; i < block_count; i++)
+        fprintf(out, "    {0x%05x, 0x%05x, block_%05x},\n", blocks[i].addr, blocks[i].end - 1, blocks[i].addr);
+
+    fprintf(out, "};\n\nstatic const AotImage image = {\"%s\", 0x%05x, sizeof(code), code, entries, %zu};\n\n", name, code_addr, block_count);
+    fprintf(out, "__attribute__((constructor)) static void register_image() {\n    aot_register(&image);\n}\n");
+
+    if (fclose(out) != 0) {
+        printf("Failed to write %s\n", path);
+
+        return 1;
+    }
+
+    return 0;
+}
+
+// Labels from hexa_asm or hexa_ld maps are entry points too, which covers interrupt handlers and other code only reached through data
+bool read_map_entries(const char *path) {
+    FILE *file = fopen(path, "r");
+    char *line = NULL;
+    size_t line_cap = 0;
+
+    if (!file)
+        return false;
+
+    // read whole lines, so the tail of a long label is never taken for another address
+    while (getline(&line, &line_cap, file) != -1) {
+        unsigned int addr;
+
+        if (line[0] != ';' && sscanf(line, "%x", &addr) == 1)
+            add_leader(addr);
+    }
+
+    free(line);
+    fclose(file);
+
+    return true;
+}
+
+uint8_t *read_file(const char *path, size_t *size) {
+    FILE *file = fopen(path, "rb");
+
+    if (!file)
+        return NULL;
+
+    fseek(file, 0, SEEK_END);
+    *size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    uint8_t *data = malloc(*size ? *size : 1);
+
+    if (data && fread(data, 1, *size, file) != *size) {
+        free(data);
+        data = NULL;
+    }
+
+    fclose(file);
+
+    return data;
+}
+
+int main(int argc, char *argv[]) {
+    char *out_file = NULL;
+    char *in_file = NULL;
+    char *map_files[16];
+    uint32_t extra[MAX_ENTRIES];
+    size_t map_count = 0, extra_count = 0;
+    long segment = -1;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+            out_file = argv[++i];
+        else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc && map_count < 16)
+            map_files[map_count++] = argv[++i];
+        else if (strcmp(argv[i], "-e") == 0 && i + 1 < argc && extra_count < MAX_ENTRIES)
+            extra[extra_count++] = strtoul(argv[++i], NULL, 0);
+        else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc)
+            segment = strtol(argv[++i], NULL, 0) & 0xffff;
+        else
+            in_file = argv[i];
+    }
+
+    if (out_file == NULL || in_file == NULL) {
+        printf("Usage: hexa_aot -o <file.c> [-m <file.map>] [-e <addr>] [-s <segment>] <file.bin>\n");
+
+        return 1;
+    }
+
+    size_t file_size;
+    uint8_t *image = read_file(in_file, &file_size);
+
+    if (!image) {
+        printf("Unable to read file %s\n", in_file);
+
+        return 1;
+    }
+
+    uint32_t size = (file_size > IMAGE_HEADER_SIZE) ? ((image[6] << 16) | (image[7] << 8) | image[8]) & ADDR_MASK : 0;
+
+    if (image[0] != 0x88 || image[1] != 0xcc || size <= IMAGE_HEADER_SIZE || size > file_size) {
+        printf("%s is not a Hexa image\n", in_file);
+
+        return 1;
+    }
+
+    code = image + IMAGE_HEADER_SIZE;
+    code_addr = ((image[2] << 16) | (image[3] << 8) | image[4]) & ADDR_MASK;
+    code_size = size - IMAGE_HEADER_SIZE;
+
+    // load_bios wraps the rest of an image to address 0, which is not worth compiling
+    if (code_size > MEM_SIZE - code_addr)
+        code_size = MEM_SIZE - code_addr;
+
+    code_segment = (segment >= 0) ? segment : (code_addr & 0xf0000) >> SEG_SHIFT;
+
+    pending = malloc(MEM_SIZE * sizeof(uint32_t));
+    blocks = malloc(MEM_SIZE * sizeof(Block));
+
+    if (!pending || !blocks) {
+        printf("Memory allocation failed\n");
+
+        return 1;
+    }
+
+    add_leader(code_addr);
+
+    for (size_t i = 0; i < extra_count; i++)
+        add_leader(extra[i]);
+
+    for (size_t i = 0; i < map_count; i++) {
+        if (!read_map_entries(map_files[i])) {
+            printf("Unable to read map %s\n", map_files[i]);
+
+            return 1;
+        }
+    }
+
+    while (pending_count > 0)
+        build_block(pending[--pending_count]);
+
+    qsort(blocks, block_count, sizeof(Block), compare_blocks);
+
+    const char *name = strrchr(in_file, '/') ? strrchr(in_file, '/') + 1 : in_file;
+
+    if (write_source(out_file, name))
+        return 1;
+
+    printf("Compiled %zu block(s), %zu instruction(s) (%zu through the interpreter) from %s into %s\n", block_count, inst_count, interpreted_count, in_file, out_file);
+
+    free(pending);
+    free(blocks);
+    free(image);
+
+    return 0;
+}
@@ -1,17 +1,69 @@
 #include "serial.h"
+#include "smp.h"
+
+bool set_serial_pattern(Machine *machine, const char *pattern) {
+    size_t len = strlen(pattern);
+
+    if (len == 0 || len > MAX_SERIAL_PATTERN)
+        return false;
+
+    memcpy(machine->serial_pattern, pattern, len);
+    machine->serial_pattern_len = len;
+    machine->serial_history_len = 0;
+    machine->serial_pattern_seen = false;
+
+    return true;
+}
+
+void match_serial(Machine *machine, uint8_t data) {
+    char *history = machine->serial_history;
+
+    if (machine->serial_history_len == machine->serial_pattern_len) {
+        memmove(history, history + 1, machine->serial_history_len - 1);
+        machine->serial_history_len--;
+    }
+
+    history[machine->serial_history_len++] = data;
+
+    if (machine->serial_history_len == machine->serial_pattern_len && memcmp(history, machine->serial_pattern, machine->serial_pattern_len) == 0)
+        machine->serial_pattern_seen = true;
+}
 
 void poll_serial(CPU *cpu) {
+    Machine *machine = cpu->machine;
     uint8_t *status = &cpu->memory[SERIAL_STATUS];
     uint8_t data = cpu->memory[SERIAL_DATA];
     
     if (!((*status & SERIAL_STATUS_NEW_DATA) && (*status & SERIAL_STATUS_TX_READY)))
         return;
 
+    // another core may be writing SERIAL_DATA, so check again under the device lock
+    device_lock(machine);
+
+    data = cpu->memory[SERIAL_DATA];
+
+    if (!((*status & SERIAL_STATUS_NEW_DATA) && (*status & SERIAL_STATUS_TX_READY))) {
+        device_unlock(machine);
+
+        return;
+    }
+
     *status &= ~SERIAL_STATUS_TX_READY;
 
-    putchar(data);
-    fflush(stdout);
+    stat_add(&machine->stats->serial_bytes, 1);
+
+    if (machine->callbacks.serial_out)
+        machine->callbacks.serial_out(machine->callbacks.user, data);
+    else {
+        putchar(data);
+        fflush(stdout);
+    }
+
+    if (machine->serial_pattern_len)
+        match_serial(machine, data);
 
     *status &= ~SERIAL_STATUS_NEW_DATA;
     *status |= SERIAL_STATUS_TX_READY;
+
+    device_unlock(machine);
 }
\ No newline at end of file
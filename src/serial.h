@@ -4,5 +4,6 @@
 #include "common.h"
 
 void poll_serial(CPU *cpu);
+bool set_serial_pattern(Machine *machine, const char *pattern);
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,109 @@
+#include "smp.h"
+#include "memory.h"
+
+bool init_device_lock(Machine *machine) {
+    pthread_mutexattr_t attr;
+    bool ok;
+
+    // a DMA transfer into the device page re-enters mmio_write while the scheduler holds the lock
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    ok = pthread_mutex_init(&machine->device_mutex, &attr) == 0;
+    pthread_mutexattr_destroy(&attr);
+
+    return ok;
+}
+
+void device_lock(Machine *machine) {
+    pthread_mutex_lock(&machine->device_mutex);
+}
+
+void device_unlock(Machine *machine) {
+    pthread_mutex_unlock(&machine->device_mutex);
+}
+
+uint16_t smp_reg(CPU *cpu, uint32_t addr) {
+    return (cpu->memory[addr] << 8) | cpu->memory[addr + 1];
+}
+
+void smp_set_reg(CPU *cpu, uint32_t addr, uint16_t value) {
+    cpu->memory[addr] = (value >> 8) & 0xff;
+    cpu->memory[addr + 1] = value & 0xff;
+}
+
+bool smp_init(Machine *machine, uint16_t count) {
+    if (count < 1 || count > MAX_CORES)
+        return false;
+
+    machine->core_count = count;
+
+    // application cores share the boot core's memory and wait halted until it starts them
+    for (uint16_t i = 1; i < count; i++) {
+        CPU *core = &machine->cores[i];
+
+        core->core_id = i;
+        core->machine = machine;
+        core->memory = machine->memory;
+        core->flags = FLAG_INT_DONE | FLAG_HALTED;
+
+        update_pages(core);
+    }
+
+    smp_set_reg(&machine->cores[0], SMP_CORE_COUNT, count);
+
+    return true;
+}
+
+void smp_write(CPU *cpu, uint32_t addr, uint16_t value) {
+    Machine *machine = cpu->machine;
+
+    if (addr == SMP_CORE_COUNT) {
+        smp_set_reg(cpu, SMP_CORE_COUNT, machine->core_count);
+
+        return;
+    }
+
+    if (addr != SMP_START && addr != SMP_IPI)
+        return;
+
+    uint32_t start = ((uint32_t)smp_reg(cpu, SMP_START_SEG) << 16) | smp_reg(cpu, SMP_START_OFF);
+
+    smp_set_reg(cpu, addr, 0);
+
+    for (uint16_t i = 0; i < machine->core_count; i++) {
+        CPU *core = &machine->cores[i];
+
+        if (!(value & (1 << i)))
+            continue;
+
+        if (addr == SMP_IPI) {
+            atomic_fetch_or(&core->signals, SIGNAL_IPI);
+
+            continue;
+        }
+
+        if (i == cpu->core_id)
+            continue;
+
+        atomic_store(&core->start_addr, start);
+        atomic_fetch_or(&core->signals, SIGNAL_START);
+    }
+}
+
+void smp_signal(CPU *cpu) {
+    unsigned int signals = atomic_load_explicit(&cpu->signals, memory_order_acquire);
+
+    if (signals & SIGNAL_START) {
+        uint32_t start = atomic_load(&cpu->start_addr);
+
+        atomic_fetch_and(&cpu->signals, ~SIGNAL_START);
+
+        cpu->cs = start >> 16;
+        cpu->pc = seg_offset(cpu->cs, start & 0xffff);
+        write_flags(cpu, FLAG_INT_DONE);
+    }
+
+    // like device interrupts, an IPI stays pending until the core is able to take it
+    if ((signals & SIGNAL_IPI) && cpu_interrupt(cpu, IPI_IRQ))
+        atomic_fetch_and(&cpu->signals, ~SIGNAL_IPI);
+}
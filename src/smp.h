@@ -0,0 +1,19 @@
+#ifndef SMP_H
+#define SMP_H
+
+#include "common.h"
+
+bool init_device_lock(Machine *machine);
+void device_lock(Machine *machine);
+void device_unlock(Machine *machine);
+bool smp_init(Machine *machine, uint16_t count);
+void smp_write(CPU *cpu, uint32_t addr, uint16_t value);
+void smp_signal(CPU *cpu);
+
+// Checked once per instruction, so the common case is a single load of the core's own signal word
+static inline void smp_poll(CPU *cpu) {
+    if (atomic_load_explicit(&cpu->signals, memory_order_acquire))
+        smp_signal(cpu);
+}
+
+#endif